@@ -238,7 +238,7 @@ build_3rdparty_autogen SDL "--disable-video-x11 --enable-video-wayland --disable
 build_3rdparty_autogen qemu "--python=$PYTHON_BIN \
         --audio-drv-list=pa --target-list=aarch64-softmmu,x86_64-softmmu \
         --enable-strip --enable-virtiofsd --enable-opengl --enable-virglrenderer --enable-slirp \
-        --enable-sdl --disable-spice --disable-werror --cross-prefix=$ARCH_TRIPLET-"
+        --enable-sdl --enable-dbus-display --disable-spice --disable-werror --cross-prefix=$ARCH_TRIPLET-"
 
 # Attempt to strip binaries manually for improved file sizes
 # Some files might be shell scripts so fail gracefully
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "image_scaler.h"
+
+#include <QImage>
+#include <QPainter>
+#include <QtTest>
+
+using namespace LomiriVNC;
+
+/* Compares the CPU scaling used without OpenGL to what QPainter does for a
+ * smooth transformed drawImage(), and the RGB16 conversion to QImage's.
+ * scaleMatches checks the vectorized scaler against a plain per pixel
+ * bilinear interpolation, and that scaling damaged areas one at a time
+ * gives the same image as scaling all of it. */
+class ImageScalerBenchmark: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void scaleMatches_data();
+    void scaleMatches();
+    void scale_data();
+    void scale();
+    void painter_data();
+    void painter();
+    void convertRgb16_data();
+    void convertRgb16();
+    void convertToFormat_data();
+    void convertToFormat();
+
+private:
+    static void addScaleRows();
+    static QImage sourceImage(const QSize &size, QImage::Format format);
+    static QImage referenceScale(const QImage &source, const QSize &size);
+    static int maxDifference(const QImage &a, const QImage &b);
+};
+
+void ImageScalerBenchmark::addScaleRows()
+{
+    QTest::addColumn<QSize>("sourceSize");
+    QTest::addColumn<QSize>("targetSize");
+    QTest::addColumn<int>("format");
+
+    static const struct {
+        QSize source;
+        QSize target;
+    } sizes[] = {
+        { QSize(800, 600), QSize(720, 540) },
+        { QSize(1024, 768), QSize(720, 540) },
+        { QSize(1920, 1080), QSize(1080, 608) },
+        { QSize(1920, 1080), QSize(2560, 1440) },
+    };
+    for (const auto &s: sizes) {
+        for (QImage::Format format: { QImage::Format_RGB32,
+                                      QImage::Format_RGB16 }) {
+            QTest::addRow("%dx%d->%dx%d %s",
+                          s.source.width(), s.source.height(),
+                          s.target.width(), s.target.height(),
+                          format == QImage::Format_RGB16 ? "rgb16" : "rgb32")
+                << s.source << s.target << int(format);
+        }
+    }
+}
+
+QImage ImageScalerBenchmark::sourceImage(const QSize &size,
+                                         QImage::Format format)
+{
+    QImage image(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); y++) {
+        QRgb *line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < size.width(); x++) {
+            line[x] = qRgb(x * 7, y * 5, (x ^ y) * 3);
+        }
+    }
+    return image.convertToFormat(format);
+}
+
+QImage ImageScalerBenchmark::referenceScale(const QImage &source,
+                                            const QSize &size)
+{
+    /* Same sampling positions and 7 bit weights as ImageScaler, one pixel
+     * and one channel at a time */
+    const QImage rgb32 = source.convertToFormat(QImage::Format_RGB32);
+    auto sourcePos = [](int i, int sourceSize, int targetSize) -> int {
+        const double scale = double(sourceSize) / targetSize;
+        double pos = (i + 0.5) * scale - 0.5;
+        pos = qBound(0.0, pos, sourceSize - 1.0);
+        return int(pos * 128 + 0.5);
+    };
+    auto blend = [](QRgb a, QRgb b, int weight) -> QRgb {
+        QRgb result = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            const int ca = (a >> shift) & 0xff;
+            const int cb = (b >> shift) & 0xff;
+            result |= QRgb(((ca * (128 - weight) + cb * weight) >> 7)) << shift;
+        }
+        return result;
+    };
+
+    QImage target(size, QImage::Format_RGB32);
+    for (int y = 0; y < size.height(); y++) {
+        const int py = sourcePos(y, source.height(), size.height());
+        const int y0 = py >> 7;
+        const int y1 = qMin(y0 + 1, source.height() - 1);
+        const QRgb *top = reinterpret_cast<const QRgb*>(rgb32.constScanLine(y0));
+        const QRgb *bottom = reinterpret_cast<const QRgb*>(rgb32.constScanLine(y1));
+        QRgb *line = reinterpret_cast<QRgb*>(target.scanLine(y));
+        for (int x = 0; x < size.width(); x++) {
+            const int px = sourcePos(x, source.width(), size.width());
+            const int x0 = px >> 7;
+            const int x1 = qMin(x0 + 1, source.width() - 1);
+            line[x] = blend(blend(top[x0], bottom[x0], py & 127),
+                            blend(top[x1], bottom[x1], py & 127), px & 127);
+        }
+    }
+    return target;
+}
+
+int ImageScalerBenchmark::maxDifference(const QImage &a, const QImage &b)
+{
+    int difference = 0;
+    for (int y = 0; y < a.height(); y++) {
+        const QRgb *la = reinterpret_cast<const QRgb*>(a.constScanLine(y));
+        const QRgb *lb = reinterpret_cast<const QRgb*>(b.constScanLine(y));
+        for (int x = 0; x < a.width(); x++) {
+            for (int shift = 0; shift < 32; shift += 8) {
+                difference = qMax(difference,
+                                  qAbs(int((la[x] >> shift) & 0xff) -
+                                       int((lb[x] >> shift) & 0xff)));
+            }
+        }
+    }
+    return difference;
+}
+
+void ImageScalerBenchmark::scaleMatches_data()
+{
+    QTest::addColumn<QSize>("sourceSize");
+    QTest::addColumn<QSize>("targetSize");
+    QTest::addColumn<int>("format");
+
+    /* Odd widths leave a remainder after every vector loop */
+    static const struct {
+        QSize source;
+        QSize target;
+    } sizes[] = {
+        { QSize(333, 217), QSize(161, 97) },
+        { QSize(175, 113), QSize(401, 263) },
+        { QSize(97, 61), QSize(97, 61) },
+        { QSize(640, 3), QSize(7, 5) },
+    };
+    for (const auto &s: sizes) {
+        for (QImage::Format format: { QImage::Format_RGB32,
+                                      QImage::Format_RGB16 }) {
+            QTest::addRow("%dx%d->%dx%d %s",
+                          s.source.width(), s.source.height(),
+                          s.target.width(), s.target.height(),
+                          format == QImage::Format_RGB16 ? "rgb16" : "rgb32")
+                << s.source << s.target << int(format);
+        }
+    }
+}
+
+void ImageScalerBenchmark::scaleMatches()
+{
+    QFETCH(QSize, sourceSize);
+    QFETCH(QSize, targetSize);
+    QFETCH(int, format);
+
+    const QImage source = sourceImage(sourceSize, QImage::Format(format));
+    QImage target(targetSize, ImageScaler::targetFormat(source.format()));
+    QVERIFY(ImageScaler::scale(source, source.rect(), &target,
+                               target.rect(), true));
+    QVERIFY(maxDifference(target, referenceScale(source, targetSize)) <= 1);
+
+    /* Damage rects of odd sizes, clipped at the right and bottom edges */
+    QImage damaged(targetSize, target.format());
+    damaged.fill(0);
+    for (int y = 0; y < targetSize.height(); y += 7) {
+        for (int x = 0; x < targetSize.width(); x += 13) {
+            QVERIFY(ImageScaler::scale(source, source.rect(), &damaged,
+                                       QRect(x, y, 13, 7), true));
+        }
+    }
+    QCOMPARE(damaged, target);
+}
+
+void ImageScalerBenchmark::scale_data()
+{
+    addScaleRows();
+}
+
+void ImageScalerBenchmark::scale()
+{
+    QFETCH(QSize, sourceSize);
+    QFETCH(QSize, targetSize);
+    QFETCH(int, format);
+
+    const QImage source = sourceImage(sourceSize, QImage::Format(format));
+    QImage target(targetSize, ImageScaler::targetFormat(source.format()));
+    QBENCHMARK {
+        ImageScaler::scale(source, source.rect(), &target, target.rect(), true);
+    }
+}
+
+void ImageScalerBenchmark::painter_data()
+{
+    addScaleRows();
+}
+
+void ImageScalerBenchmark::painter()
+{
+    QFETCH(QSize, sourceSize);
+    QFETCH(QSize, targetSize);
+    QFETCH(int, format);
+
+    const QImage source = sourceImage(sourceSize, QImage::Format(format));
+    QImage target(targetSize, QImage::Format_RGB32);
+    QBENCHMARK {
+        QPainter painter(&target);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.drawImage(QRectF(target.rect()), source, QRectF(source.rect()));
+    }
+}
+
+void ImageScalerBenchmark::convertRgb16_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::newRow("800x600") << QSize(800, 600);
+    QTest::newRow("1920x1080") << QSize(1920, 1080);
+}
+
+void ImageScalerBenchmark::convertRgb16()
+{
+    QFETCH(QSize, size);
+
+    const QImage source = sourceImage(size, QImage::Format_RGB16);
+    QImage target(size, QImage::Format_RGB32);
+    QBENCHMARK {
+        for (int y = 0; y < size.height(); y++) {
+            ImageScaler::convertRgb16(
+                reinterpret_cast<const quint16*>(source.constScanLine(y)),
+                reinterpret_cast<quint32*>(target.scanLine(y)),
+                size.width());
+        }
+    }
+    QCOMPARE(target, source.convertToFormat(QImage::Format_RGB32));
+}
+
+void ImageScalerBenchmark::convertToFormat_data()
+{
+    convertRgb16_data();
+}
+
+void ImageScalerBenchmark::convertToFormat()
+{
+    QFETCH(QSize, size);
+
+    const QImage source = sourceImage(size, QImage::Format_RGB16);
+    QImage target;
+    QBENCHMARK {
+        target = source.convertToFormat(QImage::Format_RGB32);
+    }
+}
+
+QTEST_GUILESS_MAIN(ImageScalerBenchmark)
+
+#include "image_scaler_benchmark.moc"
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "scaler.h"
+
+#include <QtTest>
+
+using namespace LomiriVNC;
+
+/* Scaler::updateMapping() runs on every geometry change and pinch step */
+class ScalerTest: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void updateMapping_data();
+    void updateMapping();
+    void computeFitOffset_data();
+    void computeFitOffset();
+};
+
+void ScalerTest::updateMapping_data()
+{
+    QTest::addColumn<QSizeF>("sourceSize");
+    QTest::addColumn<QSizeF>("itemSize");
+    QTest::addColumn<double>("scale");
+    QTest::addColumn<QPointF>("center");
+
+    QTest::newRow("fit") <<
+        QSizeF(1280, 800) << QSizeF(720, 1280) << 0.0 << QPointF();
+    QTest::newRow("1:1") <<
+        QSizeF(1280, 800) << QSizeF(1280, 800) << 1.0 << QPointF();
+    QTest::newRow("zoomed") <<
+        QSizeF(1920, 1080) << QSizeF(720, 1280) << 2.5 << QPointF(300, -100);
+    QTest::newRow("panned out") <<
+        QSizeF(1920, 1080) << QSizeF(1080, 1920) << 1.0 << QPointF(5000, 5000);
+}
+
+void ScalerTest::updateMapping()
+{
+    QFETCH(QSizeF, sourceSize);
+    QFETCH(QSizeF, itemSize);
+    QFETCH(double, scale);
+    QFETCH(QPointF, center);
+
+    const Scaler::InputData in = { sourceSize, itemSize, scale, center };
+    Scaler::OutputData out;
+    bool ok = false;
+    QBENCHMARK {
+        ok = Scaler::updateMapping(in, &out);
+    }
+    QVERIFY(ok);
+    QVERIFY(QRectF(QPointF(0, 0), itemSize).contains(out.itemPaintedRect));
+}
+
+void ScalerTest::computeFitOffset_data()
+{
+    QTest::addColumn<QRectF>("view");
+    QTest::addColumn<QSizeF>("objectSize");
+
+    QTest::newRow("centered") <<
+        QRectF(-100, -50, 1000, 800) << QSizeF(800, 600);
+    QTest::newRow("clipped") <<
+        QRectF(300, 200, 400, 300) << QSizeF(800, 600);
+    QTest::newRow("outside") <<
+        QRectF(900, 700, 400, 300) << QSizeF(800, 600);
+}
+
+void ScalerTest::computeFitOffset()
+{
+    QFETCH(QRectF, view);
+    QFETCH(QSizeF, objectSize);
+
+    QPointF offset;
+    QBENCHMARK {
+        offset = Scaler::computeFitOffset(view, objectSize);
+    }
+    const QRectF fitted = view.translated(offset);
+    QVERIFY(fitted.contains(QRectF(QPointF(0, 0), objectSize)) ||
+            QRectF(QPointF(0, 0), objectSize).contains(fitted));
+}
+
+QTEST_APPLESS_MAIN(ScalerTest)
+
+#include "scaler_benchmark.moc"
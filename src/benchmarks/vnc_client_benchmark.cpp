@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "image_scaler.h"
+#include "rfb_recorder.h"
+#include "vnc_client.h"
+
+#include <QFile>
+#include <QImage>
+#include <QPainter>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtEndian>
+#include <QtTest>
+
+using namespace LomiriVNC;
+
+/* Everything a server sends during a session: handshake, a full update,
+ * then `frames` updates of four moving rects covering an eighth of the
+ * screen */
+static QByteArray makeSession(const QSize &size, int bytesPerPixel, int frames)
+{
+    QByteArray data;
+    auto u8 = [&data](quint8 v) { data.append(char(v)); };
+    auto u16 = [&data](quint16 v) {
+        v = qToBigEndian(v);
+        data.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    auto u32 = [&data](quint32 v) {
+        v = qToBigEndian(v);
+        data.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    auto rawRect = [&](const QRect &rect, int seed) {
+        u16(rect.x()); u16(rect.y()); u16(rect.width()); u16(rect.height());
+        u32(0); /* Raw */
+        const int length = rect.width() * bytesPerPixel;
+        for (int y = 0; y < rect.height(); y++) {
+            data.append(QByteArray(length, char(seed + y)));
+        }
+    };
+
+    data.append("RFB 003.008\n");
+    /* No authentication, which succeeded */
+    u8(1); u8(1);
+    u32(0);
+
+    /* ServerInit */
+    u16(size.width()); u16(size.height());
+    const bool low = bytesPerPixel == 2;
+    u8(bytesPerPixel * 8); u8(low ? 16 : 24); u8(0); u8(1);
+    u16(low ? 31 : 255); u16(low ? 63 : 255); u16(low ? 31 : 255);
+    u8(low ? 11 : 16); u8(low ? 5 : 8); u8(0);
+    u8(0); u8(0); u8(0);
+    const QByteArray name("benchmark");
+    u32(name.size());
+    data.append(name);
+
+    u8(0); u8(0); u16(1);
+    rawRect(QRect(QPoint(0, 0), size), 0);
+
+    const QSize rectSize(size.width() / 4, size.height() / 8);
+    for (int i = 1; i <= frames; i++) {
+        u8(0); u8(0); u16(4);
+        for (int k = 0; k < 4; k++) {
+            const QPoint pos(
+                (i * 37 + k * rectSize.width()) %
+                    (size.width() - rectSize.width()),
+                (i * rectSize.height() / 2 + k * size.height() / 4) %
+                    (size.height() - rectSize.height()));
+            rawRect(QRect(pos, rectSize), i * 4 + k);
+        }
+    }
+    return data;
+}
+
+/* Stores the session as if it had been recorded from a socket */
+static bool writeRecording(const QString &fileName, const QByteArray &session,
+                           int bytesPerPixel)
+{
+    QFile file(fileName);
+    RfbRecording recording(&file);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        !recording.writeHeader(bytesPerPixel)) {
+        return false;
+    }
+    static const int chunkSize = 64 * 1024;
+    for (int i = 0; i < session.size(); i += chunkSize) {
+        if (!recording.writeChunk(0, session.constData() + i,
+                                  qMin(chunkSize, session.size() - i))) {
+            return false;
+        }
+    }
+    return recording.finish();
+}
+
+/* Decoding in VncClient, and painting the result the way VncOutput does
+ * without OpenGL, at the resolutions and scales seen on phones. Recordings
+ * of real sessions can be replayed too, by setting PVMS_RFB_RECORDING to
+ * the file name. */
+class VncClientBenchmark: public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase();
+    void replay_data();
+    void replay();
+    void recording();
+    void paint_data();
+    void paint();
+
+private:
+    static bool replaySession(VncClient *client, const QString &fileName);
+
+    QTemporaryDir m_dir;
+};
+
+static const int Frames = 30;
+
+void VncClientBenchmark::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+}
+
+bool VncClientBenchmark::replaySession(VncClient *client,
+                                       const QString &fileName)
+{
+    QSignalSpy ended(client, &VncClient::replayFinished);
+    if (!client->replay(fileName, false)) return false;
+    const bool ok = ended.wait(30000);
+    /* Let the last frame reach the GUI thread */
+    QCoreApplication::processEvents();
+    return ok;
+}
+
+void VncClientBenchmark::replay_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<bool>("lowColorDepth");
+
+    for (const QSize &size: { QSize(800, 600), QSize(1280, 720),
+                              QSize(1920, 1080) }) {
+        for (bool low: { false, true }) {
+            QTest::addRow("%dx%d %dbpp", size.width(), size.height(),
+                          low ? 16 : 32) << size << low;
+        }
+    }
+}
+
+void VncClientBenchmark::replay()
+{
+    QFETCH(QSize, size);
+    QFETCH(bool, lowColorDepth);
+
+    const int bytesPerPixel = lowColorDepth ? 2 : 4;
+    const QString fileName = m_dir.filePath("session.rfb");
+    QVERIFY(writeRecording(fileName,
+                           makeSession(size, bytesPerPixel, Frames),
+                           bytesPerPixel));
+    VncClient client;
+
+    /* Each run is a whole session: connection, then all the updates */
+    QBENCHMARK {
+        QVERIFY(replaySession(&client, fileName));
+    }
+    QCOMPARE(client.image().size(), size);
+}
+
+void VncClientBenchmark::recording()
+{
+    const QString fileName = qEnvironmentVariable("PVMS_RFB_RECORDING");
+    if (fileName.isEmpty()) {
+        QSKIP("PVMS_RFB_RECORDING is not set");
+    }
+
+    VncClient client;
+    QBENCHMARK {
+        QVERIFY(replaySession(&client, fileName));
+    }
+}
+
+void VncClientBenchmark::paint_data()
+{
+    QTest::addColumn<QSize>("size");
+    QTest::addColumn<double>("scale");
+    QTest::addColumn<bool>("painter");
+
+    for (const QSize &size: { QSize(1280, 720), QSize(1920, 1080) }) {
+        for (double scale: { 0.5, 0.75, 1.5 }) {
+            for (bool painter: { false, true }) {
+                QTest::addRow("%dx%d x%.2f %s", size.width(), size.height(),
+                              scale, painter ? "qpainter" : "scaler")
+                    << size << scale << painter;
+            }
+        }
+    }
+}
+
+void VncClientBenchmark::paint()
+{
+    QFETCH(QSize, size);
+    QFETCH(double, scale);
+    QFETCH(bool, painter);
+
+    const QString fileName = m_dir.filePath("frame.rfb");
+    QVERIFY(writeRecording(fileName, makeSession(size, 4, 0), 4));
+    VncClient client;
+    QVERIFY(replaySession(&client, fileName));
+    const QImage image = client.image();
+    QCOMPARE(image.size(), size);
+
+    QImage target((QSizeF(size) * scale).toSize(),
+                  ImageScaler::targetFormat(image.format()));
+    QBENCHMARK {
+        if (painter) {
+            QPainter p(&target);
+            p.setRenderHint(QPainter::SmoothPixmapTransform);
+            p.drawImage(QRectF(target.rect()), image, QRectF(image.rect()));
+        } else {
+            ImageScaler::scale(image, image.rect(), &target, target.rect(),
+                               true);
+        }
+    }
+}
+
+QTEST_MAIN(VncClientBenchmark)
+
+#include "vnc_client_benchmark.moc"
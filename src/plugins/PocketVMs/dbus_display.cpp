@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dbus_display.h"
+
+#include <QDBusConnection>
+#include <QDBusConnectionInterface>
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QDBusServiceWatcher>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace LomiriVNC;
+
+static const QString QEMU_SERVICE = QStringLiteral("org.qemu");
+static const QString CONSOLE_PATH = QStringLiteral("/org/qemu/Display1/Console_0");
+static const QString CONSOLE_INTERFACE = QStringLiteral("org.qemu.Display1.Console");
+static const QString LISTENER_PATH = QStringLiteral("/org/qemu/Display1/Listener");
+static const QString MAP_INTERFACE = QStringLiteral("org.qemu.Display1.Listener.Unix.Map");
+
+// Subset of pixman_format_code_t, as sent by QEMU
+static const uint PIXMAN_x8r8g8b8 = 0x20020888;
+static const uint PIXMAN_a8r8g8b8 = 0x20028888;
+static const uint PIXMAN_x8b8g8r8 = 0x20030888;
+static const uint PIXMAN_a8b8g8r8 = 0x20038888;
+static const uint PIXMAN_r5g6b5 = 0x10020565;
+
+DBusDisplay::DBusDisplay(QObject *parent):
+    QObject(parent),
+    m_watcher(nullptr),
+    m_attached(false),
+    m_map(nullptr),
+    m_mapSize(0)
+{
+    new DBusDisplayListenerAdaptor(this);
+    new DBusDisplayMapAdaptor(this);
+}
+
+DBusDisplay::~DBusDisplay()
+{
+    detach();
+}
+
+bool DBusDisplay::attach(const QString &busAddress)
+{
+    // Already attached or waiting for QEMU
+    if (!m_busName.isEmpty())
+        return true;
+
+    static int counter = 0;
+    m_busName = QStringLiteral("pvms-display-bus-%1").arg(++counter);
+
+    // The listener socket is created next to the bus socket
+    m_listenerPath = QStringLiteral("%1/display-listener-%2.sock").arg(QDir::tempPath()).arg(counter);
+    if (busAddress.startsWith(QStringLiteral("unix:path="))) {
+        const QFileInfo busSocket(busAddress.mid(strlen("unix:path=")));
+        m_listenerPath = QStringLiteral("%1/display-listener.sock").arg(busSocket.absolutePath());
+    }
+
+    QDBusConnection bus = QDBusConnection::connectToBus(busAddress, m_busName);
+    if (!bus.isConnected()) {
+        qWarning() << "Failed to connect to display bus" << busAddress << bus.lastError().message();
+        detach();
+        return false;
+    }
+
+    m_watcher = new QDBusServiceWatcher(QEMU_SERVICE, bus,
+                                        QDBusServiceWatcher::WatchForRegistration, this);
+    QObject::connect(m_watcher, &QDBusServiceWatcher::serviceRegistered, this, [=]() {
+        registerListener();
+    });
+
+    if (bus.interface()->isServiceRegistered(QEMU_SERVICE).value())
+        registerListener();
+
+    return true;
+}
+
+void DBusDisplay::detach()
+{
+    delete m_watcher;
+    m_watcher = nullptr;
+
+    if (!m_peerName.isEmpty()) {
+        QDBusConnection::disconnectFromPeer(m_peerName);
+        m_peerName.clear();
+    }
+    if (!m_busName.isEmpty()) {
+        QDBusConnection::disconnectFromBus(m_busName);
+        m_busName.clear();
+    }
+
+    unmap();
+    m_image = QImage();
+    setAttached(false);
+}
+
+bool DBusDisplay::isAttached() const
+{
+    return m_attached;
+}
+
+const QImage &DBusDisplay::image() const
+{
+    return m_image;
+}
+
+void DBusDisplay::setUiInfo(const QSize &size)
+{
+    if (!m_attached)
+        return;
+
+    // The physical size is unknown, QEMU derives it from the DPI then
+    QDBusMessage call = QDBusMessage::createMethodCall(QEMU_SERVICE, CONSOLE_PATH,
+                                                       CONSOLE_INTERFACE,
+                                                       QStringLiteral("SetUIInfo"));
+    call << QVariant::fromValue(quint16(0)) << QVariant::fromValue(quint16(0))
+         << 0 << 0 << uint(size.width()) << uint(size.height());
+
+    QDBusConnection bus(m_busName);
+    QDBusPendingCallWatcher *pending = new QDBusPendingCallWatcher(bus.asyncCall(call), this);
+    QObject::connect(pending, &QDBusPendingCallWatcher::finished, this, [=]() {
+        QDBusPendingReply<> reply = *pending;
+        pending->deleteLater();
+        if (reply.isError())
+            qWarning() << "Failed to resize the display:" << reply.error().message();
+    });
+}
+
+void DBusDisplay::registerListener()
+{
+    if (!m_peerName.isEmpty())
+        return;
+
+    // QEMU wants the server end of a connected socket for the listener
+    // connection; QtDBus can only connect by address, so let it connect
+    // to a temporary socket and hand over the accepted end.
+    const QByteArray path = m_listenerPath.toUtf8();
+    struct sockaddr_un addr;
+    if (path.size() >= (int) sizeof(addr.sun_path)) {
+        qWarning() << "Display listener path too long:" << m_listenerPath;
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.constData(), sizeof(addr.sun_path) - 1);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        qWarning() << "Failed to create display listener socket";
+        return;
+    }
+    unlink(path.constData());
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        qWarning() << "Failed to listen on" << m_listenerPath;
+        close(listener);
+        return;
+    }
+
+    static int counter = 0;
+    m_peerName = QStringLiteral("pvms-display-peer-%1").arg(++counter);
+    QDBusConnection peer = QDBusConnection::connectToPeer(QStringLiteral("unix:path=%1").arg(m_listenerPath),
+                                                          m_peerName);
+    const int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    close(listener);
+    unlink(path.constData());
+
+    if (!peer.isConnected() || fd < 0) {
+        qWarning() << "Failed to set up the display listener connection";
+        if (fd >= 0)
+            close(fd);
+        QDBusConnection::disconnectFromPeer(m_peerName);
+        m_peerName.clear();
+        return;
+    }
+
+    peer.registerObject(LISTENER_PATH, this, QDBusConnection::ExportAdaptors);
+
+    QDBusMessage call = QDBusMessage::createMethodCall(QEMU_SERVICE, CONSOLE_PATH,
+                                                       CONSOLE_INTERFACE,
+                                                       QStringLiteral("RegisterListener"));
+    call << QVariant::fromValue(QDBusUnixFileDescriptor(fd));
+    close(fd); // QDBusUnixFileDescriptor holds a duplicate
+
+    // Must be asynchronous: QEMU authenticates the new peer connection
+    // before replying.
+    QDBusConnection bus(m_busName);
+    QDBusPendingCallWatcher *pending = new QDBusPendingCallWatcher(bus.asyncCall(call), this);
+    QObject::connect(pending, &QDBusPendingCallWatcher::finished, this, [=]() {
+        QDBusPendingReply<> reply = *pending;
+        pending->deleteLater();
+        if (reply.isError()) {
+            qWarning() << "Failed to register display listener:" << reply.error().message();
+            QDBusConnection::disconnectFromPeer(m_peerName);
+            m_peerName.clear();
+            return;
+        }
+        qDebug() << "Display listener registered";
+        setAttached(true);
+    });
+}
+
+void DBusDisplay::setAttached(bool attached)
+{
+    if (m_attached == attached)
+        return;
+    m_attached = attached;
+    emit attachedChanged();
+}
+
+void DBusDisplay::unmap()
+{
+    if (!m_map)
+        return;
+    m_image = QImage(); // References the mapping
+    munmap(m_map, m_mapSize);
+    m_map = nullptr;
+    m_mapSize = 0;
+}
+
+QImage::Format DBusDisplay::imageFormat(uint pixmanFormat)
+{
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    switch (pixmanFormat) {
+    case PIXMAN_x8r8g8b8: return QImage::Format_RGB32;
+    case PIXMAN_a8r8g8b8: return QImage::Format_ARGB32;
+    case PIXMAN_x8b8g8r8: return QImage::Format_RGBX8888;
+    case PIXMAN_a8b8g8r8: return QImage::Format_RGBA8888;
+    case PIXMAN_r5g6b5: return QImage::Format_RGB16;
+    }
+#else
+    Q_UNUSED(pixmanFormat);
+#endif
+    return QImage::Format_Invalid;
+}
+
+void DBusDisplay::scanout(uint width, uint height, uint stride, uint pixmanFormat,
+                          const QByteArray &data)
+{
+    const QImage::Format format = imageFormat(pixmanFormat);
+    if (format == QImage::Format_Invalid) {
+        qWarning() << "Unsupported scanout format" << hex << pixmanFormat;
+        return;
+    }
+    if (size_t(data.size()) < size_t(stride) * height) {
+        qWarning() << "Short scanout data";
+        return;
+    }
+
+    unmap();
+    m_image = QImage(width, height, format);
+    const int length = qMin<int>(stride, m_image.bytesPerLine());
+    for (uint y = 0; y < height; y++) {
+        memcpy(m_image.scanLine(y), data.constData() + y * stride, length);
+    }
+    emit updated(m_image.rect());
+}
+
+void DBusDisplay::update(int x, int y, int width, int height,
+                         uint stride, uint pixmanFormat, const QByteArray &data)
+{
+    const QRect rect = QRect(x, y, width, height).intersected(m_image.rect());
+    if (m_map || m_image.isNull() || imageFormat(pixmanFormat) != m_image.format()) {
+        qWarning() << "Unexpected display update";
+        return;
+    }
+    if (rect.isEmpty() || size_t(data.size()) < size_t(stride) * height)
+        return;
+
+    const int bytesPerPixel = m_image.depth() / 8;
+    for (int row = 0; row < rect.height(); row++) {
+        memcpy(m_image.scanLine(rect.y() + row) + rect.x() * bytesPerPixel,
+               data.constData() + row * stride,
+               rect.width() * bytesPerPixel);
+    }
+    emit updated(rect);
+}
+
+void DBusDisplay::disable()
+{
+    unmap();
+    m_image = QImage();
+    emit updated(QRect());
+}
+
+void DBusDisplay::scanoutMap(const QDBusUnixFileDescriptor &memfd, uint offset,
+                             uint width, uint height, uint stride, uint pixmanFormat)
+{
+    const QImage::Format format = imageFormat(pixmanFormat);
+    if (format == QImage::Format_Invalid || !memfd.isValid()) {
+        qWarning() << "Unsupported shared scanout" << hex << pixmanFormat;
+        return;
+    }
+
+    unmap();
+    const size_t size = size_t(offset) + size_t(stride) * height;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, memfd.fileDescriptor(), 0);
+    if (map == MAP_FAILED) {
+        qWarning() << "Failed to map the shared scanout";
+        return;
+    }
+
+    // The guest framebuffer is used in place, QEMU keeps drawing into it
+    m_map = map;
+    m_mapSize = size;
+    m_image = QImage(static_cast<const uchar*>(map) + offset, width, height, stride, format);
+    emit updated(m_image.rect());
+}
+
+void DBusDisplay::updateMap(int x, int y, int width, int height)
+{
+    emit updated(QRect(x, y, width, height).intersected(m_image.rect()));
+}
+
+DBusDisplayListenerAdaptor::DBusDisplayListenerAdaptor(DBusDisplay *display):
+    QDBusAbstractAdaptor(display),
+    m_display(display)
+{
+}
+
+QStringList DBusDisplayListenerAdaptor::interfaces() const
+{
+    return QStringList() << MAP_INTERFACE;
+}
+
+void DBusDisplayListenerAdaptor::Scanout(uint width, uint height, uint stride, uint pixman_format,
+                                         const QByteArray &data)
+{
+    m_display->scanout(width, height, stride, pixman_format, data);
+}
+
+void DBusDisplayListenerAdaptor::Update(int x, int y, int width, int height,
+                                        uint stride, uint pixman_format, const QByteArray &data)
+{
+    m_display->update(x, y, width, height, stride, pixman_format, data);
+}
+
+void DBusDisplayListenerAdaptor::ScanoutDMABUF(const QDBusUnixFileDescriptor &dmabuf,
+                                               uint width, uint height, uint stride, uint fourcc,
+                                               qulonglong modifier, bool y0_top)
+{
+    Q_UNUSED(dmabuf);
+    Q_UNUSED(width);
+    Q_UNUSED(height);
+    Q_UNUSED(stride);
+    Q_UNUSED(modifier);
+    Q_UNUSED(y0_top);
+    // The display is only used without GL, see Machine::getLaunchArguments()
+    qWarning() << "DMABUF scanouts are not supported, fourcc" << hex << fourcc;
+    m_display->disable();
+}
+
+void DBusDisplayListenerAdaptor::UpdateDMABUF(int x, int y, int width, int height)
+{
+    Q_UNUSED(x);
+    Q_UNUSED(y);
+    Q_UNUSED(width);
+    Q_UNUSED(height);
+}
+
+void DBusDisplayListenerAdaptor::Disable()
+{
+    m_display->disable();
+}
+
+void DBusDisplayListenerAdaptor::MouseSet(int x, int y, int on)
+{
+    Q_UNUSED(x);
+    Q_UNUSED(y);
+    Q_UNUSED(on);
+}
+
+void DBusDisplayListenerAdaptor::CursorDefine(int width, int height, int hot_x, int hot_y,
+                                              const QByteArray &data)
+{
+    Q_UNUSED(width);
+    Q_UNUSED(height);
+    Q_UNUSED(hot_x);
+    Q_UNUSED(hot_y);
+    Q_UNUSED(data);
+}
+
+DBusDisplayMapAdaptor::DBusDisplayMapAdaptor(DBusDisplay *display):
+    QDBusAbstractAdaptor(display),
+    m_display(display)
+{
+}
+
+void DBusDisplayMapAdaptor::ScanoutMap(const QDBusUnixFileDescriptor &memfd, uint offset,
+                                       uint width, uint height, uint stride,
+                                       uint pixman_format)
+{
+    m_display->scanoutMap(memfd, offset, width, height, stride, pixman_format);
+}
+
+void DBusDisplayMapAdaptor::UpdateMap(int x, int y, int width, int height)
+{
+    m_display->updateMap(x, y, width, height);
+}
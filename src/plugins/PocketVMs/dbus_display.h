@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOMIRIVNC_DBUS_DISPLAY_H
+#define LOMIRIVNC_DBUS_DISPLAY_H
+
+#include <QDBusAbstractAdaptor>
+#include <QDBusUnixFileDescriptor>
+#include <QImage>
+#include <QObject>
+#include <QRect>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+
+class QDBusServiceWatcher;
+
+namespace LomiriVNC {
+
+/* Client for QEMU's "-display dbus" output. The guest framebuffer is
+ * received as a shared memfd scanout (or as plain data when QEMU can't
+ * share it) through a peer-to-peer D-Bus listener, and only the damage
+ * notifications travel over the bus afterwards.
+ * Lives in the GUI thread.
+ */
+class DBusDisplay: public QObject
+{
+    Q_OBJECT
+
+public:
+    DBusDisplay(QObject *parent = nullptr);
+    ~DBusDisplay();
+
+    /* Connects to the VM's private bus and registers a listener on the
+     * first console once QEMU shows up there. */
+    bool attach(const QString &busAddress);
+    void detach();
+
+    bool isAttached() const;
+    const QImage &image() const;
+
+    /* Tells QEMU the size the console is shown at; guests with a
+     * virtio-gpu driver adapt their resolution to it. */
+    void setUiInfo(const QSize &size);
+
+    // org.qemu.Display1.Listener
+    void scanout(uint width, uint height, uint stride, uint pixmanFormat,
+                 const QByteArray &data);
+    void update(int x, int y, int width, int height,
+                uint stride, uint pixmanFormat, const QByteArray &data);
+    void disable();
+
+    // org.qemu.Display1.Listener.Unix.Map
+    void scanoutMap(const QDBusUnixFileDescriptor &memfd, uint offset,
+                    uint width, uint height, uint stride, uint pixmanFormat);
+    void updateMap(int x, int y, int width, int height);
+
+Q_SIGNALS:
+    void attachedChanged();
+    void updated(const QRect &rect);
+
+private:
+    void registerListener();
+    void setAttached(bool attached);
+    void unmap();
+    static QImage::Format imageFormat(uint pixmanFormat);
+
+    QString m_busName;
+    QString m_peerName;
+    QString m_listenerPath;
+    QDBusServiceWatcher *m_watcher;
+    bool m_attached;
+    QImage m_image;
+    void *m_map;
+    size_t m_mapSize;
+};
+
+class DBusDisplayListenerAdaptor: public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.qemu.Display1.Listener")
+    Q_PROPERTY(QStringList Interfaces READ interfaces)
+
+public:
+    DBusDisplayListenerAdaptor(DBusDisplay *display);
+
+    QStringList interfaces() const;
+
+public Q_SLOTS:
+    void Scanout(uint width, uint height, uint stride, uint pixman_format,
+                 const QByteArray &data);
+    void Update(int x, int y, int width, int height,
+                uint stride, uint pixman_format, const QByteArray &data);
+    void ScanoutDMABUF(const QDBusUnixFileDescriptor &dmabuf,
+                       uint width, uint height, uint stride, uint fourcc,
+                       qulonglong modifier, bool y0_top);
+    void UpdateDMABUF(int x, int y, int width, int height);
+    void Disable();
+    void MouseSet(int x, int y, int on);
+    void CursorDefine(int width, int height, int hot_x, int hot_y,
+                      const QByteArray &data);
+
+private:
+    DBusDisplay *m_display;
+};
+
+class DBusDisplayMapAdaptor: public QDBusAbstractAdaptor
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.qemu.Display1.Listener.Unix.Map")
+
+public:
+    DBusDisplayMapAdaptor(DBusDisplay *display);
+
+public Q_SLOTS:
+    void ScanoutMap(const QDBusUnixFileDescriptor &memfd, uint offset,
+                    uint width, uint height, uint stride,
+                    uint pixman_format);
+    void UpdateMap(int x, int y, int width, int height);
+
+private:
+    DBusDisplay *m_display;
+};
+
+} // namespace
+
+#endif // LOMIRIVNC_DBUS_DISPLAY_H
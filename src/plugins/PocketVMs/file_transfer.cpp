@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QByteArray>
+#include <QDebug>
+#include <QFile>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "file_transfer.h"
+
+// Large enough to keep the syscall overhead low, small enough to report
+// progress every now and then
+static const size_t KERNEL_CHUNK_SIZE = 64 * 1024 * 1024;
+static const size_t USER_CHUNK_SIZE = 1024 * 1024;
+
+enum CopyResult {
+    Copied,
+    Unsupported,
+    Failed
+};
+
+static CopyResult cloneRange(int in, int out, qint64 size, const TransferProgress& progress)
+{
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        progress(size);
+        return Copied;
+    }
+#else
+    Q_UNUSED(in);
+    Q_UNUSED(out);
+    Q_UNUSED(size);
+    Q_UNUSED(progress);
+#endif
+    // Whatever the reason, real errors show up in the copies below
+    return Unsupported;
+}
+
+// Copies as much as the kernel manages to. Both file offsets advance
+// along, so that copyRange() can take over from wherever this stopped.
+static CopyResult copyRangeInKernel(int in, int out, qint64 size, qint64& copied,
+                                    const TransferProgress& progress)
+{
+#ifdef __NR_copy_file_range
+    // Older C libraries lack the wrapper
+    while (copied < size) {
+        const size_t chunk = size_t(qMin<qint64>(size - copied, KERNEL_CHUNK_SIZE));
+        const ssize_t n = syscall(__NR_copy_file_range, in, nullptr, out, nullptr, chunk, 0u);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // Filesystems like FUSE or sdcardfs refuse in all kinds of ways,
+        // and some only return short counts
+        if (n <= 0) {
+            if (n < 0)
+                qDebug() << "copy_file_range stopped at" << copied << "bytes:" << strerror(errno);
+            return Unsupported;
+        }
+        copied += n;
+        progress(copied);
+    }
+    return Copied;
+#else
+    Q_UNUSED(in);
+    Q_UNUSED(out);
+    Q_UNUSED(size);
+    Q_UNUSED(copied);
+    Q_UNUSED(progress);
+    return Unsupported;
+#endif
+}
+
+// Copies from the current offsets until the end of the source
+static CopyResult copyRange(int in, int out, qint64& copied, const TransferProgress& progress)
+{
+    QByteArray buffer(USER_CHUNK_SIZE, Qt::Uninitialized);
+    for (;;) {
+        const ssize_t n = read(in, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            qWarning() << "read failed:" << strerror(errno);
+            return Failed;
+        }
+        if (n == 0)
+            return Copied;
+
+        ssize_t written = 0;
+        while (written < n) {
+            const ssize_t w = write(out, buffer.constData() + written, n - written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0) {
+                qWarning() << "write failed:" << strerror(errno);
+                return Failed;
+            }
+            written += w;
+        }
+        copied += n;
+        progress(copied);
+    }
+}
+
+static bool copyFile(const QString& source, const QString& target, bool replace,
+                     const TransferProgress& progress)
+{
+    const QByteArray sourcePath = QFile::encodeName(source);
+    const QByteArray targetPath = QFile::encodeName(target);
+
+    const int in = open(sourcePath.constData(), O_RDONLY | O_CLOEXEC);
+    struct stat sourceInfo;
+    if (in < 0 || fstat(in, &sourceInfo) != 0) {
+        qWarning() << "Failed to open" << source << strerror(errno);
+        if (in >= 0)
+            close(in);
+        return false;
+    }
+
+    const int out = open(targetPath.constData(),
+                         O_WRONLY | O_CREAT | O_CLOEXEC | (replace ? O_TRUNC : O_EXCL),
+                         sourceInfo.st_mode & 0777);
+    if (out < 0) {
+        qWarning() << "Failed to create" << target << strerror(errno);
+        close(in);
+        return false;
+    }
+
+    qint64 copied = 0;
+    CopyResult result = cloneRange(in, out, sourceInfo.st_size, progress);
+    if (result == Unsupported)
+        result = copyRangeInKernel(in, out, sourceInfo.st_size, copied, progress);
+    if (result == Unsupported)
+        result = copyRange(in, out, copied, progress);
+
+    // Never take a short copy for a complete one, the source may be
+    // removed next
+    struct stat targetInfo;
+    if (result == Copied &&
+        (fstat(out, &targetInfo) != 0 || targetInfo.st_size != sourceInfo.st_size)) {
+        qWarning() << "Copied only part of" << source;
+        result = Failed;
+    }
+
+    close(in);
+    if (close(out) != 0 && result == Copied) {
+        qWarning() << "Failed to write" << target << strerror(errno);
+        result = Failed;
+    }
+
+    if (result != Copied) {
+        qWarning() << "Failed to copy" << source << "to" << target;
+        unlink(targetPath.constData());
+        return false;
+    }
+    return true;
+}
+
+bool copyFile(const QString& source, const QString& target,
+              const TransferProgress& progress)
+{
+    return copyFile(source, target, true, progress);
+}
+
+// rename(2) that fails with EEXIST rather than replacing the target
+static int renameNoReplace(const char* source, const char* target)
+{
+#if defined(__NR_renameat2) && defined(RENAME_NOREPLACE)
+    // Older C libraries lack the wrapper
+    if (syscall(__NR_renameat2, AT_FDCWD, source, AT_FDCWD, target, RENAME_NOREPLACE) == 0)
+        return 0;
+    if (errno != ENOSYS && errno != EINVAL)
+        return -1;
+#endif
+    // Kernels or filesystems without renameat2(): a hard link can't
+    // replace anything either
+    if (link(source, target) != 0)
+        return -1;
+    if (unlink(source) != 0)
+        qWarning() << "Failed to remove" << source << strerror(errno);
+    return 0;
+}
+
+bool moveFile(const QString& source, const QString& target,
+              const TransferProgress& progress)
+{
+    const QByteArray sourcePath = QFile::encodeName(source);
+
+    if (renameNoReplace(sourcePath.constData(), QFile::encodeName(target).constData()) == 0) {
+        progress(QFile(target).size());
+        return true;
+    }
+    if (errno == EEXIST) {
+        qWarning() << "Not replacing" << target;
+        return false;
+    }
+    if (errno != EXDEV)
+        qDebug() << "Can't rename" << source << "to" << target << strerror(errno) << "copying it";
+
+    if (!copyFile(source, target, false, progress))
+        return false;
+
+    if (unlink(sourcePath.constData()) != 0)
+        qWarning() << "Failed to remove" << source << strerror(errno);
+    return true;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FILE_TRANSFER_H
+#define FILE_TRANSFER_H
+
+#include <QString>
+
+#include <functional>
+
+// Blocking, so meant for worker threads. progress is called with the
+// number of bytes copied so far.
+typedef std::function<void(qint64 copied)> TransferProgress;
+
+// Shares the data with a reflink or copies it in the kernel where the
+// filesystems allow, and falls back to a chunked copy otherwise.
+// An existing target is replaced.
+bool copyFile(const QString& source, const QString& target,
+              const TransferProgress& progress);
+
+// Renames source to target if both are on the same filesystem, which
+// doesn't touch the data at all. Otherwise copies and removes the source,
+// which is only warned about if it fails. Fails if the target exists, so
+// that concurrent moves to the same name can't replace each other.
+bool moveFile(const QString& source, const QString& target,
+              const TransferProgress& progress);
+
+#endif
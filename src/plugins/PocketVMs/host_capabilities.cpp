@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFileInfo>
+#include <QSysInfo>
+
+#include "host_capabilities.h"
+
+const HostCapabilities& HostCapabilities::instance()
+{
+    static const HostCapabilities capabilities;
+    return capabilities;
+}
+
+HostCapabilities::HostCapabilities()
+{
+    const QFileInfo kvmInfo(QStringLiteral("/dev/kvm"));
+    if (!kvmInfo.exists())
+        qWarning() << "KVM is not enabled on this kernel or device.";
+    else if (!kvmInfo.isReadable())
+        qWarning() << "/dev/kvm is not readable.";
+    else if (!kvmInfo.isWritable())
+        qWarning() << "/dev/kvm is not writable.";
+    else
+        this->m_hasKvm = true;
+
+    // Only "arm64" and "x86_64" are supported anyway
+    const QString currentCpuType = QSysInfo::currentCpuArchitecture();
+    this->m_cpuArchitecture = currentCpuType == QStringLiteral("arm64") ?
+                QStringLiteral("aarch64") : currentCpuType;
+
+    this->m_binDir = QStringLiteral("%1/bin").arg(QCoreApplication::applicationDirPath());
+
+    qDebug() << "Host architecture:" << this->m_cpuArchitecture << "KVM:" << this->m_hasKvm;
+}
+
+bool HostCapabilities::hasKvm() const
+{
+    return this->m_hasKvm;
+}
+
+QString HostCapabilities::cpuArchitecture() const
+{
+    return this->m_cpuArchitecture;
+}
+
+bool HostCapabilities::canVirtualize(const QString& arch) const
+{
+    return this->m_hasKvm && arch == this->m_cpuArchitecture;
+}
+
+QString HostCapabilities::qemuBinary(const QString& arch) const
+{
+    return QStringLiteral("%1/qemu-system-%2").arg(this->m_binDir, arch);
+}
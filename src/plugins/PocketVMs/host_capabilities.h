@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef HOST_CAPABILITIES_H
+#define HOST_CAPABILITIES_H
+
+#include <QString>
+
+// What the host offers to VMs, probed once per process
+class HostCapabilities {
+public:
+    static const HostCapabilities& instance();
+
+    // /dev/kvm exists and is usable by the app
+    bool hasKvm() const;
+    // In QEMU's naming, e.g. "aarch64" rather than "arm64"
+    QString cpuArchitecture() const;
+    bool canVirtualize(const QString& arch) const;
+    QString qemuBinary(const QString& arch) const;
+
+private:
+    HostCapabilities();
+
+    bool m_hasKvm = false;
+    QString m_cpuArchitecture;
+    QString m_binDir;
+};
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QFile>
+#include <QMap>
+#include <QSet>
+
+#include <algorithm>
+#include <sched.h>
+
+#include "host_topology.h"
+
+static const QString SYSFS_CPU = QStringLiteral("/sys/devices/system/cpu");
+
+static QString readSysfs(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly))
+        return QString();
+    return QString::fromLatin1(file.readAll()).trimmed();
+}
+
+const HostTopology& HostTopology::instance()
+{
+    static const HostTopology topology;
+    return topology;
+}
+
+HostTopology::HostTopology()
+{
+    this->m_cpus = parseCpuList(readSysfs(QStringLiteral("%1/present").arg(SYSFS_CPU)));
+
+    for (const int cpu : this->m_cpus) {
+        const QString cpuPath = QStringLiteral("%1/cpu%2").arg(SYSFS_CPU).arg(cpu);
+
+        // cpu_capacity is only there on ARM, the maximum frequency is the
+        // next best thing elsewhere
+        QString capacity = readSysfs(QStringLiteral("%1/cpu_capacity").arg(cpuPath));
+        if (capacity.isEmpty())
+            capacity = readSysfs(QStringLiteral("%1/cpufreq/cpuinfo_max_freq").arg(cpuPath));
+        this->m_capacity.insert(cpu, capacity.toLongLong());
+
+        const int siblings = parseCpuList(readSysfs(QStringLiteral("%1/topology/thread_siblings_list").arg(cpuPath))).count();
+        this->m_threadsPerCore = qMax(this->m_threadsPerCore, siblings);
+    }
+
+    qDebug() << "Host CPUs:" << this->m_cpus << "clusters:" << clusters()
+             << "threads per core:" << this->m_threadsPerCore;
+}
+
+QList<int> HostTopology::cpus() const
+{
+    return this->m_cpus;
+}
+
+int HostTopology::threadsPerCore() const
+{
+    return this->m_threadsPerCore;
+}
+
+QList<QList<int>> HostTopology::clusters() const
+{
+    // Without any capacity information all CPUs are equal
+    QMap<qint64, QList<int>> byCapacity;
+    for (const int cpu : this->m_cpus)
+        byCapacity[this->m_capacity.value(cpu)] << cpu;
+
+    QList<QList<int>> ret;
+    for (auto it = byCapacity.constEnd(); it != byCapacity.constBegin();) {
+        --it;
+        ret << it.value();
+    }
+    return ret;
+}
+
+QList<int> HostTopology::vmCpus(int vcpus) const
+{
+    // A single prime core, like on 1+3+4 or 2+6 phones, isn't enough for
+    // a VM, so take slower clusters too until all vCPUs and the app fit
+    QList<int> ret;
+    for (const QList<int>& cluster : clusters()) {
+        if (ret.count() >= vcpus + 1)
+            break;
+        ret << cluster;
+    }
+    std::sort(ret.begin(), ret.end());
+    if (ret.count() > 1)
+        ret.removeFirst();
+    return ret;
+}
+
+int HostTopology::maxVmCpus() const
+{
+    return vmCpus(this->m_cpus.count()).count();
+}
+
+QList<int> HostTopology::parseCpuList(const QString& list)
+{
+    QSet<int> cpus;
+    for (const QString& range : list.split(',', QString::SkipEmptyParts)) {
+        const QStringList bounds = range.trimmed().split('-');
+        bool firstOk = false, lastOk = false;
+        const int first = bounds.first().toInt(&firstOk);
+        const int last = bounds.count() > 1 ? bounds.at(1).toInt(&lastOk) : first;
+        if (!firstOk || (bounds.count() > 1 && !lastOk) || last < first)
+            continue;
+        // The list may come from the user, and CPUs beyond what
+        // sched_setaffinity() takes are of no use anyway
+        for (int cpu = qMax(0, first); cpu <= qMin(last, CPU_SETSIZE - 1); cpu++)
+            cpus.insert(cpu);
+    }
+    QList<int> ret = cpus.toList();
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
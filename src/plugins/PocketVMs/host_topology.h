@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_TOPOLOGY_H
+#define HOST_TOPOLOGY_H
+
+#include <QHash>
+#include <QList>
+#include <QString>
+
+// CPU layout of the host, read once from sysfs
+class HostTopology {
+public:
+    static const HostTopology& instance();
+
+    QList<int> cpus() const;
+    int threadsPerCore() const;
+    // CPUs of equal capacity, fastest cluster first, e.g. the prime, big
+    // and little cores of a phone
+    QList<QList<int>> clusters() const;
+    // The fastest clusters with room for the vCPUs, minus one CPU left to
+    // the app itself
+    QList<int> vmCpus(int vcpus) const;
+    // Most vCPUs a VM can have without them sharing pinned CPUs
+    int maxVmCpus() const;
+
+    // Kernel CPU list format, e.g. "0-3,6"
+    static QList<int> parseCpuList(const QString& list);
+
+private:
+    HostTopology();
+
+    QList<int> m_cpus;
+    QHash<int, qint64> m_capacity;
+    int m_threadsPerCore = 1;
+};
+
+#endif
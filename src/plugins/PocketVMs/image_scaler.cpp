@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "image_scaler.h"
+
+#include <QVarLengthArray>
+#include <QVector>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define IMAGE_SCALER_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGE_SCALER_NEON
+#endif
+
+using namespace LomiriVNC;
+
+/* Interpolation weights have 7 bits, so that a weighted 8 bit channel
+ * still fits a signed 16 bit lane */
+static const int WEIGHT_BITS = 7;
+static const int WEIGHT_ONE = 1 << WEIGHT_BITS;
+
+static inline quint32 blendPixel(quint32 a, quint32 b, int weight)
+{
+    const quint32 inverse = WEIGHT_ONE - weight;
+    /* Two channels at a time, in 16 bit lanes which can't overflow */
+    const quint32 rb = (((a & 0x00ff00ff) * inverse +
+                         (b & 0x00ff00ff) * weight) >> WEIGHT_BITS) & 0x00ff00ff;
+    const quint32 ag = ((((a >> 8) & 0x00ff00ff) * inverse +
+                         ((b >> 8) & 0x00ff00ff) * weight) >> WEIGHT_BITS) & 0x00ff00ff;
+    return rb | (ag << 8);
+}
+
+static inline quint32 rgb16ToRgb32(quint16 c)
+{
+    const quint32 r = (c >> 11) & 0x1f;
+    const quint32 g = (c >> 5) & 0x3f;
+    const quint32 b = c & 0x1f;
+    return 0xff000000 |
+        (((r << 3) | (r >> 2)) << 16) |
+        (((g << 2) | (g >> 4)) << 8) |
+        ((b << 3) | (b >> 2));
+}
+
+QImage::Format ImageScaler::targetFormat(QImage::Format sourceFormat)
+{
+    switch (sourceFormat) {
+    case QImage::Format_RGB16:
+        return QImage::Format_RGB32;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        /* Channels are interpolated independently of their order */
+        return sourceFormat;
+    default:
+        return QImage::Format_Invalid;
+    }
+}
+
+void ImageScaler::convertRgb16(const quint16 *src, quint32 *dst, int count)
+{
+    int i = 0;
+#if defined(IMAGE_SCALER_SSE2)
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    const __m128i mask6 = _mm_set1_epi16(0x3f);
+    const __m128i alpha = _mm_set1_epi16(short(0xff00));
+    for (; i + 8 <= count; i += 8) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i r = _mm_srli_epi16(c, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(c, 5), mask6);
+        __m128i b = _mm_and_si128(c, mask5);
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        /* Little endian: B, G in the low half of each pixel, R, A above */
+        const __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        const __m128i ra = _mm_or_si128(r, alpha);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 4),
+                         _mm_unpackhi_epi16(bg, ra));
+    }
+#elif defined(IMAGE_SCALER_NEON)
+    for (; i + 8 <= count; i += 8) {
+        const uint16x8_t c = vld1q_u16(src + i);
+        const uint16x8_t r = vshrq_n_u16(c, 11);
+        const uint16x8_t g = vandq_u16(vshrq_n_u16(c, 5), vdupq_n_u16(0x3f));
+        const uint16x8_t b = vandq_u16(c, vdupq_n_u16(0x1f));
+        uint8x8x4_t pixels;
+        pixels.val[0] = vmovn_u16(vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2)));
+        pixels.val[1] = vmovn_u16(vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4)));
+        pixels.val[2] = vmovn_u16(vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2)));
+        pixels.val[3] = vdup_n_u8(0xff);
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), pixels);
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = rgb16ToRgb32(src[i]);
+    }
+}
+
+void ImageScaler::blendRows(const quint32 *a, const quint32 *b,
+                            quint32 *out, int count, int weight)
+{
+    if (weight == 0) {
+        memcpy(out, a, count * sizeof(quint32));
+        return;
+    }
+
+    int i = 0;
+#if defined(IMAGE_SCALER_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(short(WEIGHT_ONE - weight));
+    const __m128i wb = _mm_set1_epi16(short(weight));
+    for (; i + 4 <= count; i += 4) {
+        const __m128i pa = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        const __m128i pb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb));
+        lo = _mm_srli_epi16(lo, WEIGHT_BITS);
+        hi = _mm_srli_epi16(hi, WEIGHT_BITS);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+#elif defined(IMAGE_SCALER_NEON)
+    const uint8x8_t wa = vdup_n_u8(WEIGHT_ONE - weight);
+    const uint8x8_t wb = vdup_n_u8(weight);
+    for (; i + 4 <= count; i += 4) {
+        const uint8x16_t pa = vld1q_u8(reinterpret_cast<const uint8_t *>(a + i));
+        const uint8x16_t pb = vld1q_u8(reinterpret_cast<const uint8_t *>(b + i));
+        const uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(pa), wa),
+                                       vget_low_u8(pb), wb);
+        const uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(pa), wa),
+                                       vget_high_u8(pb), wb);
+        vst1q_u8(reinterpret_cast<uint8_t *>(out + i),
+                 vcombine_u8(vshrn_n_u16(lo, WEIGHT_BITS),
+                             vshrn_n_u16(hi, WEIGHT_BITS)));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] = blendPixel(a[i], b[i], weight);
+    }
+}
+
+void ImageScaler::blendColumns(const quint32 *row, const int *offsets,
+                               const quint8 *weights, quint32 *out, int count)
+{
+    int i = 0;
+#if defined(IMAGE_SCALER_SSE2)
+    /* Two output pixels at a time, each from a pair of neighbours */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(WEIGHT_ONE);
+    for (; i + 2 <= count; i += 2) {
+        const quint32 *p = row + offsets[i];
+        const quint32 *q = row + offsets[i + 1];
+        const __m128i a = _mm_unpacklo_epi8(
+            _mm_set_epi32(0, 0, int(q[0]), int(p[0])), zero);
+        const __m128i b = _mm_unpacklo_epi8(
+            _mm_set_epi32(0, 0, int(q[1]), int(p[1])), zero);
+        const short w0 = weights[i];
+        const short w1 = weights[i + 1];
+        const __m128i wb = _mm_set_epi16(w1, w1, w1, w1, w0, w0, w0, w0);
+        const __m128i wa = _mm_sub_epi16(one, wb);
+        __m128i r = _mm_add_epi16(_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb));
+        r = _mm_srli_epi16(r, WEIGHT_BITS);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + i),
+                         _mm_packus_epi16(r, r));
+    }
+#elif defined(IMAGE_SCALER_NEON)
+    for (; i + 2 <= count; i += 2) {
+        const quint32 *p = row + offsets[i];
+        const quint32 *q = row + offsets[i + 1];
+        const uint32x2_t a = vset_lane_u32(q[0], vdup_n_u32(p[0]), 1);
+        const uint32x2_t b = vset_lane_u32(q[1], vdup_n_u32(p[1]), 1);
+        const uint64_t w = (uint64_t(weights[i]) * 0x01010101u) |
+            ((uint64_t(weights[i + 1]) * 0x01010101u) << 32);
+        const uint8x8_t wb = vcreate_u8(w);
+        const uint8x8_t wa = vsub_u8(vdup_n_u8(WEIGHT_ONE), wb);
+        const uint16x8_t r = vmlal_u8(vmull_u8(vreinterpret_u8_u32(a), wa),
+                                      vreinterpret_u8_u32(b), wb);
+        vst1_u8(reinterpret_cast<uint8_t *>(out + i), vshrn_n_u16(r, WEIGHT_BITS));
+    }
+#endif
+    for (; i < count; i++) {
+        const quint32 *p = row + offsets[i];
+        out[i] = blendPixel(p[0], p[1], weights[i]);
+    }
+}
+
+bool ImageScaler::scale(const QImage &source, const QRectF &sourceRect,
+                        QImage *target, const QRect &area, bool smooth)
+{
+    const QImage::Format format = targetFormat(source.format());
+    if (Q_UNLIKELY(format == QImage::Format_Invalid ||
+                   target->format() != format)) {
+        return false;
+    }
+
+    const QRect rect = area.intersected(target->rect());
+    if (rect.isEmpty() || sourceRect.isEmpty() || source.isNull()) return true;
+
+    const int sourceWidth = source.width();
+    const int sourceHeight = source.height();
+    const double xScale = sourceRect.width() / target->width();
+    const double yScale = sourceRect.height() / target->height();
+
+    /* Source position of each target pixel center, in fixed point */
+    auto sourcePos = [smooth](double origin, double scale, int i,
+                              int size) -> int {
+        double pos = origin + (i + 0.5) * scale;
+        if (smooth) {
+            pos -= 0.5;
+        } else {
+            pos = std::floor(pos);
+        }
+        pos = qBound(0.0, pos, size - 1.0);
+        return int(pos * WEIGHT_ONE + 0.5);
+    };
+
+    /* Columns are the same for every row */
+    const int width = rect.width();
+    QVarLengthArray<int, 2048> offsets(width);
+    QVarLengthArray<quint8, 2048> weights(width);
+    int firstColumn = sourceWidth;
+    int lastColumn = 0;
+    for (int i = 0; i < width; i++) {
+        const int x = sourcePos(sourceRect.x(), xScale, rect.x() + i,
+                                sourceWidth);
+        offsets[i] = x >> WEIGHT_BITS;
+        weights[i] = x & (WEIGHT_ONE - 1);
+        firstColumn = qMin(firstColumn, offsets[i]);
+        lastColumn = qMax(lastColumn, offsets[i]);
+    }
+    for (int i = 0; i < width; i++) {
+        offsets[i] -= firstColumn;
+    }
+    /* Columns read, including the right neighbour of the last one; at the
+     * right edge that neighbour always has a zero weight */
+    const int count = qMin(lastColumn + 2, sourceWidth) - firstColumn;
+    const int span = lastColumn - firstColumn + 2;
+
+    /* RGB16 rows are converted once each. The two rows blended together
+     * have a different parity, so they never evict each other. */
+    const bool rgb16 = source.format() == QImage::Format_RGB16;
+    QVector<quint32> converted[2];
+    int convertedRow[2] = { -1, -1 };
+    auto sourceRow = [&](int y) -> const quint32 * {
+        if (!rgb16) {
+            return reinterpret_cast<const quint32 *>(source.constScanLine(y)) +
+                firstColumn;
+        }
+        QVector<quint32> &row = converted[y & 1];
+        if (convertedRow[y & 1] != y) {
+            row.resize(count);
+            convertRgb16(reinterpret_cast<const quint16 *>(source.constScanLine(y)) +
+                         firstColumn, row.data(), count);
+            convertedRow[y & 1] = y;
+        }
+        return row.constData();
+    };
+
+    QVector<quint32> blended(span);
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        const int pos = sourcePos(sourceRect.y(), yScale, y, sourceHeight);
+        const int y0 = pos >> WEIGHT_BITS;
+        const int weight = pos & (WEIGHT_ONE - 1);
+        quint32 *out = reinterpret_cast<quint32 *>(target->scanLine(y)) + rect.x();
+
+        const quint32 *top = sourceRow(y0);
+        if (!smooth) {
+            for (int i = 0; i < width; i++) {
+                out[i] = top[offsets[i]];
+            }
+            continue;
+        }
+
+        /* At the bottom edge the weight is always zero */
+        const quint32 *bottom = weight != 0 ? sourceRow(y0 + 1) : top;
+        blendRows(top, bottom, blended.data(), count, weight);
+        if (count < span) {
+            blended[count] = blended[count - 1];
+        }
+        blendColumns(blended.constData(), offsets.constData(),
+                     weights.constData(), out, width);
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOMIRIVNC_IMAGE_SCALER_H
+#define LOMIRIVNC_IMAGE_SCALER_H
+
+#include <QImage>
+#include <QRect>
+#include <QRectF>
+
+namespace LomiriVNC {
+
+/* CPU scaling and pixel conversion of the remote framebuffer, for when
+ * there's no GPU to do it. Uses SSE2 or NEON where the compiler targets
+ * them; all code paths give exactly the same results.
+ */
+class ImageScaler
+{
+public:
+    /* Format the scaled image must have: the source format for 32bpp
+     * sources, RGB32 for RGB16 ones, or Format_Invalid if unsupported. */
+    static QImage::Format targetFormat(QImage::Format sourceFormat);
+
+    /* Maps `sourceRect` of `source` onto the whole of `target`, and computes
+     * the pixels of `target` inside `area` only. Uses bilinear filtering if
+     * `smooth` is set, nearest neighbour sampling otherwise. */
+    static bool scale(const QImage &source, const QRectF &sourceRect,
+                      QImage *target, const QRect &area, bool smooth);
+
+    /* RGB565 to RGB32, replicating the high bits like QImage does */
+    static void convertRgb16(const quint16 *src, quint32 *dst, int count);
+
+private:
+    static void blendRows(const quint32 *a, const quint32 *b,
+                          quint32 *out, int count, int weight);
+    static void blendColumns(const quint32 *row, const int *offsets,
+                             const quint8 *weights, quint32 *out, int count);
+};
+
+} // namespace
+
+#endif // LOMIRIVNC_IMAGE_SCALER_H
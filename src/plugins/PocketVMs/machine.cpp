@@ -19,19 +19,150 @@
 #include <QDir>
 #include <QFile>
 #include <QFileInfo>
+#include <QJsonArray>
 #include <QProcessEnvironment>
-#include <QSysInfo>
 #include <QTimer>
-#include <QThread>
 
 #include <csignal>
+#include <sched.h>
 
+#include "host_capabilities.h"
+#include "host_topology.h"
 #include "machine.h"
 
+// Saving the state writes all of the guest RAM to disk
+static const int QUIT_TIMEOUT_MS = 10000;
+static const int SUSPEND_TIMEOUT_MS = 120000;
+// Left for QEMU to quit in when destroyed, if VMManager didn't wait already
+static const int DESTROY_QUIT_TIMEOUT_MS = 500;
+
+static const int BALLOON_INTERVAL_MS = 2000;
+
+// Options for the main drive. Discarding lets the qcow2 image shrink
+// again when the guest trims deleted blocks or writes zeroes.
+struct DiskProfile {
+    const char* name;
+    const char* cache;       // nullptr for QEMU's default
+    const char* aio;         // nullptr for QEMU's default
+    bool discard;
+    bool ioThread;           // handle the virtio-blk queue off the main loop
+    const char* l2CacheSize; // nullptr for QEMU's default, 1M covers 8G
+};
+
+static const DiskProfile diskProfiles[] = {
+    { "default", nullptr, nullptr, false, false, nullptr },
+    { "balanced", "writeback", "threads", true, true, "2M" },
+    // O_DIRECT skips the host page cache, which the guest has already
+    { "performance", "none", "native", true, true, "4M" },
+    { "safe", "writethrough", "threads", true, false, nullptr },
+};
+
+// Single quotes for /bin/sh, which QEMU runs exec: migrations with
+static QString shellQuote(const QString& value)
+{
+    QString quoted = value;
+    quoted.replace(QLatin1Char('\''), QStringLiteral("'\\''"));
+    return QStringLiteral("'%1'").arg(quoted);
+}
+
+// Default hugepage size in kB and how many of them are free
+static bool freeHugepages(qint64* pageSizeKb, qint64* freePages)
+{
+    QFile meminfo(QStringLiteral("/proc/meminfo"));
+    if (!meminfo.open(QFile::ReadOnly))
+        return false;
+
+    *pageSizeKb = 0;
+    *freePages = 0;
+    for (const QByteArray& line : meminfo.readAll().split('\n')) {
+        const QList<QByteArray> fields = line.simplified().split(' ');
+        if (fields.count() < 2)
+            continue;
+        if (fields.at(0) == "Hugepagesize:")
+            *pageSizeKb = fields.at(1).toLongLong();
+        else if (fields.at(0) == "HugePages_Free:")
+            *freePages = fields.at(1).toLongLong();
+    }
+    return *pageSizeKb > 0;
+}
+
+// MemAvailable counts the page cache the kernel can drop, unlike the free
+// memory. Kernels before 3.14 lack it, the cache is the next best guess.
+static bool availableMemory(qint64* totalKb, qint64* availableKb)
+{
+    QFile meminfo(QStringLiteral("/proc/meminfo"));
+    if (!meminfo.open(QFile::ReadOnly))
+        return false;
+
+    *totalKb = 0;
+    *availableKb = -1;
+    qint64 reclaimableKb = 0;
+    for (const QByteArray& line : meminfo.readAll().split('\n')) {
+        const QList<QByteArray> fields = line.simplified().split(' ');
+        if (fields.count() < 2)
+            continue;
+        if (fields.at(0) == "MemTotal:")
+            *totalKb = fields.at(1).toLongLong();
+        else if (fields.at(0) == "MemAvailable:")
+            *availableKb = fields.at(1).toLongLong();
+        else if (fields.at(0) == "MemFree:" || fields.at(0) == "Buffers:" || fields.at(0) == "Cached:")
+            reclaimableKb += fields.at(1).toLongLong();
+    }
+    if (*availableKb < 0)
+        *availableKb = reclaimableKb;
+    return *totalKb > 0;
+}
+
+enum MemoryPressure {
+    LowPressure,
+    ModeratePressure,
+    HighPressure
+};
+
+static MemoryPressure hostMemoryPressure()
+{
+    // Share of the last 10 seconds in which some task stalled on memory
+    QFile psi(QStringLiteral("/proc/pressure/memory"));
+    if (psi.open(QFile::ReadOnly)) {
+        const QList<QByteArray> fields = psi.readLine().trimmed().split(' ');
+        for (const QByteArray& field : fields) {
+            if (!field.startsWith("avg10="))
+                continue;
+            const double stalled = field.mid(6).toDouble();
+            if (stalled >= 10.0)
+                return HighPressure;
+            if (stalled < 1.0)
+                return LowPressure;
+            return ModeratePressure;
+        }
+    }
+
+    // Kernels before 4.20 don't have PSI, fall back to the available memory
+    qint64 totalKb, availableKb;
+    if (!availableMemory(&totalKb, &availableKb))
+        return ModeratePressure;
+    const double available = double(availableKb) / totalKb;
+    if (available < 0.10)
+        return HighPressure;
+    if (available > 0.25)
+        return LowPressure;
+    return ModeratePressure;
+}
+
 Machine::Machine()
 {
     this->m_session = new KSession(this);
-    QObject::connect(this->m_session, &KSession::started, this, &Machine::started);
+    QObject::connect(this->m_session, &KSession::started, this, [=]() {
+        // A prewarmed guest waits for start()
+        if (this->m_warmState == WarmingUp) {
+            setWarmState(Warm);
+            if (!this->m_startWhenWarm) {
+                qDebug() << this->name << "is prewarmed";
+                return;
+            }
+        }
+        finishStart();
+    });
     QObject::connect(this->m_session, &KSession::finished, this, &Machine::stopped);
 
     this->m_fileSharingProcess = new QProcess(this);
@@ -41,6 +172,7 @@ Machine::Machine()
         qWarning() << this->m_fileSharingProcess->readAllStandardError();
 
         if (newState == QProcess::NotRunning) {
+            stopWaitingForFileSharingSocket();
             if(this->m_fileSharingProcess->exitCode() != 0)
                 emit fileSharingError(this->m_fileSharingProcess->readAllStandardError());
             emit stopped();
@@ -48,9 +180,98 @@ Machine::Machine()
         }
 
         if (newState == QProcess::Running) {
-            startQemu();
+            waitForFileSharingSocket();
+        }
+    });
+
+    // virtiofsd is only ready once it created its socket
+    this->m_fileSharingSocketWatcher = new QFileSystemWatcher(this);
+    QObject::connect(this->m_fileSharingSocketWatcher, &QFileSystemWatcher::directoryChanged, this, [=]() {
+        if (!QFile::exists(getFileSharingSocket()))
+            return;
+        stopWaitingForFileSharingSocket();
+        if (!startQemu())
+            this->m_fileSharingProcess->terminate();
+    });
+
+    static const int SOCKET_TIMEOUT_MS = 5000;
+    this->m_fileSharingSocketTimeout = new QTimer(this);
+    this->m_fileSharingSocketTimeout->setSingleShot(true);
+    this->m_fileSharingSocketTimeout->setInterval(SOCKET_TIMEOUT_MS);
+    QObject::connect(this->m_fileSharingSocketTimeout, &QTimer::timeout, this, [=]() {
+        qWarning() << "Waited" << SOCKET_TIMEOUT_MS << "ms for socket" << getFileSharingSocket();
+        stopWaitingForFileSharingSocket();
+        this->m_fileSharingProcess->terminate();
+    });
+
+    // The private bus for QEMU's D-Bus display prints its address once it
+    // accepts connections, which is when QEMU can be started.
+    this->m_displayBusProcess = new QProcess(this);
+    QObject::connect(this->m_displayBusProcess, &QProcess::readyReadStandardOutput, this, [=]() {
+        this->m_displayBusProcess->readAllStandardOutput();
+        if (!this->running && !startFileSharingAndQemu())
+            emit stopped();
+    });
+    QObject::connect(this->m_displayBusProcess, &QProcess::errorOccurred, this, [=](QProcess::ProcessError err) {
+        if (err != QProcess::FailedToStart)
+            return;
+        // Fall back to VNC
+        qWarning() << "Failed to start the display bus, using VNC";
+        if (!startFileSharingAndQemu())
+            emit stopped();
+    });
+
+    // QMP is how the guest is controlled while QEMU runs. Machine::stop()
+    // also asks QEMU to quit through it, so that the disk images are
+    // flushed and closed properly.
+    this->m_qmp = new QmpClient(this);
+    this->m_monitor = new MachineMonitor(this->m_qmp, [=]() {
+        return this->m_session->getShellPID();
+    }, this);
+
+    QObject::connect(this->m_qmp, &QmpClient::ready, this, [=]() {
+        refreshStatus();
+        this->m_monitor->start();
+        this->m_balloonSize = this->mem;
+        emit balloonSizeChanged();
+        if (this->autoBalloon)
+            this->m_balloonTimer->start();
+        if (this->pinVcpus)
+            pinVcpuThreads();
+    });
+    QObject::connect(this->m_qmp, &QmpClient::disconnected, this, [=]() {
+        setStatus(QString());
+    });
+    QObject::connect(this->m_qmp, &QmpClient::event, this, [=](const QString& event, const QJsonObject& data) {
+        if (event == QStringLiteral("MIGRATION")) {
+            const QString migrationStatus = data.value(QStringLiteral("status")).toString();
+            if (migrationStatus == QStringLiteral("completed"))
+                finishSuspend(true);
+            else if (migrationStatus == QStringLiteral("failed") || migrationStatus == QStringLiteral("cancelled"))
+                finishSuspend(false);
+        }
+
+        if (event == QStringLiteral("STOP") || event == QStringLiteral("RESUME") ||
+            event == QStringLiteral("SHUTDOWN") || event == QStringLiteral("MIGRATION")) {
+            refreshStatus();
         }
     });
+    QObject::connect(this, &Machine::started, this, [=](){
+        this->m_qmp->connectToServer(getQmpSocket());
+    });
+
+    this->m_balloonTimer = new QTimer(this);
+    this->m_balloonTimer->setInterval(BALLOON_INTERVAL_MS);
+    QObject::connect(this->m_balloonTimer, &QTimer::timeout, this, [=]() {
+        adjustBalloon();
+    });
+
+    this->m_stopTimeout = new QTimer(this);
+    this->m_stopTimeout->setSingleShot(true);
+    QObject::connect(this->m_stopTimeout, &QTimer::timeout, this, [=]() {
+        qWarning() << "Timed out waiting for" << this->name << "to stop";
+        forceStop();
+    });
 
     QObject::connect(this, &Machine::started, this, [=](){
         if (this->running)
@@ -66,11 +287,53 @@ Machine::Machine()
         emit runningChanged();
         emit sessionChanged();
     });
+    QObject::connect(this, &Machine::stopped, this, [=](){
+        if (this->m_displayBusProcess->state() != QProcess::NotRunning)
+            this->m_displayBusProcess->terminate();
+    });
+    QObject::connect(this, &Machine::stopped, this, [=](){
+        setWarmState(Cold);
+        this->m_startWhenWarm = false;
+        setStopping(false);
+        this->m_stopTimeout->stop();
+        this->m_balloonTimer->stop();
+        this->m_monitor->stop();
+        this->m_qmp->disconnectFromServer();
+        setStatus(QString());
+
+        if (!this->m_resumeState.isEmpty()) {
+            QFile::remove(this->m_resumeState);
+            this->m_resumeState.clear();
+        }
+    });
 }
 
 Machine::~Machine()
 {
-    stop();
+    // There's no event loop left to wait for QEMU in. VMManager usually
+    // made all VMs quit before, waiting for them at once.
+    if (this->running && !this->m_quitting)
+        quitNow();
+    if (this->m_quitting && waitForQuit(DESTROY_QUIT_TIMEOUT_MS))
+        return;
+    forceStop();
+}
+
+bool Machine::quitNow()
+{
+    if (!this->running || !this->m_qmp->isReady())
+        return false;
+
+    this->m_qmp->execute(QStringLiteral("quit"));
+    this->m_qmp->flush();
+    this->m_quitting = true;
+    return true;
+}
+
+bool Machine::waitForQuit(int msecs)
+{
+    // QMP is reset once QEMU has closed its end
+    return !this->m_qmp->isReady() || this->m_qmp->waitForDisconnected(msecs);
 }
 
 bool Machine::start()
@@ -80,7 +343,88 @@ bool Machine::start()
         return false;
     }
 
-    if (this->m_fileSharingProcess->state() == QProcess::Starting)
+    if (this->isTemplate) {
+        qWarning() << "Templates can't be started, clone them instead";
+        return false;
+    }
+
+    // QEMU is already there, only the guest has to run
+    if (this->m_warmState == Warm) {
+        qDebug() << "Resuming prewarmed" << this->name;
+        finishStart();
+        return true;
+    }
+    if (this->m_warmState == WarmingUp) {
+        this->m_startWhenWarm = true;
+        return true;
+    }
+
+    return launch();
+}
+
+void Machine::warmUp()
+{
+    if (!this->prewarm || this->running || this->isTemplate || this->m_warmState != Cold)
+        return;
+
+    // Committing all of the guest RAM upfront isn't cheap enough to do
+    // for a VM that might not be started
+    if (this->preallocRam)
+        return;
+
+    // Launching throws away a saved state that can't be resumed from
+    if (hasSavedState() && !this->fastResume)
+        return;
+
+    if (this->m_session->getShellPID() > 0 ||
+        this->m_fileSharingProcess->state() != QProcess::NotRunning ||
+        this->m_displayBusProcess->state() != QProcess::NotRunning)
+        return;
+
+    qDebug() << "Prewarming" << this->name;
+    setWarmState(WarmingUp);
+    if (!launch()) {
+        setWarmState(Cold);
+        emit stopped();
+    }
+}
+
+void Machine::coolDown()
+{
+    if (this->m_warmState == Cold || this->m_startWhenWarm)
+        return;
+
+    qDebug() << "Stopping prewarmed" << this->name;
+
+    // The guest never ran, so the saved state is still good
+    if (!this->m_resumeState.isEmpty() && QFile::rename(this->m_resumeState, getSavedStatePath())) {
+        this->m_resumeState.clear();
+        emit savedStateChanged();
+    }
+
+    stopWaitingForFileSharingSocket();
+    if (this->m_fileSharingProcess->state() != QProcess::NotRunning)
+        this->m_fileSharingProcess->terminate();
+    forceStop();
+}
+
+void Machine::finishStart()
+{
+    const bool warm = this->m_warmState == Warm;
+    setWarmState(Cold);
+    this->m_startWhenWarm = false;
+
+    emit started();
+
+    // QMP connects on started(), and queues the command until it's ready
+    if (warm)
+        this->m_qmp->execute(QStringLiteral("cont"));
+}
+
+bool Machine::launch()
+{
+    if (this->m_fileSharingProcess->state() == QProcess::Starting ||
+        this->m_fileSharingSocketTimeout->isActive())
     {
         // Return true as the VM is already starting and should
         // put the UI into a "make it killable" state.
@@ -88,6 +432,33 @@ bool Machine::start()
         return true;
     }
 
+    if (this->m_displayBusProcess->state() != QProcess::NotRunning) {
+        qWarning() << "VM processes already starting";
+        return true;
+    }
+
+    // The display bus has to be up before virtiofsd and QEMU
+    if (usesLocalDisplay()) {
+        const QString busSocket = QStringLiteral("%1/display-bus.sock").arg(this->storage);
+        const QStringList busArgs = {
+            "--session",
+            "--nofork",
+            "--nopidfile",
+            QStringLiteral("--address=%1").arg(getDisplayBusAddress()),
+            "--print-address"
+        };
+
+        qDebug() << "Starting: dbus-daemon" << busArgs;
+        QFile::remove(busSocket); // May fail if it doesn't exist
+        this->m_displayBusProcess->start(QStringLiteral("dbus-daemon"), busArgs);
+        return true;
+    }
+
+    return startFileSharingAndQemu();
+}
+
+bool Machine::startFileSharingAndQemu()
+{
     // If file sharing is enabled, start QEMU *after* virtiofsd is up
     // Start directly otherwise.
     if (this->enableFileSharing) {
@@ -142,54 +513,342 @@ bool Machine::start()
 
 void Machine::stop()
 {
-    kill(this->m_session->getShellPID(), SIGKILL);
+    if (this->m_session->getShellPID() <= 0) {
+        emit stopped();
+        return;
+    }
+
+    // Stopping again while waiting for QEMU pulls the plug
+    if (this->m_stopping) {
+        forceStop();
+        return;
+    }
+
+    // Without QMP there's no way of asking QEMU
+    if (!this->m_qmp->isReady()) {
+        forceStop();
+        return;
+    }
+
+    setStopping(true);
+    this->m_stopTimeout->start(this->fastResume ? SUSPEND_TIMEOUT_MS : QUIT_TIMEOUT_MS);
+    if (this->fastResume)
+        suspendAndQuit();
+    else
+        this->m_qmp->execute(QStringLiteral("quit"));
+}
+
+void Machine::forceStop()
+{
+    // A session that never started has no shell, and kill(0) would hit
+    // our own process group
+    const int pid = this->m_session->getShellPID();
+    if (pid > 0)
+        kill(pid, SIGKILL);
     emit stopped();
 }
 
-void Machine::importIntoShare(const QUrl& url) const
+void Machine::suspendAndQuit()
 {
-    QFile file(url.path());
+    const QString partialState = QStringLiteral("%1.part").arg(getSavedStatePath());
+    QFile::remove(partialState); // May fail if it doesn't exist
 
-    if (!file.exists()) {
-        qWarning() << "File" << file << "doesn't exist.";
+    // Pause the guest so that nothing changes while saving, then migrate
+    // into a file. The outcome is reported with a MIGRATION event.
+    const QJsonObject eventsCapability {
+        { "capability", "events" },
+        { "state", true }
+    };
+    this->m_qmp->execute(QStringLiteral("migrate-set-capabilities"),
+                         QJsonObject { { "capabilities", QJsonArray { eventsCapability } } });
+    this->m_qmp->execute(QStringLiteral("stop"));
+    this->m_qmp->execute(QStringLiteral("migrate"),
+                         QJsonObject { { "uri", QStringLiteral("exec:cat > %1").arg(shellQuote(partialState)) } },
+                         [=](const QJsonValue&, const QString& error) {
+        // E.g. virtiofs doesn't support migration
+        if (!error.isEmpty()) {
+            qWarning() << "Failed to save the state of" << this->name << error;
+            finishSuspend(false);
+        }
+    });
+}
+
+void Machine::finishSuspend(bool success)
+{
+    if (!this->m_stopping || !this->fastResume)
         return;
+
+    const QString partialState = QStringLiteral("%1.part").arg(getSavedStatePath());
+    if (success) {
+        QFile::remove(getSavedStatePath());
+        if (QFile::rename(partialState, getSavedStatePath()))
+            emit savedStateChanged();
+    } else {
+        QFile::remove(partialState);
+    }
+    this->m_qmp->execute(QStringLiteral("quit"));
+}
+
+bool Machine::powerdown()
+{
+    if (!this->m_qmp->isReady())
+        return false;
+
+    // Lets the guest OS shut down by itself
+    this->m_qmp->execute(QStringLiteral("system_powerdown"));
+    return true;
+}
+
+bool Machine::changeDvd(const QString& path)
+{
+    if (!this->m_qmp->isReady())
+        return false;
+
+    auto done = [=](const QJsonValue&, const QString& error) {
+        if (!error.isEmpty()) {
+            emit this->error(error);
+            return;
+        }
+        this->dvd = path;
+        emit dvdChanged();
+    };
+
+    if (path.isEmpty()) {
+        this->m_qmp->execute(QStringLiteral("eject"),
+                             QJsonObject { { "id", "cd0" }, { "force", true } },
+                             done);
+    } else {
+        this->m_qmp->execute(QStringLiteral("blockdev-change-medium"),
+                             QJsonObject { { "id", "cd0" }, { "filename", path }, { "format", "raw" } },
+                             done);
     }
+    return true;
+}
+
+bool Machine::setBalloonSize(int mb)
+{
+    if (!this->m_qmp->isReady() || mb <= 0)
+        return false;
+
+    // The guest gives back memory until it's left with the target size
+    mb = qMin(mb, this->mem);
+    const qint64 bytes = qint64(mb) * 1024 * 1024;
+    this->m_qmp->execute(QStringLiteral("balloon"), QJsonObject { { "value", bytes } });
+
+    if (this->m_balloonSize != mb) {
+        this->m_balloonSize = mb;
+        emit balloonSizeChanged();
+    }
+    return true;
+}
+
+void Machine::adjustBalloon()
+{
+    // Steps of an eighth of the RAM, but never below a quarter of it
+    const int step = qMax(64, this->mem / 8);
+    const int minimum = qMax(256, this->mem / 4);
 
-    const QString fileName = url.path().split('/', QString::SkipEmptyParts).back();
-    const QString newPath = getFileSharingDirectory() + QStringLiteral("/%1").arg(fileName);
-    if (!file.copy(newPath)) {
-        qWarning() << "Failed to copy file" << file << "to" << newPath;
+    int target = this->m_balloonSize;
+    switch (hostMemoryPressure()) {
+    case HighPressure:
+        target = qMax(minimum, target - step);
+        break;
+    case LowPressure:
+        target = qMin(this->mem, target + step);
+        break;
+    case ModeratePressure:
+        break;
+    }
+
+    if (target != this->m_balloonSize) {
+        qDebug() << "Ballooning" << this->name << "to" << target << "MB";
+        setBalloonSize(target);
+    }
+}
+
+void Machine::pinVcpuThreads()
+{
+    const QList<int> cpus = this->cpuAffinity.isEmpty() ?
+                HostTopology::instance().vmCpus(this->cores) :
+                HostTopology::parseCpuList(this->cpuAffinity);
+    if (cpus.isEmpty()) {
+        qWarning() << "No CPUs to pin" << this->name << "to";
         return;
     }
+    if (this->cores > cpus.count())
+        qWarning() << this->name << "has" << this->cores << "vCPUs sharing" << cpus.count() << "pinned CPUs";
+
+    // A set rather than one CPU per vCPU, as phones take cores offline
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+
+    this->m_qmp->execute(QStringLiteral("query-cpus-fast"), QJsonObject(), [=](const QJsonValue& result, const QString& error) {
+        if (!error.isEmpty()) {
+            qWarning() << "Failed to query the vCPUs of" << this->name << error;
+            return;
+        }
+
+        for (const QJsonValue& vcpu : result.toArray()) {
+            const pid_t tid = vcpu.toObject().value(QStringLiteral("thread-id")).toInt();
+            if (tid <= 0)
+                continue;
+            if (sched_setaffinity(tid, sizeof(set), &set))
+                qWarning() << "Failed to pin vCPU thread" << tid << "to CPUs" << cpus;
+        }
+        qDebug() << "Pinned the vCPUs of" << this->name << "to CPUs" << cpus;
+    });
+}
+
+MachineMonitor* Machine::monitor() const
+{
+    return this->m_monitor;
+}
 
-    if (!file.remove()) {
-        qWarning() << "Failed to remove file" << file;
+int Machine::balloonSize() const
+{
+    return this->m_balloonSize;
+}
+
+void Machine::refreshStats()
+{
+    if (!this->m_qmp->isReady())
+        return;
+
+    auto store = [=](const QString& key) {
+        return [=](const QJsonValue& result, const QString& error) {
+            if (!error.isEmpty()) {
+                qDebug() << "Failed to query" << key << "of" << this->name << error;
+                return;
+            }
+            this->m_stats.insert(key, result.toVariant());
+            emit statsChanged();
+        };
+    };
+
+    this->m_qmp->execute(QStringLiteral("query-blockstats"), QJsonObject(), store(QStringLiteral("blockstats")));
+    this->m_qmp->execute(QStringLiteral("query-cpus-fast"), QJsonObject(), store(QStringLiteral("cpus")));
+    this->m_qmp->execute(QStringLiteral("query-balloon"), QJsonObject(), store(QStringLiteral("balloon")));
+}
+
+void Machine::refreshStatus()
+{
+    this->m_qmp->execute(QStringLiteral("query-status"), QJsonObject(), [=](const QJsonValue& result, const QString& error) {
+        if (error.isEmpty())
+            setStatus(result.toObject().value(QStringLiteral("status")).toString());
+    });
+}
+
+void Machine::setStatus(const QString& value)
+{
+    if (this->m_status == value)
+        return;
+
+    this->m_status = value;
+    emit statusChanged();
+}
+
+QString Machine::status() const
+{
+    return this->m_status;
+}
+
+QVariantMap Machine::stats() const
+{
+    return this->m_stats;
+}
+
+void Machine::setStopping(bool value)
+{
+    if (this->m_stopping == value)
+        return;
+
+    this->m_stopping = value;
+    emit stoppingChanged();
+}
+
+bool Machine::isStopping() const
+{
+    return this->m_stopping;
+}
+
+void Machine::setWarmState(WarmState value)
+{
+    const bool wasWarm = isWarm();
+    this->m_warmState = value;
+    if (isWarm() != wasWarm)
+        emit warmChanged();
+}
+
+bool Machine::isWarm() const
+{
+    return this->m_warmState != Cold;
+}
+
+bool Machine::hasSavedState() const
+{
+    return QFile::exists(getSavedStatePath());
+}
+
+void Machine::discardSavedState()
+{
+    if (!hasSavedState())
+        return;
+
+    qDebug() << "Discarding the saved state of" << this->name;
+    QFile::remove(getSavedStatePath());
+    emit savedStateChanged();
+}
+
+void Machine::waitForFileSharingSocket()
+{
+    if (QFile::exists(getFileSharingSocket())) {
+        if (!startQemu())
+            this->m_fileSharingProcess->terminate();
         return;
     }
 
-    qInfo() << "Imported" << fileName << "into VM" << name;
+    this->m_fileSharingSocketWatcher->addPath(QFileInfo(getFileSharingSocket()).absolutePath());
+    this->m_fileSharingSocketTimeout->start();
+
+    // It may have appeared before the watch was set up
+    if (QFile::exists(getFileSharingSocket())) {
+        stopWaitingForFileSharingSocket();
+        if (!startQemu())
+            this->m_fileSharingProcess->terminate();
+    }
+}
+
+void Machine::stopWaitingForFileSharingSocket()
+{
+    this->m_fileSharingSocketTimeout->stop();
+    const QStringList dirs = this->m_fileSharingSocketWatcher->directories();
+    if (!dirs.isEmpty())
+        this->m_fileSharingSocketWatcher->removePaths(dirs);
 }
 
 bool Machine::startQemu()
 {
-    const QString pwd = QCoreApplication::applicationDirPath();
-    const QString qemuBin = QStringLiteral("%1/bin/qemu-system-%2").arg(pwd, this->arch);
-    const QStringList args = getLaunchArguments();
+    const QString qemuBin = HostCapabilities::instance().qemuBinary(this->arch);
 
-    if (this->enableFileSharing) {
-        int counter = 0;
-        static const int MAX_RETRIES = 5;
-        const QString socket = getFileSharingSocket();
-        while (!QFile::exists(socket) && counter < MAX_RETRIES) {
-            QThread::msleep(1000);
-            ++counter;
-        }
-        if (counter >= MAX_RETRIES && !QFile::exists(socket)) {
-            qWarning() << "Waited" << MAX_RETRIES << "seconds for socket" << socket;
-            return false;
-        }
+    // The guest writes to its disks as soon as it runs, so a saved state
+    // can only be resumed from once, and not at all after a cold boot.
+    const QString resumeState = QStringLiteral("%1/resume.state").arg(this->storage);
+    QFile::remove(resumeState); // May fail if it doesn't exist
+    this->m_resumeState.clear();
+    if (hasSavedState()) {
+        if (this->fastResume && QFile::rename(getSavedStatePath(), resumeState))
+            this->m_resumeState = resumeState;
+        else
+            QFile::remove(getSavedStatePath());
+        emit savedStateChanged();
     }
 
+    const QStringList args = getLaunchArguments();
+
     // Pass proper and valid APP_ID as DESKTOP_FILE_HINT
     QProcessEnvironment qemuEnv = QProcessEnvironment::systemEnvironment();
 
@@ -223,11 +882,15 @@ QStringList Machine::getLaunchArguments()
 {
     QStringList ret;
 
-    const bool useKvm = hasKvm() && canVirtualize() && this->enableVirtualization;
+    const bool useKvm = HostCapabilities::instance().hasKvm() && canVirtualize() && this->enableVirtualization;
     const bool isAarch64 = this->arch == QStringLiteral("aarch64");
 
     // Machine setup
-    ret << QStringLiteral("-smp") << QString::number(this->cores);
+    // Mirror the host's SMT, so that guest schedulers know which vCPUs share a core
+    const int threads = this->cores % HostTopology::instance().threadsPerCore() == 0 ?
+                HostTopology::instance().threadsPerCore() : 1;
+    ret << QStringLiteral("-smp") << QStringLiteral("%1,sockets=1,cores=%2,threads=%3")
+           .arg(this->cores).arg(this->cores / threads).arg(threads);
     ret << QStringLiteral("-m") << QStringLiteral("%1M").arg(this->mem);
 
     // Use KVM if possible
@@ -262,6 +925,8 @@ QStringList Machine::getLaunchArguments()
     if (!this->useVirglrenderer) {
         if (this->externalWindowOnly)
             ret << QStringLiteral("-display") << QStringLiteral("sdl");
+        else if (usesLocalDisplay() && this->m_displayBusProcess->state() == QProcess::Running)
+            ret << QStringLiteral("-display") << QStringLiteral("dbus,addr=%1").arg(getDisplayBusAddress());
         else
             ret << QStringLiteral("-display") << QStringLiteral("egl-headless");
 
@@ -288,12 +953,20 @@ QStringList Machine::getLaunchArguments()
     // ISO/DVD drive
     // This one likes to get lost due to content-hub clearing each app's cache during boot,
     // so add a check whether the file is actually there or not.
-    if (!this->dvd.isEmpty() && QFile::exists(this->dvd)) {
-        ret << QStringLiteral("-cdrom") << this->dvd;
+    // The drive is always there so that media can be changed through QMP.
+    const bool hasDvd = !this->dvd.isEmpty() && QFile::exists(this->dvd);
+    ret << QStringLiteral("-drive") << QStringLiteral("if=none,id=dvd0,media=cdrom,readonly=on%1")
+           .arg(hasDvd ? QStringLiteral(",format=raw,file=%1").arg(this->dvd) : QString());
+    if (isAarch64) {
+        // No IDE on "virt"
+        ret << QStringLiteral("-device") << QStringLiteral("virtio-scsi-pci,id=scsi0")
+            << QStringLiteral("-device") << QStringLiteral("scsi-cd,drive=dvd0,id=cd0");
+    } else {
+        ret << QStringLiteral("-device") << QStringLiteral("ide-cd,drive=dvd0,id=cd0");
     }
 
     // Main drive
-    ret << QStringLiteral("-drive") << QStringLiteral("if=virtio,format=qcow2,file=%1").arg(this->hdd);
+    ret << getDriveArguments();
 
     // USB and input peripherals
     ret << QStringLiteral("-device") << QStringLiteral("qemu-xhci");
@@ -320,11 +993,12 @@ QStringList Machine::getLaunchArguments()
     // Optional file sharing
     if (this->enableFileSharing) {
         ret << QStringLiteral("-chardev") << QStringLiteral("socket,id=char0,path=%1").arg(getFileSharingSocket())
-            << QStringLiteral("-device") << QStringLiteral("vhost-user-fs-pci,chardev=char0,tag=pocketvms")
-            << QStringLiteral("-object") << QStringLiteral("memory-backend-memfd,id=mem,size=%1M,share=on").arg(this->mem)
-            << QStringLiteral("-numa") << QStringLiteral("node,memdev=mem");
+            << QStringLiteral("-device") << QStringLiteral("vhost-user-fs-pci,chardev=char0,tag=pocketvms");
     }
 
+    // Guest RAM
+    ret << getMemoryArguments();
+
     // Audio over PulseAudio
     ret << "-audiodev" << "pa,id=snd0";
     ret << "-device" << "intel-hda" << "-device" << "hda-output,audiodev=snd0";
@@ -333,48 +1007,134 @@ QStringList Machine::getLaunchArguments()
     ret << "-object" << "rng-random,id=rng0,filename=/dev/urandom";
     ret << "-device" << "virtio-rng-pci,rng=rng0";
 
-    // We don't embed the VM monitor in the main app when using OpenGL
+    // Clipboard sharing between VNC clients and the guest's spice-vdagent
+    if (this->shareClipboard && !this->externalWindowOnly) {
+        ret << "-chardev" << "qemu-vdagent,id=vdagent0,name=vdagent,clipboard=on";
+        ret << "-device" << "virtio-serial-pci";
+        ret << "-device" << "virtserialport,chardev=vdagent0,name=com.redhat.spice.0";
+    }
+
+    // Memory balloon, see Machine::setBalloonSize()
+    // Free page reporting hands pages the guest freed back to the host
+    // right away, without waiting for the balloon to inflate.
+    ret << "-device" << "virtio-balloon-pci,id=balloon0,free-page-reporting=on,deflate-on-oom=on";
+
+    // We don't embed the VM monitor in the main app when using OpenGL.
+    // With the D-Bus display, VNC is still used for input and as a fallback.
     if (!this->externalWindowOnly) {
         ret << QStringLiteral("-vnc") << QStringLiteral("unix:%1").arg(QStringLiteral("%1/vnc.sock").arg(this->storage));
     }
 
+    // QMP for controlling QEMU from Machine
+    ret << QStringLiteral("-qmp") << QStringLiteral("unix:%1,server=on,wait=off").arg(getQmpSocket());
+
+    // Prewarmed: the guest only runs once start() sends "cont"
+    if (this->m_warmState == WarmingUp)
+        ret << QStringLiteral("-S");
+
+    // Continue where the VM was stopped
+    if (!this->m_resumeState.isEmpty())
+        ret << QStringLiteral("-incoming") << QStringLiteral("exec:cat %1").arg(shellQuote(this->m_resumeState));
+
     // Disable all the unnecessary QEMU windows & consoles we don't use, but keep one serial console
     ret << "-parallel" << "none" << "-serial" << "mon:stdio";
 
     return ret;
 }
 
-bool Machine::hasKvm()
+QStringList Machine::getDriveArguments() const
 {
-    const QString kvmPath = QStringLiteral("/dev/kvm");
+    QStringList ret;
 
-    if (!QFile::exists(kvmPath)) {
-        qWarning() << "KVM is not enabled on this kernel or device.";
-        return false;
+    const DiskProfile* profile = &diskProfiles[0];
+    for (const DiskProfile& candidate : diskProfiles) {
+        if (this->diskProfile == QLatin1String(candidate.name))
+            profile = &candidate;
     }
 
-    QFileInfo kvmInfo(kvmPath);
-    if (!kvmInfo.isReadable()) {
-        qWarning() << "/dev/kvm is not readable.";
-        return false;
+    if (profile == &diskProfiles[0]) {
+        ret << QStringLiteral("-drive") << QStringLiteral("if=virtio,format=qcow2,file=%1").arg(this->hdd);
+        return ret;
     }
-    if (!kvmInfo.isWritable()) {
-        qWarning() << "/dev/kvm is not writable.";
-        return false;
+
+    QStringList drive = {
+        QStringLiteral("if=none"),
+        QStringLiteral("id=hdd0"),
+        QStringLiteral("format=qcow2"),
+        QStringLiteral("file=%1").arg(this->hdd)
+    };
+    if (profile->cache)
+        drive << QStringLiteral("cache=%1").arg(profile->cache);
+    if (profile->aio)
+        drive << QStringLiteral("aio=%1").arg(profile->aio);
+    if (profile->discard)
+        drive << QStringLiteral("discard=unmap") << QStringLiteral("detect-zeroes=unmap");
+    if (profile->l2CacheSize)
+        drive << QStringLiteral("l2-cache-size=%1").arg(profile->l2CacheSize);
+    ret << QStringLiteral("-drive") << drive.join(',');
+
+    QString device = QStringLiteral("virtio-blk-pci,drive=hdd0");
+    if (profile->ioThread) {
+        ret << QStringLiteral("-object") << QStringLiteral("iothread,id=io0");
+        device += QStringLiteral(",iothread=io0");
     }
+    if (profile->discard)
+        device += QStringLiteral(",discard=on");
+    ret << QStringLiteral("-device") << device;
 
-    return true;
+    return ret;
 }
 
-bool Machine::canVirtualize() const
+QStringList Machine::getMemoryArguments() const
 {
-    // Only "arm64" and "x86_64" are supported anyway
-    const QString currentCpuType = QSysInfo::currentCpuArchitecture();
-    const QString machineType = currentCpuType == QStringLiteral("arm64") ?
-                QStringLiteral("aarch64") : currentCpuType;
-    qDebug() << "uname" << machineType << "vs arch" << this->arch;
+    QStringList ret;
+
+    // vhost-user needs the guest RAM shared with virtiofsd
+    const bool useHugepages = this->ramBackend == QStringLiteral("hugepages");
+    const bool useMemfd = this->enableFileSharing || useHugepages ||
+                          this->ramBackend == QStringLiteral("memfd");
+
+    if (!useMemfd) {
+        if (this->preallocRam)
+            ret << QStringLiteral("-mem-prealloc");
+        return ret;
+    }
+
+    QStringList backend = {
+        QStringLiteral("memory-backend-memfd"),
+        QStringLiteral("id=mem"),
+        QStringLiteral("size=%1M").arg(this->mem),
+        QStringLiteral("share=on")
+    };
+
+    if (useHugepages) {
+        qint64 pageSizeKb = 0;
+        qint64 freePages = 0;
+        const bool available = freeHugepages(&pageSizeKb, &freePages) &&
+                               freePages * pageSizeKb >= qint64(this->mem) * 1024 &&
+                               (qint64(this->mem) * 1024) % pageSizeKb == 0;
+        if (available) {
+            backend << QStringLiteral("hugetlb=on")
+                    << QStringLiteral("hugetlbsize=%1K").arg(pageSizeKb);
+        } else {
+            // QEMU would fail to start
+            qWarning() << "Not enough hugepages reserved for" << this->mem << "MB, using regular pages";
+        }
+    }
+
+    if (this->preallocRam) {
+        backend << QStringLiteral("prealloc=on")
+                << QStringLiteral("prealloc-threads=%1").arg(qMax(1, this->cores));
+    }
 
-    return (machineType == this->arch);
+    ret << QStringLiteral("-object") << backend.join(',')
+        << QStringLiteral("-numa") << QStringLiteral("node,memdev=mem");
+    return ret;
+}
+
+bool Machine::canVirtualize() const
+{
+    return HostCapabilities::instance().cpuArchitecture() == this->arch;
 }
 
 QString Machine::getFileSharingDirectory() const
@@ -389,6 +1149,27 @@ QString Machine::getFileSharingSocket() const
     return path;
 }
 
+QString Machine::getDisplayBusAddress() const
+{
+    return QStringLiteral("unix:path=%1/display-bus.sock").arg(this->storage);
+}
+
+QString Machine::getQmpSocket() const
+{
+    return QStringLiteral("%1/qmp.sock").arg(this->storage);
+}
+
+QString Machine::getSavedStatePath() const
+{
+    return QStringLiteral("%1/suspend.state").arg(this->storage);
+}
+
+bool Machine::usesLocalDisplay() const
+{
+    // The D-Bus display is only shared in memory without OpenGL
+    return this->localDisplay && !this->externalWindowOnly && !this->useVirglrenderer;
+}
+
 QObject* Machine::session()
 {
     return this->m_session;
@@ -17,13 +17,19 @@
 #ifndef MACHINE_H
 #define MACHINE_H
 
+#include <QFileSystemWatcher>
 #include <QObject>
 #include <QProcess>
 #include <QString>
 #include <QStringList>
+#include <QTimer>
 #include <QUrl>
+#include <QVariantMap>
 #include <ksession.h>
 
+#include "machine_monitor.h"
+#include "qmp_client.h"
+
 class Machine: public QObject {
     Q_OBJECT
 
@@ -41,8 +47,38 @@ class Machine: public QObject {
     Q_PROPERTY(bool useVirglrenderer MEMBER useVirglrenderer NOTIFY useVirglrendererChanged)
     Q_PROPERTY(bool externalWindowOnly MEMBER externalWindowOnly NOTIFY externalWindowOnlyChanged)
     Q_PROPERTY(bool enableVirtualization MEMBER enableVirtualization NOTIFY enableVirtualizationChanged)
+    Q_PROPERTY(bool localDisplay MEMBER localDisplay NOTIFY localDisplayChanged)
+    Q_PROPERTY(bool isTemplate MEMBER isTemplate NOTIFY isTemplateChanged)
+    Q_PROPERTY(QString backingFile MEMBER backingFile NOTIFY backingFileChanged)
+    Q_PROPERTY(QString vncEncodings MEMBER vncEncodings NOTIFY vncEncodingsChanged)
+    Q_PROPERTY(int vncCompressLevel MEMBER vncCompressLevel NOTIFY vncCompressLevelChanged)
+    Q_PROPERTY(int vncQualityLevel MEMBER vncQualityLevel NOTIFY vncQualityLevelChanged)
+    Q_PROPERTY(bool vncLowColorDepth MEMBER vncLowColorDepth NOTIFY vncLowColorDepthChanged)
+    Q_PROPERTY(bool fastResume MEMBER fastResume NOTIFY fastResumeChanged)
+    Q_PROPERTY(bool autoBalloon MEMBER autoBalloon NOTIFY autoBalloonChanged)
+    Q_PROPERTY(QString diskProfile MEMBER diskProfile NOTIFY diskProfileChanged)
+    Q_PROPERTY(bool pinVcpus MEMBER pinVcpus NOTIFY pinVcpusChanged)
+    Q_PROPERTY(QString cpuAffinity MEMBER cpuAffinity NOTIFY cpuAffinityChanged)
+    Q_PROPERTY(QString ramBackend MEMBER ramBackend NOTIFY ramBackendChanged)
+    Q_PROPERTY(bool preallocRam MEMBER preallocRam NOTIFY preallocRamChanged)
+    Q_PROPERTY(bool shareClipboard MEMBER shareClipboard NOTIFY shareClipboardChanged)
+    Q_PROPERTY(bool autoResize MEMBER autoResize NOTIFY autoResizeChanged)
+    Q_PROPERTY(bool recordDisplay MEMBER recordDisplay NOTIFY recordDisplayChanged)
+    Q_PROPERTY(bool prewarm MEMBER prewarm NOTIFY prewarmChanged)
 
     Q_PROPERTY(bool running MEMBER running NOTIFY runningChanged)
+    Q_PROPERTY(bool stopping READ isStopping NOTIFY stoppingChanged)
+    // QEMU was launched by warmUp() and holds the disks, with the guest paused
+    Q_PROPERTY(bool warm READ isWarm NOTIFY warmChanged)
+    Q_PROPERTY(bool hasSavedState READ hasSavedState NOTIFY savedStateChanged)
+    // Run state as reported by QEMU, e.g. "running", "paused" or "inmigrate"
+    Q_PROPERTY(QString status READ status NOTIFY statusChanged)
+    // Results of the last refreshStats()
+    Q_PROPERTY(QVariantMap stats READ stats NOTIFY statsChanged)
+    // Memory the guest was last asked to keep, in MB
+    Q_PROPERTY(int balloonSize READ balloonSize NOTIFY balloonSizeChanged)
+    // Resource usage while running
+    Q_PROPERTY(MachineMonitor* monitor READ monitor CONSTANT)
     Q_PROPERTY(QObject* session READ session NOTIFY sessionChanged);
 
 public:
@@ -61,6 +97,43 @@ public:
     bool useVirglrenderer = false;
     bool externalWindowOnly = false;
     bool enableVirtualization = false;
+    // Share the framebuffer through QEMU's D-Bus display instead of VNC
+    bool localDisplay = false;
+    // Templates only serve as base images for linked clones, and are never
+    // started themselves since that would corrupt them
+    bool isTemplate = false;
+    // Disk image of the template a linked clone's hdd is an overlay of
+    QString backingFile;
+    // VNC encoding choices, see VncClient
+    QString vncEncodings;
+    int vncCompressLevel = 3;
+    int vncQualityLevel = 5;
+    bool vncLowColorDepth = false;
+    // Save the VM state when stopping and resume from it on the next start
+    // instead of shutting down and booting again
+    bool fastResume = false;
+    // Take memory away from the guest while the host is short on it
+    bool autoBalloon = false;
+    // Main drive tuning: "default", "balanced", "performance" or "safe"
+    QString diskProfile = QStringLiteral("default");
+    // Keep the vCPU threads on the host CPUs in cpuAffinity, e.g. "4-7",
+    // or on the performance cores but one if it's empty
+    bool pinVcpus = false;
+    QString cpuAffinity;
+    // Guest RAM backing: "default" (anonymous memory), "memfd" (shared
+    // memory, using transparent hugepages if the host allows it for shmem)
+    // or "hugepages" (hugetlbfs, when enough pages are reserved)
+    QString ramBackend = QStringLiteral("default");
+    // Allocate all of the guest RAM upfront instead of on first touch
+    bool preallocRam = false;
+    // Clipboard channel for VNC, needs spice-vdagent in the guest
+    bool shareClipboard = false;
+    // Have the guest follow the size of the embedded display
+    bool autoResize = false;
+    // Record the VNC sessions to the storage directory, to analyze display lag
+    bool recordDisplay = false;
+    // Launch QEMU paused while the VM is looked at, see warmUp()
+    bool prewarm = false;
 
     bool running = false;
 
@@ -76,21 +149,91 @@ public:
 
     Q_INVOKABLE bool start();
     Q_INVOKABLE void stop();
-    Q_INVOKABLE void importIntoShare(const QUrl& url) const;
+    // Asks QEMU to quit at once, for when there's no event loop left to
+    // stop() the VM in; false if QMP isn't connected. The VM is gone when
+    // waitForQuit() returns true.
+    bool quitNow();
+    bool waitForQuit(int msecs);
+    // With prewarm set, launches QEMU with the guest paused, so that start()
+    // only has to resume it. coolDown() stops it again if start() wasn't
+    // called meanwhile.
+    Q_INVOKABLE void warmUp();
+    Q_INVOKABLE void coolDown();
+
+    // Guest control, only while running
+    Q_INVOKABLE bool powerdown();
+    Q_INVOKABLE bool changeDvd(const QString& path);
+    Q_INVOKABLE bool setBalloonSize(int mb);
+    Q_INVOKABLE void refreshStats();
 
     Q_INVOKABLE QString getFileSharingDirectory() const;
     Q_INVOKABLE QString getFileSharingSocket() const;
+    Q_INVOKABLE QString getDisplayBusAddress() const;
+    Q_INVOKABLE bool usesLocalDisplay() const;
+    Q_INVOKABLE QString getQmpSocket() const;
+    Q_INVOKABLE QString getSavedStatePath() const;
+
+    bool isStopping() const;
+    bool isWarm() const;
+    bool hasSavedState() const;
+    QString status() const;
+    int balloonSize() const;
+    MachineMonitor* monitor() const;
+    QVariantMap stats() const;
+    // The saved state only matches the disks and hardware it was saved with
+    Q_INVOKABLE void discardSavedState();
 
     Q_INVOKABLE bool canVirtualize() const;
 
 private:
+    // QEMU launched by warmUp(), before start() was called
+    enum WarmState {
+        Cold,
+        WarmingUp,
+        Warm
+    };
+
+    bool launch();
+    void finishStart();
+    bool startFileSharingAndQemu();
+    void waitForFileSharingSocket();
+    void stopWaitingForFileSharingSocket();
     bool startQemu();
+    void forceStop();
+    void suspendAndQuit();
+    void finishSuspend(bool success);
+    void refreshStatus();
+    void adjustBalloon();
+    void pinVcpuThreads();
+    void setStatus(const QString& value);
+    void setStopping(bool value);
+    void setWarmState(WarmState value);
     QStringList getLaunchArguments();
-    static bool hasKvm();
+    QStringList getDriveArguments() const;
+    QStringList getMemoryArguments() const;
     QObject* session();
 
     KSession* m_session = nullptr;
     QProcess* m_fileSharingProcess = nullptr;
+    QProcess* m_displayBusProcess = nullptr;
+    QFileSystemWatcher* m_fileSharingSocketWatcher = nullptr;
+    QTimer* m_fileSharingSocketTimeout = nullptr;
+
+    QmpClient* m_qmp = nullptr;
+    MachineMonitor* m_monitor = nullptr;
+    QString m_status;
+    QVariantMap m_stats;
+    QTimer* m_balloonTimer = nullptr;
+    int m_balloonSize = 0;
+    QTimer* m_stopTimeout = nullptr;
+    bool m_stopping = false;
+    // quitNow() was called
+    bool m_quitting = false;
+    // State file consumed by the running QEMU, if it was resumed
+    QString m_resumeState;
+    WarmState m_warmState = Cold;
+    // start() was called while warming up
+    bool m_startWhenWarm = false;
 
 signals:
     void nameChanged();
@@ -107,8 +250,32 @@ signals:
     void useVirglrendererChanged();
     void externalWindowOnlyChanged();
     void enableVirtualizationChanged();
+    void localDisplayChanged();
+    void isTemplateChanged();
+    void backingFileChanged();
+    void vncEncodingsChanged();
+    void vncCompressLevelChanged();
+    void vncQualityLevelChanged();
+    void vncLowColorDepthChanged();
+    void fastResumeChanged();
+    void autoBalloonChanged();
+    void diskProfileChanged();
+    void pinVcpusChanged();
+    void cpuAffinityChanged();
+    void ramBackendChanged();
+    void preallocRamChanged();
+    void shareClipboardChanged();
+    void autoResizeChanged();
+    void recordDisplayChanged();
+    void prewarmChanged();
 
     void runningChanged();
+    void stoppingChanged();
+    void warmChanged();
+    void savedStateChanged();
+    void statusChanged();
+    void statsChanged();
+    void balloonSizeChanged();
     void sessionChanged();
 
     void started();
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+
+#include <unistd.h>
+
+#include "machine_monitor.h"
+#include "qmp_client.h"
+
+static const int HISTORY_SIZE = 60;
+
+static QByteArray readProcFile(int pid, const char* name)
+{
+    QFile file(QStringLiteral("/proc/%1/%2").arg(pid).arg(QLatin1String(name)));
+    if (!file.open(QFile::ReadOnly))
+        return QByteArray();
+    return file.readAll();
+}
+
+// Value of a "Key: value" line as found in /proc/<pid>/status and io
+static qint64 procValue(const QByteArray& contents, const QByteArray& key)
+{
+    for (const QByteArray& line : contents.split('\n')) {
+        if (!line.startsWith(key))
+            continue;
+        const QList<QByteArray> fields = line.mid(key.size()).simplified().split(' ');
+        return fields.first().toLongLong();
+    }
+    return -1;
+}
+
+MachineMonitor::MachineMonitor(QmpClient* qmp, std::function<int()> pid, QObject* parent) :
+    QObject(parent),
+    m_qmp(qmp),
+    m_pid(pid)
+{
+    for (Ring& ring : this->m_history)
+        ring.samples.resize(HISTORY_SIZE);
+
+    this->m_timer.setInterval(2000);
+    QObject::connect(&this->m_timer, &QTimer::timeout, this, [=]() {
+        sample();
+    });
+    this->m_clock.start();
+}
+
+void MachineMonitor::start()
+{
+    if (this->m_timer.isActive())
+        return;
+
+    reset();
+    this->m_timer.start();
+    sample();
+    emit activeChanged();
+}
+
+void MachineMonitor::stop()
+{
+    if (!this->m_timer.isActive())
+        return;
+
+    this->m_timer.stop();
+    emit activeChanged();
+}
+
+void MachineMonitor::reset()
+{
+    this->m_lastSampleTime = -1;
+    this->m_lastCpuTicks = -1;
+    this->m_lastHostRead = -1;
+    this->m_lastHostWrite = -1;
+    this->m_lastDiskRead = -1;
+    this->m_lastDiskWrite = -1;
+    this->m_lastDiskTime = -1;
+    // Not waiting for a reply to a query from before
+    this->m_blockStatsPending = false;
+    this->m_cpuUsage = 0;
+    this->m_rss = 0;
+    this->m_diskReadRate = 0;
+    this->m_diskWriteRate = 0;
+    this->m_hostReadRate = 0;
+    this->m_hostWriteRate = 0;
+    for (Ring& ring : this->m_history) {
+        ring.next = 0;
+        ring.count = 0;
+    }
+    emit updated();
+}
+
+void MachineMonitor::sample()
+{
+    const int pid = this->m_pid();
+    if (pid <= 0)
+        return;
+
+    const qint64 now = this->m_clock.nsecsElapsed();
+    const double elapsed = this->m_lastSampleTime < 0 ? 0.0 : (now - this->m_lastSampleTime) / 1e9;
+    this->m_lastSampleTime = now;
+
+    // The command name may contain spaces, so count the fields after it.
+    // utime and stime are the 14th and 15th fields.
+    const QByteArray stat = readProcFile(pid, "stat");
+    const int commandEnd = stat.lastIndexOf(')');
+    if (commandEnd >= 0) {
+        const QList<QByteArray> fields = stat.mid(commandEnd + 2).split(' ');
+        if (fields.count() > 12) {
+            static const double ticksPerSecond = sysconf(_SC_CLK_TCK);
+            const qint64 ticks = fields.at(11).toLongLong() + fields.at(12).toLongLong();
+            if (this->m_lastCpuTicks >= 0 && elapsed > 0)
+                this->m_cpuUsage = (ticks - this->m_lastCpuTicks) / ticksPerSecond / elapsed * 100.0;
+            this->m_lastCpuTicks = ticks;
+        }
+    }
+
+    const qint64 rssKb = procValue(readProcFile(pid, "status"), "VmRSS:");
+    if (rssKb >= 0)
+        this->m_rss = rssKb * 1024;
+
+    const QByteArray io = readProcFile(pid, "io");
+    const qint64 hostRead = procValue(io, "read_bytes:");
+    const qint64 hostWrite = procValue(io, "write_bytes:");
+    if (hostRead >= 0 && hostWrite >= 0) {
+        if (this->m_lastHostRead >= 0 && elapsed > 0) {
+            this->m_hostReadRate = (hostRead - this->m_lastHostRead) / elapsed;
+            this->m_hostWriteRate = (hostWrite - this->m_lastHostWrite) / elapsed;
+        }
+        this->m_lastHostRead = hostRead;
+        this->m_lastHostWrite = hostWrite;
+    }
+
+    append(CpuHistory, this->m_cpuUsage);
+    append(RssHistory, this->m_rss);
+    emit updated();
+
+    sampleBlockStats();
+}
+
+void MachineMonitor::sampleBlockStats()
+{
+    // Don't pile up commands if QEMU is busy
+    if (!this->m_qmp->isReady() || this->m_blockStatsPending)
+        return;
+
+    this->m_blockStatsPending = true;
+    this->m_qmp->execute(QStringLiteral("query-blockstats"), QJsonObject(), [=](const QJsonValue& result, const QString& error) {
+        this->m_blockStatsPending = false;
+        if (!error.isEmpty() || !this->m_timer.isActive())
+            return;
+
+        qint64 read = 0;
+        qint64 written = 0;
+        for (const QJsonValue& device : result.toArray()) {
+            const QJsonObject stats = device.toObject().value(QStringLiteral("stats")).toObject();
+            read += stats.value(QStringLiteral("rd_bytes")).toVariant().toLongLong();
+            written += stats.value(QStringLiteral("wr_bytes")).toVariant().toLongLong();
+        }
+
+        // Timed on arrival, QMP replies may be late
+        const qint64 now = this->m_clock.nsecsElapsed();
+        if (this->m_lastDiskTime >= 0 && now > this->m_lastDiskTime) {
+            const double elapsed = (now - this->m_lastDiskTime) / 1e9;
+            this->m_diskReadRate = (read - this->m_lastDiskRead) / elapsed;
+            this->m_diskWriteRate = (written - this->m_lastDiskWrite) / elapsed;
+        }
+        this->m_lastDiskTime = now;
+        this->m_lastDiskRead = read;
+        this->m_lastDiskWrite = written;
+
+        append(DiskReadHistory, this->m_diskReadRate);
+        append(DiskWriteHistory, this->m_diskWriteRate);
+        emit updated();
+    });
+}
+
+void MachineMonitor::append(History history, double value)
+{
+    Ring& ring = this->m_history[history];
+    ring.samples[ring.next] = value;
+    ring.next = (ring.next + 1) % HISTORY_SIZE;
+    ring.count = qMin(ring.count + 1, HISTORY_SIZE);
+}
+
+QVariantList MachineMonitor::history(History history) const
+{
+    const Ring& ring = this->m_history[history];
+    QVariantList ret;
+    ret.reserve(ring.count);
+    const int first = (ring.next - ring.count + HISTORY_SIZE) % HISTORY_SIZE;
+    for (int i = 0; i < ring.count; i++)
+        ret << ring.samples.at((first + i) % HISTORY_SIZE);
+    return ret;
+}
+
+int MachineMonitor::interval() const
+{
+    return this->m_timer.interval();
+}
+
+void MachineMonitor::setInterval(int interval)
+{
+    interval = qMax(interval, 250);
+    if (interval == this->m_timer.interval())
+        return;
+
+    this->m_timer.setInterval(interval);
+    emit intervalChanged();
+}
+
+int MachineMonitor::historySize() const
+{
+    return HISTORY_SIZE;
+}
+
+bool MachineMonitor::active() const
+{
+    return this->m_timer.isActive();
+}
+
+double MachineMonitor::cpuUsage() const
+{
+    return this->m_cpuUsage;
+}
+
+qint64 MachineMonitor::rss() const
+{
+    return this->m_rss;
+}
+
+double MachineMonitor::diskReadRate() const
+{
+    return this->m_diskReadRate;
+}
+
+double MachineMonitor::diskWriteRate() const
+{
+    return this->m_diskWriteRate;
+}
+
+double MachineMonitor::hostReadRate() const
+{
+    return this->m_hostReadRate;
+}
+
+double MachineMonitor::hostWriteRate() const
+{
+    return this->m_hostWriteRate;
+}
+
+QVariantList MachineMonitor::cpuHistory() const
+{
+    return history(CpuHistory);
+}
+
+QVariantList MachineMonitor::rssHistory() const
+{
+    return history(RssHistory);
+}
+
+QVariantList MachineMonitor::diskReadHistory() const
+{
+    return history(DiskReadHistory);
+}
+
+QVariantList MachineMonitor::diskWriteHistory() const
+{
+    return history(DiskWriteHistory);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MACHINE_MONITOR_H
+#define MACHINE_MONITOR_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+#include <QVariantList>
+#include <QVector>
+
+#include <functional>
+
+class QmpClient;
+
+// Samples what a running VM costs the host: CPU time, memory and I/O
+// of the QEMU process from /proc, and the guest's disk I/O through QMP.
+// One sample is a few small file reads and one QMP command.
+class MachineMonitor : public QObject {
+    Q_OBJECT
+
+    Q_PROPERTY(int interval READ interval WRITE setInterval NOTIFY intervalChanged)
+    Q_PROPERTY(int historySize READ historySize CONSTANT)
+    Q_PROPERTY(bool active READ active NOTIFY activeChanged)
+
+    // Percent of one host CPU, may exceed 100 with several vCPUs
+    Q_PROPERTY(double cpuUsage READ cpuUsage NOTIFY updated)
+    // Resident memory of the QEMU process in bytes
+    Q_PROPERTY(qint64 rss READ rss NOTIFY updated)
+    // Guest disk throughput in bytes per second
+    Q_PROPERTY(double diskReadRate READ diskReadRate NOTIFY updated)
+    Q_PROPERTY(double diskWriteRate READ diskWriteRate NOTIFY updated)
+    // Host storage throughput of the QEMU process in bytes per second
+    Q_PROPERTY(double hostReadRate READ hostReadRate NOTIFY updated)
+    Q_PROPERTY(double hostWriteRate READ hostWriteRate NOTIFY updated)
+
+    // Oldest sample first
+    Q_PROPERTY(QVariantList cpuHistory READ cpuHistory NOTIFY updated)
+    Q_PROPERTY(QVariantList rssHistory READ rssHistory NOTIFY updated)
+    Q_PROPERTY(QVariantList diskReadHistory READ diskReadHistory NOTIFY updated)
+    Q_PROPERTY(QVariantList diskWriteHistory READ diskWriteHistory NOTIFY updated)
+
+public:
+    MachineMonitor(QmpClient* qmp, std::function<int()> pid, QObject* parent = nullptr);
+
+    void start();
+    void stop();
+    Q_INVOKABLE void reset();
+
+    int interval() const;
+    void setInterval(int interval);
+    int historySize() const;
+    bool active() const;
+
+    double cpuUsage() const;
+    qint64 rss() const;
+    double diskReadRate() const;
+    double diskWriteRate() const;
+    double hostReadRate() const;
+    double hostWriteRate() const;
+
+    QVariantList cpuHistory() const;
+    QVariantList rssHistory() const;
+    QVariantList diskReadHistory() const;
+    QVariantList diskWriteHistory() const;
+
+private:
+    enum History {
+        CpuHistory = 0,
+        RssHistory,
+        DiskReadHistory,
+        DiskWriteHistory,
+        HistoryCount
+    };
+
+    // Fixed size ring of samples
+    struct Ring {
+        QVector<double> samples;
+        int next = 0;
+        int count = 0;
+    };
+
+    void sample();
+    void sampleBlockStats();
+    void append(History history, double value);
+    QVariantList history(History history) const;
+
+    QmpClient* m_qmp;
+    std::function<int()> m_pid;
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    bool m_blockStatsPending = false;
+
+    // Totals of the previous sample, -1 before the first one
+    qint64 m_lastSampleTime = -1;
+    qint64 m_lastCpuTicks = -1;
+    qint64 m_lastHostRead = -1;
+    qint64 m_lastHostWrite = -1;
+    qint64 m_lastDiskRead = -1;
+    qint64 m_lastDiskWrite = -1;
+    qint64 m_lastDiskTime = -1;
+
+    double m_cpuUsage = 0;
+    qint64 m_rss = 0;
+    double m_diskReadRate = 0;
+    double m_diskWriteRate = 0;
+    double m_hostReadRate = 0;
+    double m_hostWriteRate = 0;
+    Ring m_history[HistoryCount];
+
+signals:
+    void intervalChanged();
+    void activeChanged();
+    void updated();
+};
+
+#endif
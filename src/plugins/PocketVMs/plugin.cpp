@@ -20,12 +20,15 @@
 #include "vmmanager.h"
 #include "vnc_client.h"
 #include "vnc_output.h"
+#include "vnc_statistics.h"
 
 void ExamplePlugin::registerTypes(const char *uri) {
     //@uri VMManager
     qmlRegisterType<Machine>(uri, 1, 0, "Machine");
+    qmlRegisterUncreatableType<MachineMonitor>(uri, 1, 0, "MachineMonitor", "Provided by Machine.monitor");
     qmlRegisterSingletonType<VMManager>(uri, 1, 0, "VMManager", [](QQmlEngine*, QJSEngine*) -> QObject* { return new VMManager; });
     using namespace LomiriVNC;
     qmlRegisterType<VncClient>(uri, 1, 0, "VncClient");
     qmlRegisterType<VncOutput>(uri, 1, 0, "VncOutput");
+    qmlRegisterType<VncStatistics>(uri, 1, 0, "VncStatistics");
 }
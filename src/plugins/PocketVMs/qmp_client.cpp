@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QDebug>
+#include <QJsonDocument>
+
+#include "qmp_client.h"
+
+QmpClient::QmpClient(QObject* parent) : QObject(parent)
+{
+    this->m_socket = new QLocalSocket(this);
+    QObject::connect(this->m_socket, &QLocalSocket::readyRead, this, [=]() {
+        readMessages();
+    });
+    QObject::connect(this->m_socket, &QLocalSocket::disconnected, this, [=]() {
+        const bool wasReady = this->m_ready;
+        reset();
+        if (wasReady)
+            emit disconnected();
+    });
+    QObject::connect(this->m_socket, QOverload<QLocalSocket::LocalSocketError>::of(&QLocalSocket::error),
+                     this, [=](QLocalSocket::LocalSocketError err) {
+        const bool retry = err == QLocalSocket::ServerNotFoundError ||
+                           err == QLocalSocket::ConnectionRefusedError;
+        if (retry && !this->m_path.isEmpty() && this->m_connectTime.elapsed() < this->m_timeout) {
+            this->m_retryTimer->start();
+            return;
+        }
+        if (err != QLocalSocket::PeerClosedError)
+            qWarning() << "QMP connection to" << this->m_path << "failed:" << this->m_socket->errorString();
+    });
+
+    static const int RETRY_INTERVAL_MS = 100;
+    this->m_retryTimer = new QTimer(this);
+    this->m_retryTimer->setSingleShot(true);
+    this->m_retryTimer->setInterval(RETRY_INTERVAL_MS);
+    QObject::connect(this->m_retryTimer, &QTimer::timeout, this, [=]() {
+        tryConnect();
+    });
+}
+
+void QmpClient::connectToServer(const QString& path, int timeout)
+{
+    disconnectFromServer();
+
+    this->m_path = path;
+    this->m_timeout = timeout;
+    this->m_connectTime.start();
+    tryConnect();
+}
+
+void QmpClient::disconnectFromServer()
+{
+    this->m_path.clear();
+    this->m_retryTimer->stop();
+    this->m_socket->abort();
+    reset();
+}
+
+bool QmpClient::isReady() const
+{
+    return this->m_ready;
+}
+
+void QmpClient::execute(const QString& command, const QJsonObject& arguments, Callback callback)
+{
+    // Sent from a callback failing in reset(), for the connection that's gone
+    if (this->m_resetting) {
+        if (callback)
+            callback(QJsonValue(), QStringLiteral("disconnected"));
+        return;
+    }
+
+    if (!this->m_ready) {
+        this->m_queue.append(Pending { command, arguments, callback });
+        return;
+    }
+
+    send(command, arguments, callback);
+}
+
+void QmpClient::flush()
+{
+    this->m_socket->flush();
+}
+
+bool QmpClient::waitForDisconnected(int msecs)
+{
+    this->m_socket->flush();
+    return this->m_socket->waitForDisconnected(msecs);
+}
+
+void QmpClient::tryConnect()
+{
+    if (this->m_path.isEmpty())
+        return;
+
+    this->m_socket->abort();
+    this->m_socket->connectToServer(this->m_path);
+}
+
+void QmpClient::readMessages()
+{
+    this->m_buffer.append(this->m_socket->readAll());
+
+    // Every message is a single line of JSON
+    int end;
+    while ((end = this->m_buffer.indexOf('\n')) >= 0) {
+        const QByteArray line = this->m_buffer.left(end).trimmed();
+        this->m_buffer.remove(0, end + 1);
+        if (line.isEmpty())
+            continue;
+
+        QJsonParseError parseError;
+        const QJsonDocument doc = QJsonDocument::fromJson(line, &parseError);
+        if (!doc.isObject()) {
+            qWarning() << "Invalid QMP message:" << parseError.errorString() << line;
+            continue;
+        }
+        handleMessage(doc.object());
+    }
+}
+
+void QmpClient::handleMessage(const QJsonObject& message)
+{
+    // The greeting, commands are only accepted after negotiating capabilities
+    if (message.contains(QStringLiteral("QMP"))) {
+        send(QStringLiteral("qmp_capabilities"), QJsonObject(), [=](const QJsonValue&, const QString& error) {
+            if (!error.isEmpty()) {
+                qWarning() << "QMP capabilities negotiation failed:" << error;
+                return;
+            }
+
+            this->m_ready = true;
+            const QList<Pending> queue = this->m_queue;
+            this->m_queue.clear();
+            for (const Pending& pending : queue)
+                send(pending.command, pending.arguments, pending.callback);
+            emit ready();
+        });
+        return;
+    }
+
+    if (message.contains(QStringLiteral("event"))) {
+        emit event(message.value(QStringLiteral("event")).toString(),
+                   message.value(QStringLiteral("data")).toObject());
+        return;
+    }
+
+    const qint64 id = message.value(QStringLiteral("id")).toVariant().toLongLong();
+    if (!this->m_callbacks.contains(id))
+        return;
+
+    const Callback callback = this->m_callbacks.take(id);
+    if (!callback)
+        return;
+
+    if (message.contains(QStringLiteral("error"))) {
+        const QJsonObject error = message.value(QStringLiteral("error")).toObject();
+        callback(QJsonValue(), error.value(QStringLiteral("desc")).toString());
+    } else {
+        callback(message.value(QStringLiteral("return")), QString());
+    }
+}
+
+void QmpClient::send(const QString& command, const QJsonObject& arguments, Callback callback)
+{
+    const qint64 id = this->m_nextId++;
+    this->m_callbacks.insert(id, callback);
+
+    QJsonObject message;
+    message.insert(QStringLiteral("execute"), command);
+    if (!arguments.isEmpty())
+        message.insert(QStringLiteral("arguments"), arguments);
+    message.insert(QStringLiteral("id"), id);
+
+    this->m_socket->write(QJsonDocument(message).toJson(QJsonDocument::Compact) + '\n');
+}
+
+void QmpClient::reset()
+{
+    this->m_ready = false;
+    this->m_buffer.clear();
+
+    // Nothing is going to answer these anymore
+    QList<Callback> orphaned = this->m_callbacks.values();
+    for (const Pending& pending : this->m_queue)
+        orphaned << pending.callback;
+    this->m_callbacks.clear();
+    this->m_queue.clear();
+
+    this->m_resetting = true;
+    for (const Callback& callback : orphaned) {
+        if (callback)
+            callback(QJsonValue(), QStringLiteral("disconnected"));
+    }
+    this->m_resetting = false;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QMP_CLIENT_H
+#define QMP_CLIENT_H
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMap>
+#include <QJsonObject>
+#include <QJsonValue>
+#include <QLocalSocket>
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+#include <functional>
+
+// Asynchronous client for the QEMU Machine Protocol on a unix socket.
+// Commands may be sent right after connecting, they're queued until the
+// capabilities negotiation is done. Every callback is called exactly once,
+// with the error "disconnected" if the connection went away before QEMU
+// answered.
+class QmpClient : public QObject {
+    Q_OBJECT
+
+public:
+    // Either the "return" value of a command or its error description
+    typedef std::function<void(const QJsonValue& result, const QString& error)> Callback;
+
+    QmpClient(QObject* parent = nullptr);
+
+    // QEMU creates the socket some time after it was started, so keep
+    // trying for up to timeout milliseconds
+    void connectToServer(const QString& path, int timeout = 10000);
+    void disconnectFromServer();
+    bool isReady() const;
+
+    void execute(const QString& command,
+                 const QJsonObject& arguments = QJsonObject(),
+                 Callback callback = nullptr);
+
+    // Only for when there's no event loop, e.g. during destruction
+    void flush();
+    bool waitForDisconnected(int msecs);
+
+signals:
+    void ready();
+    void disconnected();
+    void event(QString name, QJsonObject data);
+
+private:
+    void tryConnect();
+    void readMessages();
+    void handleMessage(const QJsonObject& message);
+    void send(const QString& command, const QJsonObject& arguments, Callback callback);
+    void reset();
+
+    struct Pending {
+        QString command;
+        QJsonObject arguments;
+        Callback callback;
+    };
+
+    QLocalSocket* m_socket = nullptr;
+    QTimer* m_retryTimer = nullptr;
+    QElapsedTimer m_connectTime;
+    QString m_path;
+    int m_timeout = 0;
+    bool m_ready = false;
+    QByteArray m_buffer;
+    qint64 m_nextId = 0;
+    // Ordered, so that callbacks fail in the order the commands were sent
+    QMap<qint64, Callback> m_callbacks;
+    QList<Pending> m_queue;
+    bool m_resetting = false;
+};
+
+#endif
@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rfb_recorder.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QtEndian>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace LomiriVNC;
+
+static const char magic[] = "PVMSRFB";
+static const quint8 version = 2;
+/* Version 1 recordings are read too, they store the chunks as is */
+static const quint8 uncompressedVersion = 1;
+static const int bufferSize = 64 * 1024;
+/* Way more than any chunk read from a socket */
+static const quint32 maxChunkSize = 64 * 1024 * 1024;
+
+static int connectUnix(const QString &path)
+{
+    const QByteArray name = path.toLocal8Bit();
+    sockaddr_un address;
+    if (name.size() >= int(sizeof(address.sun_path))) return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, name.constData(), name.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool writeAll(int fd, const char *data, int size)
+{
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+RfbRecording::RfbRecording(QIODevice *device):
+    m_device(device),
+    m_stream(nullptr),
+    m_compressed(false),
+    m_writing(false)
+{
+}
+
+RfbRecording::~RfbRecording()
+{
+    if (!m_stream) return;
+    if (m_writing) {
+        deflateEnd(m_stream);
+    } else {
+        inflateEnd(m_stream);
+    }
+    delete m_stream;
+}
+
+bool RfbRecording::writeHeader(int bytesPerPixel)
+{
+    const char header[] = {
+        magic[0], magic[1], magic[2], magic[3], magic[4], magic[5], magic[6],
+        char(version), char(bytesPerPixel),
+    };
+    if (m_stream || m_device->write(header, sizeof(header)) != sizeof(header)) {
+        return false;
+    }
+
+    /* The relay thread compresses while it passes the data on, so it
+     * has to be fast rather than as small as possible */
+    m_stream = new z_stream;
+    memset(m_stream, 0, sizeof(z_stream));
+    if (deflateInit(m_stream, Z_BEST_SPEED) != Z_OK) {
+        delete m_stream;
+        m_stream = nullptr;
+        return false;
+    }
+    m_writing = true;
+    m_compressed = true;
+    m_buffer.resize(bufferSize);
+    return true;
+}
+
+bool RfbRecording::writeChunk(quint32 time, const char *data, int size)
+{
+    if (Q_UNLIKELY(!m_writing)) return false;
+
+    const quint32 header[] = {
+        qToBigEndian(time),
+        qToBigEndian(quint32(size)),
+    };
+    return deflateTo(reinterpret_cast<const char*>(header), sizeof(header),
+                     Z_NO_FLUSH) &&
+        deflateTo(data, size, Z_NO_FLUSH);
+}
+
+bool RfbRecording::finish()
+{
+    return m_writing && deflateTo(nullptr, 0, Z_FINISH);
+}
+
+bool RfbRecording::deflateTo(const char *data, int size, int flush)
+{
+    m_stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    m_stream->avail_in = size;
+    do {
+        m_stream->next_out = reinterpret_cast<Bytef*>(m_buffer.data());
+        m_stream->avail_out = m_buffer.size();
+        if (deflate(m_stream, flush) == Z_STREAM_ERROR) return false;
+        const int n = m_buffer.size() - m_stream->avail_out;
+        if (n > 0 && m_device->write(m_buffer.constData(), n) != n) {
+            return false;
+        }
+    } while (m_stream->avail_out == 0);
+    return true;
+}
+
+int RfbRecording::readHeader()
+{
+    char header[9];
+    if (m_stream || m_device->read(header, sizeof(header)) != sizeof(header) ||
+        memcmp(header, magic, 7) != 0) {
+        return 0;
+    }
+    const quint8 headerVersion = quint8(header[7]);
+    if (headerVersion == version) {
+        m_stream = new z_stream;
+        memset(m_stream, 0, sizeof(z_stream));
+        if (inflateInit(m_stream) != Z_OK) {
+            delete m_stream;
+            m_stream = nullptr;
+            return 0;
+        }
+        m_compressed = true;
+        m_buffer.resize(bufferSize);
+    } else if (headerVersion != uncompressedVersion) {
+        qWarning() << "Unsupported RFB recording version" << int(headerVersion);
+        return 0;
+    }
+    const int bytesPerPixel = header[8];
+    return bytesPerPixel == 2 || bytesPerPixel == 4 ? bytesPerPixel : 0;
+}
+
+bool RfbRecording::readChunk(quint32 *time, QByteArray *data)
+{
+    quint32 header[2];
+    if (!read(reinterpret_cast<char*>(header), sizeof(header))) return false;
+    const quint32 size = qFromBigEndian(header[1]);
+    if (Q_UNLIKELY(size > maxChunkSize)) return false;
+
+    *time = qFromBigEndian(header[0]);
+    data->resize(size);
+    return read(data->data(), size);
+}
+
+bool RfbRecording::read(char *data, int size)
+{
+    if (!m_compressed) return m_device->read(data, size) == size;
+
+    /* A recording which wasn't finished ends with the last whole chunk */
+    m_stream->next_out = reinterpret_cast<Bytef*>(data);
+    m_stream->avail_out = size;
+    while (m_stream->avail_out > 0) {
+        if (m_stream->avail_in == 0) {
+            const qint64 n = m_device->read(m_buffer.data(), m_buffer.size());
+            if (n <= 0) return false;
+            m_stream->next_in = reinterpret_cast<Bytef*>(m_buffer.data());
+            m_stream->avail_in = uInt(n);
+        }
+        const int ret = inflate(m_stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) return m_stream->avail_out == 0;
+        if (ret != Z_OK) return false;
+    }
+    return true;
+}
+
+RfbRelay::RfbRelay():
+    QThread(),
+    m_listenFd(-1)
+{
+    if (pipe2(m_wakeFds, O_CLOEXEC) < 0) {
+        m_wakeFds[0] = m_wakeFds[1] = -1;
+    }
+}
+
+RfbRelay::~RfbRelay()
+{
+    stop();
+    wait();
+    if (m_listenFd >= 0) close(m_listenFd);
+    if (m_wakeFds[0] >= 0) close(m_wakeFds[0]);
+    if (m_wakeFds[1] >= 0) close(m_wakeFds[1]);
+}
+
+QString RfbRelay::listen()
+{
+    if (!m_dir.isValid() || m_wakeFds[0] < 0) return QString();
+
+    const QString path = m_dir.filePath(QStringLiteral("relay.sock"));
+    const QByteArray name = path.toLocal8Bit();
+    sockaddr_un address;
+    if (name.size() >= int(sizeof(address.sun_path))) return QString();
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, name.constData(), name.size());
+
+    m_listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listenFd < 0 ||
+        bind(m_listenFd, reinterpret_cast<sockaddr*>(&address),
+             sizeof(address)) < 0 ||
+        ::listen(m_listenFd, 1) < 0) {
+        qWarning() << "Could not listen on" << path << strerror(errno);
+        return QString();
+    }
+
+    start();
+    return path;
+}
+
+void RfbRelay::stop()
+{
+    if (m_wakeFds[1] >= 0) {
+        const char c = 0;
+        ssize_t ret = write(m_wakeFds[1], &c, 1);
+        Q_UNUSED(ret);
+    }
+}
+
+int RfbRelay::accept()
+{
+    if (!waitReadable(m_listenFd)) return -1;
+    return accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+}
+
+bool RfbRelay::waitReadable(int fd, int timeout)
+{
+    pollfd fds[] = {
+        { fd, POLLIN, 0 },
+        { m_wakeFds[0], POLLIN, 0 },
+    };
+    int ret;
+    do {
+        ret = poll(fds, 2, timeout);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 && fds[1].revents == 0 && fds[0].revents != 0;
+}
+
+bool RfbRelay::isStopping() const
+{
+    pollfd fd = { m_wakeFds[0], POLLIN, 0 };
+    return poll(&fd, 1, 0) > 0;
+}
+
+RfbRecorder::RfbRecorder(const QString &host, const QString &fileName,
+                         int bytesPerPixel):
+    RfbRelay(),
+    m_host(host),
+    m_file(fileName),
+    m_bytesPerPixel(bytesPerPixel)
+{
+}
+
+RfbRecorder::~RfbRecorder()
+{
+    /* run() must be over before the members go */
+    stop();
+    wait();
+}
+
+void RfbRecorder::run()
+{
+    const int client = accept();
+    if (client < 0) return;
+
+    const int server = connectUnix(m_host);
+    if (server < 0) {
+        qWarning() << "Could not connect to" << m_host << strerror(errno);
+        close(client);
+        return;
+    }
+
+    /* Still relay if the recording can't be written */
+    RfbRecording recording(&m_file);
+    bool writing = m_file.open(QIODevice::WriteOnly | QIODevice::Truncate) &&
+        recording.writeHeader(m_bytesPerPixel);
+    if (!writing) {
+        qWarning() << "Could not record to" << m_file.fileName();
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+    char buffer[64 * 1024];
+    while (true) {
+        pollfd fds[] = {
+            { client, POLLIN, 0 },
+            { server, POLLIN, 0 },
+            { m_wakeFds[0], POLLIN, 0 },
+        };
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[2].revents) break;
+
+        if (fds[1].revents) {
+            ssize_t n = read(server, buffer, sizeof(buffer));
+            if (n <= 0) break;
+            if (writing) {
+                writing = recording.writeChunk(quint32(clock.elapsed()),
+                                               buffer, n);
+            }
+            if (!writeAll(client, buffer, n)) break;
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(client, buffer, sizeof(buffer));
+            if (n <= 0) break;
+            if (!writeAll(server, buffer, n)) break;
+        }
+    }
+
+    if (writing && !recording.finish()) {
+        qWarning() << "Could not finish recording" << m_file.fileName();
+    }
+    m_file.close();
+    close(server);
+    close(client);
+}
+
+RfbReplayer::RfbReplayer(const QString &fileName, bool realTime):
+    RfbRelay(),
+    m_file(fileName),
+    m_recording(&m_file),
+    m_bytesPerPixel(0),
+    m_realTime(realTime)
+{
+    if (m_file.open(QIODevice::ReadOnly)) {
+        m_bytesPerPixel = m_recording.readHeader();
+    }
+    if (m_bytesPerPixel == 0) {
+        qWarning() << "Not an RFB recording:" << fileName;
+    }
+}
+
+RfbReplayer::~RfbReplayer()
+{
+    stop();
+    wait();
+}
+
+void RfbReplayer::run()
+{
+    const int client = accept();
+    if (client < 0) return;
+
+    QElapsedTimer clock;
+    clock.start();
+    quint32 time;
+    QByteArray data;
+    while (m_recording.readChunk(&time, &data)) {
+        if (m_realTime && !sleepUntil(client, clock, time)) break;
+        if (!deliver(client, data.constData(), data.size())) break;
+    }
+
+    close(client);
+}
+
+bool RfbReplayer::sleepUntil(int fd, const QElapsedTimer &clock, qint64 time)
+{
+    /* Whatever the client sends meanwhile is of no interest */
+    qint64 delay;
+    while ((delay = time - clock.elapsed()) > 0) {
+        if (!waitReadable(fd, int(delay))) {
+            if (isStopping()) return false;
+            continue;
+        }
+        char discard[4096];
+        if (read(fd, discard, sizeof(discard)) <= 0) return false;
+    }
+    return true;
+}
+
+bool RfbReplayer::deliver(int fd, const char *data, int size)
+{
+    /* Keep reading from the client, so that its writes never block */
+    while (size > 0) {
+        pollfd fds[] = {
+            { fd, POLLIN | POLLOUT, 0 },
+            { m_wakeFds[0], POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (fds[1].revents) return false;
+        if (fds[0].revents & (POLLERR | POLLHUP)) return false;
+
+        if (fds[0].revents & POLLIN) {
+            char discard[4096];
+            if (read(fd, discard, sizeof(discard)) <= 0) return false;
+        }
+        if (fds[0].revents & POLLOUT) {
+            ssize_t n = send(fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LOMIRIVNC_RFB_RECORDER_H
+#define LOMIRIVNC_RFB_RECORDER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+#include <QTemporaryDir>
+#include <QThread>
+
+class QIODevice;
+struct z_stream_s;
+
+namespace LomiriVNC {
+
+/* Recordings of what a VNC server sent: the "PVMSRFB" magic, a version
+ * byte and the bytes per pixel the client asked for, then the data in
+ * chunks, as it was read from the socket. Each chunk has the milliseconds
+ * since the start and its size, both as big endian 32 bit integers.
+ * Since version 2 the chunks are one zlib stream; version 1 recordings,
+ * stored as is, can still be read. */
+class RfbRecording
+{
+public:
+    explicit RfbRecording(QIODevice *device);
+    ~RfbRecording();
+
+    bool writeHeader(int bytesPerPixel);
+    bool writeChunk(quint32 time, const char *data, int size);
+    /* Ends the stream; without it, data still in zlib's buffers is lost */
+    bool finish();
+    /* Returns the bytes per pixel, or 0 if this isn't a recording */
+    int readHeader();
+    bool readChunk(quint32 *time, QByteArray *data);
+
+private:
+    Q_DISABLE_COPY(RfbRecording)
+
+    bool deflateTo(const char *data, int size, int flush);
+    bool read(char *data, int size);
+
+    QIODevice *m_device;
+    z_stream_s *m_stream;
+    bool m_compressed;
+    bool m_writing;
+    QByteArray m_buffer;
+};
+
+/* Serves a single VNC client on a private socket, from its own thread:
+ * libvncclient connects there as it would to a server. */
+class RfbRelay: public QThread
+{
+public:
+    ~RfbRelay();
+
+    /* Returns the address to connect to, or an empty string on failure */
+    QString listen();
+    void stop();
+
+protected:
+    RfbRelay();
+
+    /* Waits for the client, returns its socket or -1 if stopped */
+    int accept();
+    /* Waits until `fd` can be read, false if stopped or on error */
+    bool waitReadable(int fd, int timeout = -1);
+    bool isStopping() const;
+
+    int m_wakeFds[2];
+
+private:
+    QTemporaryDir m_dir;
+    int m_listenFd;
+};
+
+/* Passes a connection through to a server on a unix socket, writing all
+ * the server sends to a recording */
+class RfbRecorder: public RfbRelay
+{
+public:
+    RfbRecorder(const QString &host, const QString &fileName,
+                int bytesPerPixel);
+    ~RfbRecorder();
+
+protected:
+    void run() override;
+
+private:
+    QString m_host;
+    QFile m_file;
+    int m_bytesPerPixel;
+};
+
+/* Plays a recording back, either at the pace it was recorded or as fast as
+ * the client takes it. The connection is closed at the end of it. */
+class RfbReplayer: public RfbRelay
+{
+public:
+    RfbReplayer(const QString &fileName, bool realTime);
+    ~RfbReplayer();
+
+    /* Bytes per pixel of the recording, or 0 if it can't be read */
+    int bytesPerPixel() const { return m_bytesPerPixel; }
+
+protected:
+    void run() override;
+
+private:
+    bool sleepUntil(int fd, const QElapsedTimer &clock, qint64 time);
+    bool deliver(int fd, const char *data, int size);
+
+    QFile m_file;
+    RfbRecording m_recording;
+    int m_bytesPerPixel;
+    bool m_realTime;
+};
+
+} // namespace
+
+#endif // LOMIRIVNC_RFB_RECORDER_H
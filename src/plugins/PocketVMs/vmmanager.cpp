@@ -16,21 +16,31 @@
 
 #include <QCoreApplication>
 #include <QDebug>
-#include <QDirIterator>
+#include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QFileInfo>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMetaProperty>
 #include <QQmlEngine>
+#include <QRegularExpression>
 #include <QStandardPaths>
 #include <QString>
 #include <QUuid>
 #include <QVariant>
+#include <QtConcurrent>
 
+#include <cstdio>
+#include <functional>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/sysinfo.h>
 
+#include "file_transfer.h"
+#include "host_capabilities.h"
+#include "host_topology.h"
 #include "vmmanager.h"
 
 const QString KEY_STORAGE = QStringLiteral("storage");
@@ -46,6 +56,24 @@ const QString KEY_ENABLEFILESHARING = QStringLiteral("enableFileSharing");
 const QString KEY_VIRGLRENDERER = QStringLiteral("useVirglrenderer");
 const QString KEY_EXTERNAL_WINDOW_ONLY = QStringLiteral("externalWindowOnly");
 const QString KEY_ENABLE_VIRTUALIZATION = QStringLiteral("enableVirtualization");
+const QString KEY_LOCAL_DISPLAY = QStringLiteral("localDisplay");
+const QString KEY_TEMPLATE = QStringLiteral("template");
+const QString KEY_BACKING_FILE = QStringLiteral("backingFile");
+const QString KEY_VNC_ENCODINGS = QStringLiteral("vncEncodings");
+const QString KEY_VNC_COMPRESS_LEVEL = QStringLiteral("vncCompressLevel");
+const QString KEY_VNC_QUALITY_LEVEL = QStringLiteral("vncQualityLevel");
+const QString KEY_VNC_LOW_COLOR_DEPTH = QStringLiteral("vncLowColorDepth");
+const QString KEY_FAST_RESUME = QStringLiteral("fastResume");
+const QString KEY_AUTO_BALLOON = QStringLiteral("autoBalloon");
+const QString KEY_DISK_PROFILE = QStringLiteral("diskProfile");
+const QString KEY_PIN_VCPUS = QStringLiteral("pinVcpus");
+const QString KEY_CPU_AFFINITY = QStringLiteral("cpuAffinity");
+const QString KEY_RAM_BACKEND = QStringLiteral("ramBackend");
+const QString KEY_PREALLOC_RAM = QStringLiteral("preallocRam");
+const QString KEY_SHARE_CLIPBOARD = QStringLiteral("shareClipboard");
+const QString KEY_AUTO_RESIZE = QStringLiteral("autoResize");
+const QString KEY_RECORD_DISPLAY = QStringLiteral("recordDisplay");
+const QString KEY_PREWARM = QStringLiteral("prewarm");
 
 const QStringList VALID_ARCHES = {
     QStringLiteral("x86_64"),
@@ -60,7 +88,257 @@ static QString appDataLocation() {
 #endif
 }
 
-VMManager::VMManager() = default;
+// Everything needed to lay out a new VM's storage off the GUI thread
+struct VMCreationJob {
+    QString storage;
+    QString hdd;
+    quint64 hddSize;
+    QString backingFile;
+    QString flash1Source;
+    QString flash1;
+    QString flash2Source;
+    QString flash2;
+    // Moved rather than copied, empty to leave the DVD where it is
+    QString dvdSource;
+    QString dvd;
+    QByteArray json;
+};
+
+static bool runVMCreation(const VMCreationJob& job, const std::function<void(int)>& progress)
+{
+    const QString pwd = QCoreApplication::applicationDirPath();
+
+    // Create directory storing the VM image
+    {
+        QDir vmDir(job.storage);
+        if (!vmDir.exists()) {
+            vmDir.mkpath(job.storage);
+        }
+    }
+
+    // Create the QCOW2 image for the HDD
+    {
+        const QString qemuImgBin = QStringLiteral("%1/bin/qemu-img").arg(pwd);
+
+        QStringList qemuImgArgs;
+        qemuImgArgs << QStringLiteral("create") << QStringLiteral("-f") << QStringLiteral("qcow2");
+        // Linked clones only store what differs from their template
+        if (!job.backingFile.isEmpty())
+            qemuImgArgs << QStringLiteral("-b") << job.backingFile << QStringLiteral("-F") << QStringLiteral("qcow2");
+        qemuImgArgs << job.hdd;
+        if (job.backingFile.isEmpty() || job.hddSize > 0)
+            qemuImgArgs << QStringLiteral("%1G").arg(job.hddSize);
+        qDebug() << "Creating qcow2 image with arguments:" << qemuImgArgs;
+
+        QProcess qemuImg;
+        qemuImg.start(qemuImgBin, qemuImgArgs);
+        qemuImg.waitForFinished(-1);
+        if (qemuImg.exitStatus() != QProcess::NormalExit || qemuImg.exitCode() != 0) {
+            qWarning() << "qemu-img failed:" << qemuImg.readAllStandardError();
+            return false;
+        }
+    }
+    progress(10);
+
+    // Copy the EFI firmware and NVRAM, and move the DVD image, which take
+    // most of the time. The DVD is usually just renamed, but copied if the
+    // image is on another filesystem.
+    {
+        const qint64 firmwareSize = QFileInfo(job.flash1Source).size();
+        const qint64 nvramSize = QFileInfo(job.flash2Source).size();
+        const qint64 dvdSize = job.dvdSource.isEmpty() ? 0 : QFileInfo(job.dvdSource).size();
+        const qint64 total = qMax<qint64>(1, firmwareSize + nvramSize + dvdSize);
+        qint64 done = 0;
+        auto report = [&](qint64 copied) {
+            progress(10 + int((done + copied) * 85 / total));
+        };
+
+        if (!copyFile(job.flash1Source, job.flash1, report))
+            return false;
+        done = firmwareSize;
+
+        if (!copyFile(job.flash2Source, job.flash2, report))
+            return false;
+        done += nvramSize;
+
+        // Create the VM metadata
+        {
+            const QString jsonFilePath = QStringLiteral("%1/info.json").arg(job.storage);
+            QFile jsonFile(jsonFilePath);
+            if (!jsonFile.open(QFile::ReadWrite)) {
+                qWarning() << "Failed to open JSON file for writing";
+                return false;
+            }
+
+            jsonFile.write(job.json);
+        }
+
+        // Finally, as a failed creation removes the VM's directory with
+        // everything in it
+        if (!job.dvdSource.isEmpty() && !moveFile(job.dvdSource, job.dvd, report)) {
+            qWarning() << "Failed to move" << job.dvdSource << "DVD image to target" << job.dvd;
+            return false;
+        }
+    }
+    progress(100);
+
+    return true;
+}
+
+static QString qemuImgBinary()
+{
+    return QStringLiteral("%1/bin/qemu-img").arg(QCoreApplication::applicationDirPath());
+}
+
+// The apparent size of a qcow2 image says little about its disk usage
+static qint64 allocatedSize(const QString& path)
+{
+    struct stat info;
+    if (stat(path.toUtf8().constData(), &info))
+        return 0;
+    return qint64(info.st_blocks) * 512;
+}
+
+// -U also allows looking at the images of running VMs
+static QVariantMap runDiskInfo(const QString& hdd)
+{
+    QProcess qemuImg;
+    qemuImg.start(qemuImgBinary(), { QStringLiteral("info"), QStringLiteral("-U"), QStringLiteral("--output=json"), hdd });
+    qemuImg.waitForFinished(-1);
+    if (qemuImg.exitStatus() != QProcess::NormalExit || qemuImg.exitCode() != 0) {
+        qWarning() << "qemu-img info failed:" << qemuImg.readAllStandardError();
+        return QVariantMap();
+    }
+
+    const QJsonObject info = QJsonDocument::fromJson(qemuImg.readAllStandardOutput()).object();
+    QVariantMap ret;
+    ret.insert("hddActualSize", info.value("actual-size").toVariant());
+    ret.insert("hddVirtualSize", info.value("virtual-size").toVariant());
+    return ret;
+}
+
+// Leaked clusters only waste space, corruptions lose data
+static QVariantMap runDiskCheck(const QString& hdd)
+{
+    QProcess qemuImg;
+    qemuImg.start(qemuImgBinary(), { QStringLiteral("check"), QStringLiteral("--output=json"), hdd });
+    qemuImg.waitForFinished(-1);
+
+    // Exit codes 2 and 3 report corruptions and leaks, which are in the JSON
+    const int exitCode = qemuImg.exitCode();
+    if (qemuImg.exitStatus() != QProcess::NormalExit || exitCode == 1 || exitCode > 3) {
+        qWarning() << "qemu-img check failed:" << qemuImg.readAllStandardError();
+        return QVariantMap();
+    }
+
+    const QJsonObject check = QJsonDocument::fromJson(qemuImg.readAllStandardOutput()).object();
+    QVariantMap ret = runDiskInfo(hdd);
+    if (ret.isEmpty())
+        return ret;
+    ret.insert("hddCorruptions", check.value("corruptions").toInt());
+    ret.insert("hddLeaks", check.value("leaks").toInt());
+    ret.insert("hddChecked", QDateTime::currentDateTime());
+    return ret;
+}
+
+// Copies only the clusters in use into a new image, which then replaces
+// the old one. Linked clones stay overlays of their template.
+static QVariantMap runDiskCompaction(const QString& hdd, const QString& backingFile, bool compress,
+                                     const std::function<void(int)>& progress)
+{
+    const QString compacted = QStringLiteral("%1.compact").arg(hdd);
+
+    QStringList args = { QStringLiteral("convert"), QStringLiteral("-p"), QStringLiteral("-O"), QStringLiteral("qcow2") };
+    if (compress)
+        args << QStringLiteral("-c");
+    if (!backingFile.isEmpty())
+        args << QStringLiteral("-B") << backingFile << QStringLiteral("-F") << QStringLiteral("qcow2");
+    args << hdd << compacted;
+    qDebug() << "Compacting disk image with arguments:" << args;
+
+    // Progress looks like "    (42.00/100%)\r"
+    static const QRegularExpression progressExpression(QStringLiteral("\\((\\d+(?:\\.\\d+)?)/100%\\)"));
+
+    QProcess qemuImg;
+    qemuImg.start(qemuImgBinary(), args);
+    qemuImg.waitForStarted(-1);
+    while (qemuImg.state() == QProcess::Running) {
+        qemuImg.waitForReadyRead(1000);
+        const QString output = QString::fromUtf8(qemuImg.readAllStandardOutput());
+        QRegularExpressionMatchIterator it = progressExpression.globalMatch(output);
+        int value = -1;
+        while (it.hasNext())
+            value = int(it.next().captured(1).toDouble());
+        if (value >= 0)
+            progress(qMin(value, 99));
+    }
+    qemuImg.waitForFinished(-1);
+
+    if (qemuImg.exitStatus() != QProcess::NormalExit || qemuImg.exitCode() != 0) {
+        qWarning() << "qemu-img convert failed:" << qemuImg.readAllStandardError();
+        QFile::remove(compacted);
+        return QVariantMap();
+    }
+
+    const qint64 before = allocatedSize(hdd);
+    if (rename(compacted.toUtf8().constData(), hdd.toUtf8().constData())) {
+        qWarning() << "Failed to replace" << hdd << "with its compacted image";
+        QFile::remove(compacted);
+        return QVariantMap();
+    }
+    progress(100);
+
+    QVariantMap ret = runDiskInfo(hdd);
+    ret.insert("hddReclaimed", before - allocatedSize(hdd));
+    return ret;
+}
+
+VMManager::VMManager()
+{
+    // Changes usually come in bursts, e.g. while a VM is being created
+    this->m_refreshTimer.setSingleShot(true);
+    this->m_refreshTimer.setInterval(100);
+    QObject::connect(&this->m_refreshTimer, &QTimer::timeout, this, &VMManager::refreshVMs);
+    QObject::connect(&this->m_watcher, &QFileSystemWatcher::directoryChanged, this, [=]() {
+        this->m_refreshTimer.start();
+    });
+    QObject::connect(&this->m_watcher, &QFileSystemWatcher::fileChanged, this, [=]() {
+        this->m_refreshTimer.start();
+    });
+    QObject::connect(QCoreApplication::instance(), &QCoreApplication::aboutToQuit,
+                     this, &VMManager::quitRunningVMs);
+}
+
+VMManager::~VMManager()
+{
+    // The jobs report back to this object
+    for (QFutureWatcher<bool>* watcher : this->m_creations)
+        watcher->waitForFinished();
+    for (QFutureWatcher<QVariantMap>* watcher : this->m_maintenance.keys())
+        watcher->waitForFinished();
+    for (QFutureWatcher<bool>* watcher : this->m_imports.keys())
+        watcher->waitForFinished();
+}
+
+void VMManager::quitRunningVMs()
+{
+    static const int QUIT_WAIT_MS = 5000;
+
+    // All of them quit at the same time, so that closing the app takes no
+    // longer with several VMs than with one
+    QList<Machine*> quitting;
+    for (const QPointer<Machine>& machine : this->m_runningVMs) {
+        if (machine && machine->quitNow())
+            quitting.append(machine);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    for (Machine* machine : quitting) {
+        if (!machine->waitForQuit(qMax(0, int(QUIT_WAIT_MS - timer.elapsed()))))
+            qWarning() << machine->name << "didn't quit in time";
+    }
+}
 
 void VMManager::setRefreshing(bool value)
 {
@@ -73,24 +351,69 @@ void VMManager::setRefreshing(bool value)
 
 void VMManager::refreshVMs()
 {
+    const QString root = appDataLocation();
     QVariantList vms;
-    QDirIterator dirIt(appDataLocation(),
-                QStringList() << "info.json", QDir::Files, QDirIterator::Subdirectories);
+    QHash<QString, CachedEntry> cache;
 
     setRefreshing(true);
 
-    while (dirIt.hasNext()) {
-        dirIt.next();
-        QVariantMap vm;
-        try {
-            vm = listEntryForJSON(dirIt.filePath(), QFileInfo(dirIt.filePath()).canonicalPath());
-        } catch (...) {
+    // Picks up VMs being added or removed
+    if (!this->m_watcher.directories().contains(root) && QDir(root).exists())
+        this->m_watcher.addPath(root);
+
+    // Each VM lives in its own directory right below the root; don't
+    // descend into disk images and shared folders.
+    const QFileInfoList dirs = QDir(root).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+    for (const QFileInfo& dir : dirs) {
+        const QFileInfo info(QStringLiteral("%1/info.json").arg(dir.absoluteFilePath()));
+        if (!info.isFile())
             continue;
+
+        const QString path = info.absoluteFilePath();
+        CachedEntry entry = this->m_cache.value(path);
+        if (entry.modified != info.lastModified() || entry.size != info.size()) {
+            entry.modified = info.lastModified();
+            entry.size = info.size();
+            try {
+                entry.vm = listEntryForJSON(path, info.canonicalPath());
+                entry.valid = true;
+            } catch (...) {
+                entry.vm.clear();
+                entry.valid = false;
+            }
         }
+        cache.insert(path, entry);
+
+        // Rewritten files may have to be watched again
+        if (!this->m_watcher.files().contains(path))
+            this->m_watcher.addPath(path);
+
+        if (!entry.valid)
+            continue;
+
+        // The disk image grows without info.json changing
+        QVariantMap vm = entry.vm;
+        const QString hdd = vm.value("hdd").toString();
+        vm.insert("hddSize", allocatedSize(hdd));
+
+        const CachedDiskInfo disk = this->m_diskInfo.value(hdd);
+        for (auto it = disk.info.constBegin(); it != disk.info.constEnd(); ++it)
+            vm.insert(it.key(), it.value());
+        refreshDiskInfo(hdd);
+
         vms.push_back(vm);
     }
-    this->m_vms = vms;
-    emit vmsChanged();
+
+    for (auto it = this->m_cache.constBegin(); it != this->m_cache.constEnd(); ++it) {
+        if (!cache.contains(it.key()))
+            this->m_watcher.removePath(it.key());
+    }
+    this->m_cache = cache;
+
+    if (vms != this->m_vms) {
+        this->m_vms = vms;
+        emit vmsChanged();
+    }
 
     setRefreshing(false);
 }
@@ -106,7 +429,7 @@ Machine* VMManager::fromQml(const QVariantMap& vm)
     machine->cores = vm.value(KEY_CORES).toInt();
     machine->mem = vm.value(KEY_MEM).toInt();
     machine->hdd = vm.value(KEY_HDD).toString();
-    machine->hddSize = QFileInfo(machine->hdd).size();
+    machine->hddSize = allocatedSize(machine->hdd);
     machine->dvd = vm.value(KEY_DVD).toString();
     machine->flash1 = vm.value(KEY_FLASH1).toString();
     machine->flash2 = vm.value(KEY_FLASH2).toString();
@@ -114,10 +437,160 @@ Machine* VMManager::fromQml(const QVariantMap& vm)
     machine->enableFileSharing = vm.value(KEY_ENABLEFILESHARING).toBool();
     machine->externalWindowOnly = vm.value(KEY_EXTERNAL_WINDOW_ONLY).toBool();
     machine->enableVirtualization = vm.value(KEY_ENABLE_VIRTUALIZATION).toBool();
+    machine->localDisplay = vm.value(KEY_LOCAL_DISPLAY).toBool();
+    machine->isTemplate = vm.value(KEY_TEMPLATE).toBool();
+    machine->backingFile = vm.value(KEY_BACKING_FILE).toString();
+    machine->vncEncodings = vm.value(KEY_VNC_ENCODINGS).toString();
+    machine->vncCompressLevel = vm.value(KEY_VNC_COMPRESS_LEVEL).toInt();
+    machine->vncQualityLevel = vm.value(KEY_VNC_QUALITY_LEVEL).toInt();
+    machine->vncLowColorDepth = vm.value(KEY_VNC_LOW_COLOR_DEPTH).toBool();
+    machine->fastResume = vm.value(KEY_FAST_RESUME).toBool();
+    machine->autoBalloon = vm.value(KEY_AUTO_BALLOON).toBool();
+    machine->diskProfile = vm.value(KEY_DISK_PROFILE).toString();
+    machine->pinVcpus = vm.value(KEY_PIN_VCPUS).toBool();
+    machine->cpuAffinity = vm.value(KEY_CPU_AFFINITY).toString();
+    machine->ramBackend = vm.value(KEY_RAM_BACKEND).toString();
+    machine->preallocRam = vm.value(KEY_PREALLOC_RAM).toBool();
+    machine->shareClipboard = vm.value(KEY_SHARE_CLIPBOARD).toBool();
+    machine->autoResize = vm.value(KEY_AUTO_RESIZE).toBool();
+    machine->recordDisplay = vm.value(KEY_RECORD_DISPLAY).toBool();
+    machine->prewarm = vm.value(KEY_PREWARM).toBool();
 
     return machine;
 }
 
+bool VMManager::startVM(Machine* machine)
+{
+    if (!machine) {
+        qWarning() << "nullptr machine provided";
+        return false;
+    }
+
+    if (this->m_runningVMs.contains(machine) || this->m_queuedVMs.contains(machine))
+        return true;
+
+    if (machine->mem > ramBudget() || machine->cores > coreBudget()) {
+        qWarning() << machine->name << "needs more than the budget of" << ramBudget() << "MB and"
+                   << coreBudget() << "cores";
+        emit machine->error(QStringLiteral("This VM needs more memory or CPU cores than the device can provide"));
+        return false;
+    }
+
+    if (!fitsBudget(machine)) {
+        qDebug() << "Queueing" << machine->name << "until running VMs release their resources";
+        this->m_queuedVMs.append(machine);
+        emit queuedVMsChanged();
+        return true;
+    }
+
+    return launchVM(machine);
+}
+
+void VMManager::cancelStartVM(Machine* machine)
+{
+    if (this->m_queuedVMs.removeAll(machine) > 0)
+        emit queuedVMsChanged();
+}
+
+void VMManager::prewarmVM(Machine* machine)
+{
+    // Only if starting it right away would be allowed
+    if (!machine || this->m_runningVMs.contains(machine) || !fitsBudget(machine))
+        return;
+
+    machine->warmUp();
+}
+
+bool VMManager::fitsBudget(const Machine* machine) const
+{
+    return committedRam() + machine->mem <= ramBudget() &&
+           committedCores() + machine->cores <= coreBudget();
+}
+
+bool VMManager::launchVM(Machine* machine)
+{
+    if (!machine->start())
+        return false;
+
+    // Failing to start also ends up in stopped()
+    this->m_runningVMs.append(machine);
+    this->m_runningConnections.insert(machine, QObject::connect(machine, &Machine::stopped, this, [=]() {
+        releaseVM(machine);
+    }));
+    emit committedResourcesChanged();
+    return true;
+}
+
+void VMManager::releaseVM(Machine* machine)
+{
+    QObject::disconnect(this->m_runningConnections.take(machine));
+    if (this->m_runningVMs.removeAll(machine) == 0)
+        return;
+
+    emit committedResourcesChanged();
+    startQueuedVMs();
+}
+
+void VMManager::startQueuedVMs()
+{
+    // In order, but smaller VMs may go ahead of ones that still don't fit
+    const QList<QPointer<Machine>> queue = this->m_queuedVMs;
+    for (const QPointer<Machine>& machine : queue) {
+        if (machine && !fitsBudget(machine))
+            continue;
+
+        this->m_queuedVMs.removeAll(machine);
+        if (machine && !launchVM(machine))
+            qWarning() << "Failed to start queued VM" << machine->name;
+    }
+
+    if (queue != this->m_queuedVMs)
+        emit queuedVMsChanged();
+}
+
+int VMManager::committedRam() const
+{
+    int ret = 0;
+    for (const QPointer<Machine>& machine : this->m_runningVMs) {
+        if (machine)
+            ret += machine->mem;
+    }
+    return ret;
+}
+
+int VMManager::committedCores() const
+{
+    int ret = 0;
+    for (const QPointer<Machine>& machine : this->m_runningVMs) {
+        if (machine)
+            ret += machine->cores;
+    }
+    return ret;
+}
+
+QStringList VMManager::queuedVMs() const
+{
+    QStringList ret;
+    for (const QPointer<Machine>& machine : this->m_queuedVMs) {
+        if (machine)
+            ret << machine->storage;
+    }
+    return ret;
+}
+
+int VMManager::ramBudget()
+{
+    // What's left after keeping the same reserve for the phone as maxRam
+    return maxRam();
+}
+
+int VMManager::coreBudget()
+{
+    // vCPUs beyond the host CPUs only make the VMs compete with each other
+    const int cpus = HostTopology::instance().cpus().count();
+    return cpus > 0 ? cpus : int(sysconf(_SC_NPROCESSORS_CONF));
+}
+
 bool VMManager::createVM(Machine* machine)
 {
     if (!machine) {
@@ -125,85 +598,306 @@ bool VMManager::createVM(Machine* machine)
         return false;
     }
 
+    return startVMCreation(machine, efiNVRAMSource(machine->arch));
+}
+
+bool VMManager::cloneVM(Machine* base, const QString& name)
+{
+    if (!base) {
+        qWarning() << "nullptr machine provided";
+        return false;
+    }
+
+    if (!base->isTemplate) {
+        qWarning() << base->name << "is not a template";
+        return false;
+    }
+
+    // Take over all the settings of the template
+    Machine clone;
+    const QMetaObject* metaObject = base->metaObject();
+    for (int i = metaObject->propertyOffset(); i < metaObject->propertyCount(); i++) {
+        const QMetaProperty property = metaObject->property(i);
+        if (!property.isWritable() || qstrcmp(property.name(), "running") == 0)
+            continue;
+        property.write(&clone, property.read(base));
+    }
+
+    clone.name = name;
+    clone.isTemplate = false;
+    clone.backingFile = base->hdd;
+    clone.hddSize = 0; // Same as the template
+
+    // The template's NVRAM knows how to boot the installed system
+    return startVMCreation(&clone, base->flash2);
+}
+
+bool VMManager::startVMCreation(Machine* machine, const QString& nvramSource)
+{
     const QString vmDirPath = appDataLocation() + QStringLiteral("/") + QUuid::createUuid().toString();
-    const QString pwd = QCoreApplication::applicationDirPath();
 
+    // All the paths are known upfront, so the metadata can be prepared
+    // here and the Machine isn't touched from the worker thread.
     machine->storage = vmDirPath;
+    machine->hdd = QStringLiteral("%1/hdd.qcow2").arg(vmDirPath);
+    machine->flash1 = QStringLiteral("%1/efi.fd").arg(vmDirPath);
+    machine->flash2 = QStringLiteral("%1/efi_nvram.fd").arg(vmDirPath);
+
+    // Move the DVD/ISO image from HubIncoming to storage. Anything else,
+    // like a template's DVD, isn't the VM's to take.
+    QString dvdSource;
+    if (machine->dvd.contains(QStringLiteral("/HubIncoming/"))) {
+        dvdSource = machine->dvd;
+        machine->dvd = QStringLiteral("%1/dvd.iso").arg(vmDirPath);
+    }
 
-    // Create directory storing the VM image
-    {
-        QDir vmDir(vmDirPath);
-        if (!vmDir.exists()) {
-            vmDir.mkpath(vmDirPath);
+    VMCreationJob job;
+    job.storage = vmDirPath;
+    job.hdd = machine->hdd;
+    job.hddSize = machine->hddSize;
+    job.backingFile = machine->backingFile;
+    job.flash1Source = efiFirmwareSource(machine->arch);
+    job.flash1 = machine->flash1;
+    job.flash2Source = nvramSource;
+    job.flash2 = machine->flash2;
+    job.dvdSource = dvdSource;
+    job.dvd = machine->dvd;
+    job.json = machineToJSON(machine);
+
+    auto progress = [=](int value) {
+        QMetaObject::invokeMethod(this, [=]() {
+            emit vmCreationProgress(vmDirPath, value);
+        }, Qt::QueuedConnection);
+    };
+
+    QFutureWatcher<bool>* watcher = new QFutureWatcher<bool>(this);
+    QObject::connect(watcher, &QFutureWatcher<bool>::finished, this, [=]() {
+        const bool success = watcher->result();
+        if (!success) {
+            qWarning() << "Failed to create VM in" << vmDirPath;
+            QDir(vmDirPath).removeRecursively();
         }
-    }
 
-    // Create the QCOW2 image for the HDD
-    {
-        const QString qemuImgBin = QStringLiteral("%1/bin/qemu-img").arg(pwd);
-        const QString hddPath = QStringLiteral("%1/hdd.qcow2").arg(vmDirPath);
+        this->m_creations.removeAll(watcher);
+        watcher->deleteLater();
+        emit creatingVMsChanged();
+        refreshVMs();
+        emit vmCreated(vmDirPath, success);
+    });
 
-        QStringList qemuImgArgs;
-        qemuImgArgs << QStringLiteral("create") << QStringLiteral("-f") << QStringLiteral("qcow2");
-        qemuImgArgs << hddPath << QStringLiteral("%1G").arg(machine->hddSize);
-        qDebug() << "Creating qcow2 image with arguments:" << qemuImgArgs;
+    this->m_creations.append(watcher);
+    watcher->setFuture(QtConcurrent::run([=]() {
+        return runVMCreation(job, progress);
+    }));
+    emit creatingVMsChanged();
 
-        QProcess qemuImg;
-        qemuImg.start(qemuImgBin, qemuImgArgs);
-        qemuImg.waitForFinished();
-        if (qemuImg.exitCode() != 0) {
-            qWarning() << "qemu-img failed:" << qemuImg.readAllStandardError();
-            return false;
-        }
+    return true;
+}
+
+int VMManager::creatingVMs() const
+{
+    return this->m_creations.count();
+}
 
-        machine->hdd = hddPath;
+bool VMManager::checkDisk(Machine* machine)
+{
+    if (!machine) {
+        qWarning() << "nullptr machine provided";
+        return false;
     }
 
-#if 0 // Enable once Content-Hub incoming files can be unlinked from their source location
-    // Move the DVD/ISO image from HubIncoming to storage
-    {
-        const QString dvdStoragePath = QStringLiteral("%1/dvd.iso").arg(vmDirPath);
-        if (rename(machine->dvd.toUtf8().data(), dvdStoragePath.toUtf8().data())) {
-            qWarning() << "Failed to move" << machine->dvd << "DVD image to target" << dvdStoragePath;
-            return false;
-        }
-        machine->dvd = dvdStoragePath;
+    const QString hdd = machine->hdd;
+    return startDiskMaintenance(machine, [=](const std::function<void(int)>&) {
+        return runDiskCheck(hdd);
+    });
+}
+
+bool VMManager::compactDisk(Machine* machine, bool compress)
+{
+    if (!machine) {
+        qWarning() << "nullptr machine provided";
+        return false;
     }
-#endif
 
-    {
-        const bool ret = resetEFIFirmware(machine);
-        if (!ret)
-            return false;
+    const QString hdd = machine->hdd;
+    const QString backingFile = machine->backingFile;
+    return startDiskMaintenance(machine, [=](const std::function<void(int)>& progress) {
+        return runDiskCompaction(hdd, backingFile, compress, progress);
+    });
+}
+
+QVariantMap VMManager::diskInfo(Machine* machine) const
+{
+    if (!machine)
+        return QVariantMap();
+    return this->m_diskInfo.value(machine->hdd).info;
+}
+
+bool VMManager::startDiskMaintenance(Machine* machine,
+                                     const std::function<QVariantMap(const std::function<void(int)>&)>& job)
+{
+    // Both jobs need the image for themselves, and a prewarmed QEMU has
+    // it open just like a running one
+    if (machine->running || machine->isWarm()) {
+        qWarning() << "Not touching the disk of running VM" << machine->name;
+        return false;
     }
 
-    {
-        const bool ret = resetEFINVRAM(machine);
-        if (!ret)
-            return false;
+    const QString storage = machine->storage;
+    const QString hdd = machine->hdd;
+    if (maintainedVMs().contains(storage)) {
+        qWarning() << "Disk of" << machine->name << "is already being maintained";
+        return false;
     }
 
-    // Finally, create the VM metadata
-    {
-        const QString jsonFilePath = QStringLiteral("%1/info.json").arg(vmDirPath);
-        QFile jsonFile(jsonFilePath);
-        if (!jsonFile.open(QFile::ReadWrite)) {
-            qWarning() << "Failed to open JSON file for writing";
-            return false;
+    auto progress = [=](int value) {
+        QMetaObject::invokeMethod(this, [=]() {
+            emit diskMaintenanceProgress(storage, value);
+        }, Qt::QueuedConnection);
+    };
+
+    QFutureWatcher<QVariantMap>* watcher = new QFutureWatcher<QVariantMap>(this);
+    QObject::connect(watcher, &QFutureWatcher<QVariantMap>::finished, this, [=]() {
+        const QVariantMap result = watcher->result();
+        const bool success = !result.isEmpty();
+        if (success) {
+            CachedDiskInfo& disk = this->m_diskInfo[hdd];
+            disk.modified = QFileInfo(hdd).lastModified();
+            disk.refreshed = QDateTime::currentDateTime();
+            for (auto it = result.constBegin(); it != result.constEnd(); ++it)
+                disk.info.insert(it.key(), it.value());
         }
 
-        jsonFile.write(machineToJSON(machine));
+        this->m_maintenance.remove(watcher);
+        watcher->deleteLater();
+        emit maintainedVMsChanged();
+        refreshVMs();
+        emit diskMaintenanceFinished(storage, success);
+    });
+
+    this->m_maintenance.insert(watcher, storage);
+    watcher->setFuture(QtConcurrent::run([=]() {
+        return job(progress);
+    }));
+    emit maintainedVMsChanged();
+
+    return true;
+}
+
+void VMManager::refreshDiskInfo(const QString& hdd)
+{
+    static const int MIN_REFRESH_INTERVAL_S = 60;
+
+    // Images of running VMs change all the time
+    const QDateTime modified = QFileInfo(hdd).lastModified();
+    const CachedDiskInfo disk = this->m_diskInfo.value(hdd);
+    if (disk.modified == modified || this->m_diskInfoPending.contains(hdd))
+        return;
+    if (disk.refreshed.isValid() && disk.refreshed.secsTo(QDateTime::currentDateTime()) < MIN_REFRESH_INTERVAL_S)
+        return;
+
+    this->m_diskInfoPending.append(hdd);
+
+    QFutureWatcher<QVariantMap>* watcher = new QFutureWatcher<QVariantMap>(this);
+    QObject::connect(watcher, &QFutureWatcher<QVariantMap>::finished, this, [=]() {
+        const QVariantMap result = watcher->result();
+        this->m_diskInfoPending.removeAll(hdd);
+        watcher->deleteLater();
+
+        CachedDiskInfo& disk = this->m_diskInfo[hdd];
+        disk.modified = modified;
+        disk.refreshed = QDateTime::currentDateTime();
+        bool changed = false;
+        for (auto it = result.constBegin(); it != result.constEnd(); ++it) {
+            changed |= disk.info.value(it.key()) != it.value();
+            disk.info.insert(it.key(), it.value());
+        }
+        if (changed)
+            this->m_refreshTimer.start();
+    });
+    watcher->setFuture(QtConcurrent::run([=]() {
+        return runDiskInfo(hdd);
+    }));
+}
+
+QStringList VMManager::maintainedVMs() const
+{
+    return this->m_maintenance.values();
+}
+
+bool VMManager::importIntoShare(Machine* machine, const QUrl& url)
+{
+    if (!machine) {
+        qWarning() << "nullptr machine provided";
+        return false;
+    }
+
+    const QString path = url.path();
+    if (!QFile::exists(path)) {
+        qWarning() << "File" << path << "doesn't exist.";
+        return false;
     }
 
+    // Usually just a rename, but ISOs and datasets can take a while to
+    // copy if the shared folder is on another filesystem. Doesn't replace
+    // files in there, not even another one of the same import.
+    const QString storage = machine->storage;
+    const QString name = machine->name;
+    const QString fileName = path.split('/', QString::SkipEmptyParts).back();
+    const QString directory = machine->getFileSharingDirectory();
+    const QString newPath = directory + QStringLiteral("/%1").arg(fileName);
+    const qint64 size = qMax<qint64>(1, QFileInfo(path).size());
+    auto progress = [=](qint64 copied) {
+        QMetaObject::invokeMethod(this, [=]() {
+            emit importProgress(storage, fileName, int(copied * 100 / size));
+        }, Qt::QueuedConnection);
+    };
+
+    QFutureWatcher<bool>* watcher = new QFutureWatcher<bool>(this);
+    QObject::connect(watcher, &QFutureWatcher<bool>::finished, this, [=]() {
+        const bool success = watcher->result();
+        if (success)
+            qInfo() << "Imported" << fileName << "into VM" << name;
+        this->m_imports.remove(watcher);
+        watcher->deleteLater();
+        emit importingVMsChanged();
+        emit importFinished(storage, fileName, success);
+    });
+
+    this->m_imports.insert(watcher, storage);
+    watcher->setFuture(QtConcurrent::run([=]() {
+        // Only created on the first start otherwise
+        QDir().mkpath(directory);
+        return moveFile(path, newPath, progress);
+    }));
+    emit importingVMsChanged();
+
     return true;
 }
 
+QStringList VMManager::importingVMs() const
+{
+    return this->m_imports.values();
+}
+
+QString VMManager::efiFirmwareSource(const QString& arch)
+{
+    const QString pwd = QCoreApplication::applicationDirPath();
+    return QStringLiteral("%1/efi/%2/code.fd").arg(pwd, arch);
+}
+
+QString VMManager::efiNVRAMSource(const QString& arch)
+{
+    const QString pwd = QCoreApplication::applicationDirPath();
+    const QString varsArch = (arch == QStringLiteral("aarch64")) ?
+                QStringLiteral("arm") : QStringLiteral("i386");
+    return QStringLiteral("%1/share/qemu/edk2-%2-vars.fd").arg(pwd, varsArch);
+}
 
 // Copy the EFI firmware to storage
 bool VMManager::resetEFIFirmware(Machine* machine)
 {
-    const QString pwd = QCoreApplication::applicationDirPath();
-    const QString efiFw = QStringLiteral("%1/efi/%2/code.fd").arg(pwd, machine->arch);
+    const QString efiFw = efiFirmwareSource(machine->arch);
     const QString efiFwTarget = QStringLiteral("%1/efi.fd").arg(machine->storage);
 
     if (QFile::exists(efiFwTarget)) {
@@ -225,10 +919,7 @@ bool VMManager::resetEFIFirmware(Machine* machine)
 // Copy the EFI NVRAM to storage
 bool VMManager::resetEFINVRAM(Machine* machine)
 {
-    const QString pwd = QCoreApplication::applicationDirPath();
-    const QString varsArch = (machine->arch == QStringLiteral("aarch64")) ?
-                QStringLiteral("arm") : QStringLiteral("i386");
-    const QString efiVars = QStringLiteral("%1/share/qemu/edk2-%2-vars.fd").arg(pwd, varsArch);
+    const QString efiVars = efiNVRAMSource(machine->arch);
     const QString efiVarsTarget = QStringLiteral("%1/efi_nvram.fd").arg(machine->storage);
 
     if (QFile::exists(efiVarsTarget)) {
@@ -331,6 +1022,96 @@ QVariantMap VMManager::listEntryForJSON(const QString& path, const QString& stor
     else
         ret.insert(KEY_ENABLE_VIRTUALIZATION, true);
 
+    if (rootObject.contains(KEY_LOCAL_DISPLAY))
+        ret.insert(KEY_LOCAL_DISPLAY, rootObject.value(KEY_LOCAL_DISPLAY).toBool());
+    else
+        ret.insert(KEY_LOCAL_DISPLAY, false);
+
+    if (rootObject.contains(KEY_TEMPLATE))
+        ret.insert(KEY_TEMPLATE, rootObject.value(KEY_TEMPLATE).toBool());
+    else
+        ret.insert(KEY_TEMPLATE, false);
+
+    if (rootObject.contains(KEY_BACKING_FILE))
+        ret.insert(KEY_BACKING_FILE, rootObject.value(KEY_BACKING_FILE).toString());
+    else
+        ret.insert(KEY_BACKING_FILE, QString());
+
+    if (rootObject.contains(KEY_VNC_ENCODINGS))
+        ret.insert(KEY_VNC_ENCODINGS, rootObject.value(KEY_VNC_ENCODINGS).toString());
+    else
+        ret.insert(KEY_VNC_ENCODINGS, QString());
+
+    if (rootObject.contains(KEY_VNC_COMPRESS_LEVEL))
+        ret.insert(KEY_VNC_COMPRESS_LEVEL, rootObject.value(KEY_VNC_COMPRESS_LEVEL).toInt());
+    else
+        ret.insert(KEY_VNC_COMPRESS_LEVEL, 3);
+
+    if (rootObject.contains(KEY_VNC_QUALITY_LEVEL))
+        ret.insert(KEY_VNC_QUALITY_LEVEL, rootObject.value(KEY_VNC_QUALITY_LEVEL).toInt());
+    else
+        ret.insert(KEY_VNC_QUALITY_LEVEL, 5);
+
+    if (rootObject.contains(KEY_VNC_LOW_COLOR_DEPTH))
+        ret.insert(KEY_VNC_LOW_COLOR_DEPTH, rootObject.value(KEY_VNC_LOW_COLOR_DEPTH).toBool());
+    else
+        ret.insert(KEY_VNC_LOW_COLOR_DEPTH, false);
+
+    if (rootObject.contains(KEY_FAST_RESUME))
+        ret.insert(KEY_FAST_RESUME, rootObject.value(KEY_FAST_RESUME).toBool());
+    else
+        ret.insert(KEY_FAST_RESUME, false);
+
+    if (rootObject.contains(KEY_AUTO_BALLOON))
+        ret.insert(KEY_AUTO_BALLOON, rootObject.value(KEY_AUTO_BALLOON).toBool());
+    else
+        ret.insert(KEY_AUTO_BALLOON, false);
+
+    if (rootObject.contains(KEY_DISK_PROFILE))
+        ret.insert(KEY_DISK_PROFILE, rootObject.value(KEY_DISK_PROFILE).toString());
+    else
+        ret.insert(KEY_DISK_PROFILE, QStringLiteral("default"));
+
+    if (rootObject.contains(KEY_PIN_VCPUS))
+        ret.insert(KEY_PIN_VCPUS, rootObject.value(KEY_PIN_VCPUS).toBool());
+    else
+        ret.insert(KEY_PIN_VCPUS, false);
+
+    if (rootObject.contains(KEY_CPU_AFFINITY))
+        ret.insert(KEY_CPU_AFFINITY, rootObject.value(KEY_CPU_AFFINITY).toString());
+    else
+        ret.insert(KEY_CPU_AFFINITY, QString());
+
+    if (rootObject.contains(KEY_RAM_BACKEND))
+        ret.insert(KEY_RAM_BACKEND, rootObject.value(KEY_RAM_BACKEND).toString());
+    else
+        ret.insert(KEY_RAM_BACKEND, QStringLiteral("default"));
+
+    if (rootObject.contains(KEY_PREALLOC_RAM))
+        ret.insert(KEY_PREALLOC_RAM, rootObject.value(KEY_PREALLOC_RAM).toBool());
+    else
+        ret.insert(KEY_PREALLOC_RAM, false);
+
+    if (rootObject.contains(KEY_SHARE_CLIPBOARD))
+        ret.insert(KEY_SHARE_CLIPBOARD, rootObject.value(KEY_SHARE_CLIPBOARD).toBool());
+    else
+        ret.insert(KEY_SHARE_CLIPBOARD, false);
+
+    if (rootObject.contains(KEY_AUTO_RESIZE))
+        ret.insert(KEY_AUTO_RESIZE, rootObject.value(KEY_AUTO_RESIZE).toBool());
+    else
+        ret.insert(KEY_AUTO_RESIZE, false);
+
+    if (rootObject.contains(KEY_RECORD_DISPLAY))
+        ret.insert(KEY_RECORD_DISPLAY, rootObject.value(KEY_RECORD_DISPLAY).toBool());
+    else
+        ret.insert(KEY_RECORD_DISPLAY, false);
+
+    if (rootObject.contains(KEY_PREWARM))
+        ret.insert(KEY_PREWARM, rootObject.value(KEY_PREWARM).toBool());
+    else
+        ret.insert(KEY_PREWARM, false);
+
     return ret;
 }
 
@@ -349,6 +1130,24 @@ QByteArray VMManager::machineToJSON(const Machine* machine)
     rootObject.insert(KEY_ENABLEFILESHARING, QJsonValue(machine->enableFileSharing));
     rootObject.insert(KEY_EXTERNAL_WINDOW_ONLY, QJsonValue(machine->externalWindowOnly));
     rootObject.insert(KEY_ENABLE_VIRTUALIZATION, QJsonValue(machine->enableVirtualization));
+    rootObject.insert(KEY_LOCAL_DISPLAY, QJsonValue(machine->localDisplay));
+    rootObject.insert(KEY_TEMPLATE, QJsonValue(machine->isTemplate));
+    rootObject.insert(KEY_BACKING_FILE, QJsonValue(machine->backingFile));
+    rootObject.insert(KEY_VNC_ENCODINGS, QJsonValue(machine->vncEncodings));
+    rootObject.insert(KEY_VNC_COMPRESS_LEVEL, QJsonValue(machine->vncCompressLevel));
+    rootObject.insert(KEY_VNC_QUALITY_LEVEL, QJsonValue(machine->vncQualityLevel));
+    rootObject.insert(KEY_VNC_LOW_COLOR_DEPTH, QJsonValue(machine->vncLowColorDepth));
+    rootObject.insert(KEY_FAST_RESUME, QJsonValue(machine->fastResume));
+    rootObject.insert(KEY_AUTO_BALLOON, QJsonValue(machine->autoBalloon));
+    rootObject.insert(KEY_DISK_PROFILE, QJsonValue(machine->diskProfile));
+    rootObject.insert(KEY_PIN_VCPUS, QJsonValue(machine->pinVcpus));
+    rootObject.insert(KEY_CPU_AFFINITY, QJsonValue(machine->cpuAffinity));
+    rootObject.insert(KEY_RAM_BACKEND, QJsonValue(machine->ramBackend));
+    rootObject.insert(KEY_PREALLOC_RAM, QJsonValue(machine->preallocRam));
+    rootObject.insert(KEY_SHARE_CLIPBOARD, QJsonValue(machine->shareClipboard));
+    rootObject.insert(KEY_AUTO_RESIZE, QJsonValue(machine->autoResize));
+    rootObject.insert(KEY_RECORD_DISPLAY, QJsonValue(machine->recordDisplay));
+    rootObject.insert(KEY_PREWARM, QJsonValue(machine->prewarm));
 
     QJsonDocument doc(rootObject);
     return doc.toJson();
@@ -361,6 +1160,19 @@ bool VMManager::editVM(Machine* machine)
         return false;
     }
 
+    // A prewarmed QEMU has the old settings
+    machine->coolDown();
+
+    // Clones would be corrupted as soon as their template is written to
+    if (!machine->isTemplate && hasClones(machine)) {
+        qWarning() << machine->name << "has linked clones and stays a template";
+        machine->isTemplate = true;
+        emit machine->isTemplateChanged();
+    }
+
+    // The saved state won't fit changed hardware settings
+    machine->discardSavedState();
+
     // Edit the VM metadata
     {
         const QString jsonFilePath = QStringLiteral("%1/info.json").arg(machine->storage);
@@ -377,36 +1189,31 @@ bool VMManager::editVM(Machine* machine)
 
 bool VMManager::deleteVM(Machine* machine)
 {
+    if (hasClones(machine)) {
+        qWarning() << "Not deleting" << machine->storage << "which has linked clones";
+        return false;
+    }
+
+    machine->coolDown();
     qDebug() << "Deleting:" << machine->storage;
     return QDir(machine->storage).removeRecursively();
 }
 
-bool VMManager::canVirtualize(const QString& arch)
+bool VMManager::hasClones(Machine* machine) const
 {
-    // Only "arm64" and "x86_64" are supported anyway
-    const QString currentCpuType = QSysInfo::currentCpuArchitecture();
-    const QString machineType = currentCpuType == QStringLiteral("arm64") ?
-                QStringLiteral("aarch64") : currentCpuType;
-    qDebug() << "uname" << machineType << "vs arch" << arch;
-
-    const QString kvmPath = QStringLiteral("/dev/kvm");
-
-    if (!QFile::exists(kvmPath)) {
-        qWarning() << "KVM is not enabled on this kernel or device.";
+    if (!machine || machine->hdd.isEmpty())
         return false;
-    }
 
-    QFileInfo kvmInfo(kvmPath);
-    if (!kvmInfo.isReadable()) {
-        qWarning() << "/dev/kvm is not readable.";
-        return false;
-    }
-    if (!kvmInfo.isWritable()) {
-        qWarning() << "/dev/kvm is not writable.";
-        return false;
+    for (const CachedEntry& entry : this->m_cache) {
+        if (entry.valid && entry.vm.value(KEY_BACKING_FILE).toString() == machine->hdd)
+            return true;
     }
+    return false;
+}
 
-    return (machineType == arch);
+bool VMManager::canVirtualize(const QString& arch)
+{
+    return HostCapabilities::instance().canVirtualize(arch);
 }
 
 int VMManager::maxRam()
@@ -419,7 +1226,9 @@ int VMManager::maxRam()
 
 int VMManager::maxCores()
 {
-    return sysconf(_SC_NPROCESSORS_CONF) - 1;
+    // As many as can be pinned, which leaves one CPU to the app
+    const int cpus = HostTopology::instance().maxVmCpus();
+    return cpus > 0 ? cpus : int(sysconf(_SC_NPROCESSORS_CONF)) - 1;
 }
 
 int VMManager::maxHddSize()
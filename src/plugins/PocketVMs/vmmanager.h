@@ -17,11 +17,22 @@
 #ifndef VMMANAGER_H
 #define VMMANAGER_H
 
+#include <QDateTime>
+#include <QFileSystemWatcher>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QList>
 #include <QObject>
+#include <QPointer>
 #include <QString>
+#include <QStringList>
+#include <QTimer>
+#include <QUrl>
 #include <QVariantList>
 #include <QVariantMap>
 
+#include <functional>
+
 #include "machine.h"
 
 class VMManager: public QObject {
@@ -29,6 +40,18 @@ class VMManager: public QObject {
 
     Q_PROPERTY(QVariantList vms MEMBER m_vms NOTIFY vmsChanged)
     Q_PROPERTY(bool refreshing MEMBER m_refreshing NOTIFY refreshingChanged)
+    Q_PROPERTY(int creatingVMs READ creatingVMs NOTIFY creatingVMsChanged)
+    // Storage paths of the VMs whose disk is being checked or compacted
+    Q_PROPERTY(QStringList maintainedVMs READ maintainedVMs NOTIFY maintainedVMsChanged)
+    // Resources handed out to the VMs started through startVM()
+    Q_PROPERTY(int committedRam READ committedRam NOTIFY committedResourcesChanged)
+    Q_PROPERTY(int committedCores READ committedCores NOTIFY committedResourcesChanged)
+    Q_PROPERTY(int ramBudget READ ramBudget CONSTANT)
+    Q_PROPERTY(int coreBudget READ coreBudget CONSTANT)
+    // Storage paths of the VMs waiting for resources to become available
+    Q_PROPERTY(QStringList queuedVMs READ queuedVMs NOTIFY queuedVMsChanged)
+    // Storage paths of the VMs files are being imported into, once per file
+    Q_PROPERTY(QStringList importingVMs READ importingVMs NOTIFY importingVMsChanged)
 
     Q_PROPERTY(int maxRam READ maxRam CONSTANT)
     Q_PROPERTY(int maxCores READ maxCores CONSTANT)
@@ -36,14 +59,33 @@ class VMManager: public QObject {
 
 public:
     VMManager();
-    ~VMManager() = default;
+    ~VMManager();
 
-    Q_INVOKABLE void startVM(Machine* machine);
+    // Starts the VM if it fits into the remaining budget, or queues it
+    // until enough running VMs stopped. Returns false if it never fits.
+    Q_INVOKABLE bool startVM(Machine* machine);
+    Q_INVOKABLE void cancelStartVM(Machine* machine);
+    // Machine::warmUp() if the VM could be started right now
+    Q_INVOKABLE void prewarmVM(Machine* machine);
     Q_INVOKABLE void refreshVMs();
     Q_INVOKABLE static Machine* fromQml(const QVariantMap& vm);
-    Q_INVOKABLE static bool createVM(Machine* machine);
-    Q_INVOKABLE static bool editVM(Machine* machine);
-    Q_INVOKABLE static bool deleteVM(Machine* machine);
+    // Returns immediately, see vmCreationProgress() and vmCreated()
+    Q_INVOKABLE bool createVM(Machine* machine);
+    // Creates a linked clone of a template, asynchronously like createVM()
+    Q_INVOKABLE bool cloneVM(Machine* base, const QString& name);
+    Q_INVOKABLE bool editVM(Machine* machine);
+    Q_INVOKABLE bool deleteVM(Machine* machine);
+    Q_INVOKABLE bool hasClones(Machine* machine) const;
+    // Both return immediately, see diskMaintenanceProgress() and
+    // diskMaintenanceFinished(). The results of the last check are part
+    // of the VM's list entry.
+    Q_INVOKABLE bool checkDisk(Machine* machine);
+    // Rewrites the disk image without unused clusters, optionally compressed
+    Q_INVOKABLE bool compactDisk(Machine* machine, bool compress);
+    Q_INVOKABLE QVariantMap diskInfo(Machine* machine) const;
+    // Moves the file into the VM's shared folder. Returns immediately, see
+    // importProgress() and importFinished().
+    Q_INVOKABLE bool importIntoShare(Machine* machine, const QUrl& url);
     Q_INVOKABLE static bool resetEFIFirmware(Machine* machine);
     Q_INVOKABLE static bool resetEFINVRAM(Machine* machine);
 
@@ -52,18 +94,76 @@ public:
 private:
     static QVariantMap listEntryForJSON(const QString& path, const QString& storage);
     static QByteArray machineToJSON(const Machine* machine);
+    static QString efiFirmwareSource(const QString& arch);
+    static QString efiNVRAMSource(const QString& arch);
+    bool startVMCreation(Machine* machine, const QString& nvramSource);
     void setRefreshing(bool value);
+    int creatingVMs() const;
+    QStringList maintainedVMs() const;
+    int committedRam() const;
+    int committedCores() const;
+    QStringList queuedVMs() const;
+    QStringList importingVMs() const;
+    bool fitsBudget(const Machine* machine) const;
+    bool launchVM(Machine* machine);
+    void releaseVM(Machine* machine);
+    void startQueuedVMs();
+    void quitRunningVMs();
+    static int ramBudget();
+    static int coreBudget();
+    bool startDiskMaintenance(Machine* machine, const std::function<QVariantMap(const std::function<void(int)>&)>& job);
+    void refreshDiskInfo(const QString& hdd);
 
     static int maxRam();
     static int maxCores();
     static int maxHddSize();
 
+    // Parsed info.json files, reused for as long as they're unchanged
+    struct CachedEntry {
+        QDateTime modified;
+        qint64 size = -1;
+        bool valid = false;
+        QVariantMap vm;
+    };
+
     QVariantList m_vms;
-    bool m_refreshing;
+    bool m_refreshing = false;
+    QHash<QString, CachedEntry> m_cache;
+    QFileSystemWatcher m_watcher;
+    QTimer m_refreshTimer;
+    QList<QFutureWatcher<bool>*> m_creations;
+
+    // qemu-img results per disk image, refreshed when the image changed
+    struct CachedDiskInfo {
+        QDateTime modified;
+        QDateTime refreshed;
+        QVariantMap info;
+    };
+    QHash<QString, CachedDiskInfo> m_diskInfo;
+    QStringList m_diskInfoPending;
+    QHash<QFutureWatcher<QVariantMap>*, QString> m_maintenance;
+    QHash<QFutureWatcher<bool>*, QString> m_imports;
+
+    QList<QPointer<Machine>> m_runningVMs;
+    QHash<Machine*, QMetaObject::Connection> m_runningConnections;
+    QList<QPointer<Machine>> m_queuedVMs;
 
 signals:
     void vmsChanged();
     void refreshingChanged();
+    void creatingVMsChanged();
+    // Progress in percent of the VM being created in "storage"
+    void vmCreationProgress(const QString& storage, int progress);
+    void vmCreated(const QString& storage, bool success);
+    void maintainedVMsChanged();
+    void committedResourcesChanged();
+    void queuedVMsChanged();
+    void diskMaintenanceProgress(const QString& storage, int progress);
+    void diskMaintenanceFinished(const QString& storage, bool success);
+    void importingVMsChanged();
+    // Progress in percent of a file being imported into "storage"
+    void importProgress(const QString& storage, const QString& fileName, int progress);
+    void importFinished(const QString& storage, const QString& fileName, bool success);
 };
 
 #endif
@@ -19,294 +19,714 @@
 
 #include "vnc_client.h"
 
+#include "dbus_display.h"
+#include "rfb_recorder.h"
+#include "vnc_output.h"
+#include "vnc_statistics.h"
+
+#include <QAtomicInt>
 #include <QByteArrayList>
+#include <QClipboard>
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QGuiApplication>
 #include <QImage>
 #include <QKeyEvent>
 #include <QList>
 #include <QMouseEvent>
 #include <QPointF>
-#include <QQuickItem>
+#include <QRect>
+#include <QRegion>
 #include <QScopedPointer>
+#include <QSize>
 #include <QSocketNotifier>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <sys/ioctl.h>
 #define XK_CYRILLIC
 #include <rfb/rfbclient.h>
 
 using namespace LomiriVNC;
 
+/* Delays between connection attempts, doubling up to the maximum */
+static const int RETRY_MIN_MS = 50;
+static const int RETRY_MAX_MS = 2000;
+/* How long a server may stay silent before it's probed, and then again
+ * before it's considered stalled */
+static const int STALL_CHECK_MS = 5000;
+
+/* Each connection is a session of its own, with its own handshake: the
+ * first one is recorded to the file itself, later ones to numbered files
+ * next to it, as in "session.2.rfb" */
+static QString recordingFileName(const QString &fileName, int connection)
+{
+    if (connection == 0) return fileName;
+
+    const QFileInfo info(fileName);
+    QString name = info.completeBaseName() + QLatin1Char('.') +
+        QString::number(connection + 1);
+    if (!info.suffix().isEmpty()) {
+        name += QLatin1Char('.') + info.suffix();
+    }
+    return info.dir().filePath(name);
+}
+
 namespace LomiriVNC {
 
-class VncClientPrivate {
-    Q_DECLARE_PUBLIC(VncClient)
+struct KeyStroke {
+    uint32_t code;
+    bool pressed;
+};
 
+/* Lock-free triple buffer handing the decoded frames from the worker thread
+ * over to the GUI thread: the worker owns the write slot, the GUI owns the
+ * read slot, and the middle slot is exchanged atomically between them.
+ */
+class FrameExchange {
 public:
-    VncClientPrivate(VncClient *q);
-    ~VncClientPrivate();
+    struct Frame {
+        QImage image;
+        /* Area changed since the frame the reader had before taking this
+         * one (possibly more) */
+        QRegion damage;
+        /* Area which changed in the framebuffer since this slot was last
+         * written; only accessed by the worker */
+        QRegion stale;
+    };
+
+    FrameExchange();
+
+    /* Worker thread: copies the changed parts of `source` into the write
+     * slot and publishes it. Returns true if the reader needs to be
+     * notified, false if the previous frame wasn't taken yet. */
+    bool publish(const QImage &source, const QRegion &damage);
+
+    /* GUI thread: takes the latest published frame, if any */
+    bool take();
+    const Frame &current() const { return m_frames[m_read]; }
+
+private:
+    enum {
+        IndexMask = 0x3,
+        FreshBit = 0x4,
+    };
+
+    Frame m_frames[3];
+    int m_write;
+    QAtomicInt m_middle;
+    int m_read;
+    /* Worker thread: damage since the last frame known to be taken */
+    QRegion m_pendingDamage;
+};
+
+/* Encoding and pixel format choices, copied to the worker thread */
+struct VncSettings {
+    VncSettings():
+        compressLevel(3),
+        qualityLevel(5),
+        lowColorDepth(false),
+        remoteCursor(true) {}
+
+    QByteArray encodings;
+    int compressLevel;
+    int qualityLevel;
+    bool lowColorDepth;
+    bool remoteCursor;
+    /* Where to record the sessions, if anywhere */
+    QString recordFile;
+};
+
+class VncClientPrivate;
+
+/* Lives in the VNC thread, and owns the rfbClient: all the RFB messages are
+ * read, decoded and sent from there. */
+class VncWorker: public QObject {
+public:
+    VncWorker(VncClientPrivate *d);
+    ~VncWorker();
 
     static void *dataTag();
-    static void vncLog(const char *format, ...);
-    static void vncError(const char *format, ...);
     static void gotFrameBufferUpdate(rfbClient *cl,
                                      int x, int y, int w, int h);
     static char *GetPassword(rfbClient *cl);
     static rfbBool mallocFrameBuffer(rfbClient* client);
-
-    static int qtToRfb(Qt::MouseButtons buttons);
-    static uint32_t qCharToVnc(QChar c);
-    static uint32_t qKeyToVnc(int key);
+    static void gotCursorShape(rfbClient *client, int xhot, int yhot,
+                               int width, int height, int bytesPerPixel);
+    static rfbBool handleCursorPos(rfbClient *client, int x, int y);
+    static void gotCutText(rfbClient *client, const char *text, int textlen);
+#ifdef HAVE_VNC_UTF8_CLIPBOARD
+    static void gotCutTextUtf8(rfbClient *client, const char *text,
+                               int textlen);
+#endif
 
     void onUpdate(int x, int y, int w, int h);
     void onResize();
+    void onCursorShape(int xhot, int yhot, int width, int height,
+                       int bytesPerPixel);
+    void onCursorPos(int x, int y);
+    void onCutText(const QString &text);
     char *getPassword();
 
-    bool connectToServer(const QString &host, const QString &password);
+    /* Keeps trying until connected, and reconnects whenever the connection
+     * is lost, until disconnect() is called */
+    bool connectToServer(const QString &host, const QString &password,
+                         const VncSettings &settings);
+    bool replay(const QString &fileName, bool realTime,
+                const VncSettings &settings);
     void disconnect();
+    void setSettings(const VncSettings &settings);
 
     void onSocketActivated();
 
-    void sendKeyEvent(QChar c);
-    void sendKeyEvent(QKeyEvent *keyEvent, bool pressed);
-    void sendKeyEvent(uint32_t code, bool pressed);
-    void sendMouseEvent(const QPointF &pos, Qt::MouseButtons buttons);
+    void sendKeyEvents(const QVector<KeyStroke> &strokes);
+    void sendMouseEvent(int x, int y, int buttonMask);
+    void sendCutText(const QString &text);
+    void setDesktopSize(const QSize &size);
+
+    void setFramebufferUpdates(bool enabled);
 
 private:
+    bool tryConnect();
+    void scheduleReconnect();
+    void onSocketDirChanged();
+    void checkStalled();
+    bool open(const QString &address);
+    void closeConnection();
+    void applyEncodings();
+    void applyUpdateRect();
+    void publishFrame();
+    void setConnected(bool connected);
+
+    VncClientPrivate *d;
     QScopedPointer<QSocketNotifier> m_notifier;
     int m_bytesPerPixel;
-    QImage m_image;
-    QList<QQuickItem*> m_viewers;
+    /* The back buffer, which libvncclient decodes into, and its pixels */
+    QByteArray m_frameData;
+    QImage m_frameBuffer;
+    QRegion m_damage;
+    QString m_host;
     QString m_password;
+    VncSettings m_settings;
+    QByteArray m_encodings;
+    const char *m_defaultEncodings;
+    bool m_framebufferUpdates;
+    /* Recorder or replayer the client is connected through, if any */
+    QScopedPointer<RfbRelay> m_relay;
+    /* Connections recorded since connectToServer() */
+    int m_recordings;
+    bool m_replaying;
+    /* Whether to connect again after a failure or a lost connection */
+    bool m_reconnect;
+    int m_retryDelay;
+    QTimer *m_retryTimer;
+    /* Watches for the server's unix socket to appear */
+    QFileSystemWatcher *m_socketWatcher;
+    QTimer *m_stallTimer;
+    /* Since the server last sent anything */
+    QElapsedTimer m_lastActivity;
+    bool m_probing;
     rfbClient *m_client;
+};
+
+class VncClientPrivate {
+    Q_DECLARE_PUBLIC(VncClient)
+
+public:
+    VncClientPrivate(VncClient *q);
+    ~VncClientPrivate();
+
+    static void vncLog(const char *format, ...);
+    static void vncError(const char *format, ...);
+
+    static int qtToRfb(Qt::MouseButtons buttons);
+    static uint32_t qCharToVnc(uint ucs4);
+    static uint32_t qKeyToVnc(int key);
+    static Qt::KeyboardModifier qKeyToModifier(int key);
+
+    bool connectToServer(const QString &host, const QString &password);
+    bool replay(const QString &fileName, bool realTime);
+    void disconnect();
+
+    void onFrameReady();
+    void onConnectionStatus(bool connected);
+    void onDisplayUpdated(const QRect &rect);
+    void onCursorShape(const QImage &image, const QPoint &hotspot);
+    void onCursorPos(const QPoint &pos);
+    void onCutText(const QString &text);
+    void onReplayFinished();
+    void onSystemClipboardChanged();
+    void updateViewers(const QRect &rect);
+    void applySettings();
+
+    void sendText(const QString &text);
+    void sendKeyEvent(QKeyEvent *keyEvent, bool pressed);
+    void syncModifiers(Qt::KeyboardModifiers modifiers,
+                       QVector<KeyStroke> &strokes);
+    void sendKeyStrokes(const QVector<KeyStroke> &strokes);
+    void sendMouseEvent(const QPointF &pos, Qt::MouseButtons buttons);
+    void sendClipboard(const QString &text);
+    void requestDesktopSize(const QSize &size);
+    void applyDesktopSize();
+
+private:
+    friend class VncWorker;
+    QThread m_thread;
+    VncWorker *m_worker;
+    FrameExchange m_frames;
+    VncMetrics m_metrics;
+    DBusDisplay m_display;
+    QString m_displayBus;
+    bool m_sharedDisplay;
+    VncSettings m_settings;
+    QImage m_cursorImage;
+    QPoint m_cursorHotspot;
+    QList<VncOutput*> m_viewers;
+    /* The last text exchanged with the server, either way */
+    QString m_clipboard;
+    bool m_clipboardSharing;
+    /* Guest screen size wanted by the viewers, set once it settled */
+    QSize m_desktopSize;
+    QTimer m_resizeTimer;
+    /* Modifiers the server considers pressed */
+    Qt::KeyboardModifiers m_modifiers;
+    bool m_connected;
     VncClient *q_ptr;
 };
 
 } // namespace
 
-VncClientPrivate::VncClientPrivate(VncClient *q):
+FrameExchange::FrameExchange():
+    m_write(0),
+    m_middle(1),
+    m_read(2)
+{
+}
+
+bool FrameExchange::publish(const QImage &source, const QRegion &damage)
+{
+    Frame &frame = m_frames[m_write];
+
+    QRegion dirty = frame.stale + damage;
+    if (frame.image.size() != source.size() ||
+        frame.image.format() != source.format()) {
+        frame.image = QImage(source.size(), source.format());
+        dirty = source.rect();
+    }
+
+    const int bytesPerPixel = source.depth() / 8;
+    for (const QRect &r: dirty) {
+        const QRect rect = r.intersected(source.rect());
+        const int offset = rect.x() * bytesPerPixel;
+        const int length = rect.width() * bytesPerPixel;
+        for (int y = rect.top(); y <= rect.bottom(); y++) {
+            memcpy(frame.image.scanLine(y) + offset,
+                   source.constScanLine(y) + offset, length);
+        }
+    }
+    frame.stale = QRegion();
+    frame.damage = m_pendingDamage + damage;
+
+    /* The other two slots are now out of date in the damaged area */
+    for (int i = 0; i < 3; i++) {
+        if (i != m_write) m_frames[i].stale += damage;
+    }
+
+    const int old = m_middle.fetchAndStoreOrdered(m_write | FreshBit);
+    m_write = old & IndexMask;
+
+    /* If the previous frame was taken, the reader is up to date with it and
+     * the next frame only needs to carry its own damage; otherwise, keep
+     * accumulating. */
+    const bool taken = !(old & FreshBit);
+    m_pendingDamage = taken ? damage : frame.damage;
+    return taken;
+}
+
+bool FrameExchange::take()
+{
+    /* Only the reader clears the fresh bit, so it can't go away between
+     * the check and the exchange */
+    if (!(m_middle.loadAcquire() & FreshBit)) return false;
+
+    const int old = m_middle.fetchAndStoreOrdered(m_read);
+    m_read = old & IndexMask;
+    return true;
+}
+
+VncWorker::VncWorker(VncClientPrivate *d):
+    QObject(),
+    d(d),
     m_bytesPerPixel(4),
-    m_client(nullptr),
-    q_ptr(q)
+    m_defaultEncodings(nullptr),
+    m_framebufferUpdates(true),
+    m_recordings(0),
+    m_replaying(false),
+    m_reconnect(false),
+    m_retryDelay(RETRY_MIN_MS),
+    m_retryTimer(new QTimer(this)),
+    m_socketWatcher(new QFileSystemWatcher(this)),
+    m_stallTimer(new QTimer(this)),
+    m_probing(false),
+    m_client(nullptr)
 {
-    rfbClientLog = vncLog;
-    rfbClientErr = vncError;
+    /* Children, so that they move to the VNC thread along with the worker */
+    m_retryTimer->setSingleShot(true);
+    QObject::connect(m_retryTimer, &QTimer::timeout,
+                     this, [this]() { tryConnect(); });
+    QObject::connect(m_socketWatcher, &QFileSystemWatcher::directoryChanged,
+                     this, [this]() { onSocketDirChanged(); });
+    m_stallTimer->setInterval(STALL_CHECK_MS);
+    QObject::connect(m_stallTimer, &QTimer::timeout,
+                     this, [this]() { checkStalled(); });
 }
 
-VncClientPrivate::~VncClientPrivate()
+VncWorker::~VncWorker()
 {
     disconnect();
 }
 
-void *VncClientPrivate::dataTag()
+void *VncWorker::dataTag()
 {
     return reinterpret_cast<void*>(dataTag);
 }
 
-void VncClientPrivate::vncLog(const char *format, ...)
+void VncWorker::gotFrameBufferUpdate(rfbClient *client,
+                                     int x, int y, int w, int h)
 {
-    va_list args;
-	va_start(args, format);
-    QString message = QString::vasprintf(format, args);
-	va_end(args);
-
-    qDebug() << "VNC:" << message.trimmed();
+    void *ptr = rfbClientGetClientData(client, dataTag());
+    static_cast<VncWorker*>(ptr)->onUpdate(x, y, w, h);
 }
 
-void VncClientPrivate::vncError(const char *format, ...)
+char *VncWorker::GetPassword(rfbClient *client)
 {
-    va_list args;
-	va_start(args, format);
-    QString message = QString::vasprintf(format, args);
-	va_end(args);
+    void *ptr = rfbClientGetClientData(client, dataTag());
+    return static_cast<VncWorker*>(ptr)->getPassword();
+}
 
-    qWarning() << "VNC:" << message.trimmed();
+rfbBool VncWorker::mallocFrameBuffer(rfbClient* client)
+{
+    void *ptr = rfbClientGetClientData(client, dataTag());
+    static_cast<VncWorker*>(ptr)->onResize();
+    return true;
 }
 
-void VncClientPrivate::gotFrameBufferUpdate(rfbClient *client,
-                                            int x, int y, int w, int h)
+void VncWorker::gotCursorShape(rfbClient *client, int xhot, int yhot,
+                               int width, int height, int bytesPerPixel)
 {
     void *ptr = rfbClientGetClientData(client, dataTag());
-    static_cast<VncClientPrivate*>(ptr)->onUpdate(x, y, w, h);
+    static_cast<VncWorker*>(ptr)->onCursorShape(xhot, yhot, width, height,
+                                                bytesPerPixel);
 }
 
-char *VncClientPrivate::GetPassword(rfbClient *client)
+rfbBool VncWorker::handleCursorPos(rfbClient *client, int x, int y)
 {
     void *ptr = rfbClientGetClientData(client, dataTag());
-    return static_cast<VncClientPrivate*>(ptr)->getPassword();
+    static_cast<VncWorker*>(ptr)->onCursorPos(x, y);
+    return TRUE;
 }
 
-rfbBool VncClientPrivate::mallocFrameBuffer(rfbClient* client)
+void VncWorker::gotCutText(rfbClient *client, const char *text, int textlen)
 {
     void *ptr = rfbClientGetClientData(client, dataTag());
-    static_cast<VncClientPrivate*>(ptr)->onResize();
-    return true;
+    /* Plain RFB cut text is Latin-1 */
+    static_cast<VncWorker*>(ptr)->onCutText(QString::fromLatin1(text, textlen));
 }
 
-int VncClientPrivate::qtToRfb(Qt::MouseButtons buttons)
+#ifdef HAVE_VNC_UTF8_CLIPBOARD
+void VncWorker::gotCutTextUtf8(rfbClient *client, const char *text,
+                               int textlen)
 {
-    int ret = 0;
-    if (buttons & Qt::LeftButton) ret |= rfbButton1Mask;
-    if (buttons & Qt::RightButton) ret |= rfbButton2Mask;
-    if (buttons & Qt::MiddleButton) ret |= rfbButton3Mask;
-    return ret;
+    void *ptr = rfbClientGetClientData(client, dataTag());
+    static_cast<VncWorker*>(ptr)->onCutText(QString::fromUtf8(text, textlen));
 }
+#endif
 
-#include "key_mapping.h"
+void VncWorker::onUpdate(int x, int y, int w, int h)
+{
+    m_damage += QRect(x, y, w, h);
+}
 
-uint32_t VncClientPrivate::qCharToVnc(QChar c)
+void VncWorker::onResize()
 {
-    uint32_t code = 0;
+    int width = m_client->width;
+    int height = m_client->height;
+    qDebug() << Q_FUNC_INFO << width << height;
 
-    if (char latin1 = c.toLatin1()) {
-        code = XK_a + latin1 - 'a';
+    /* RGBX8888 has the same byte order as GL_RGBA, so that VncOutput can
+     * upload the framebuffer to its texture without any conversion; the
+     * same goes for native endian RGB565 and GL_UNSIGNED_SHORT_5_6_5 */
+    const bool lowColorDepth = m_bytesPerPixel == 2;
+    const QImage::Format format =
+        lowColorDepth ? QImage::Format_RGB16 : QImage::Format_RGBX8888;
+    /* Reconnecting to the same guest usually finds the same size: keep the
+     * buffer, showing the last frame until the server sends a new one */
+    if (m_frameBuffer.size() != QSize(width, height) ||
+        m_frameBuffer.format() != format) {
+        /* libvncclient takes the width as the stride, so the rows have to
+         * be packed; QImage would pad odd RGB16 rows to 4 bytes */
+        const int bytesPerLine = width * m_bytesPerPixel;
+        m_frameBuffer = QImage();
+        m_frameData = QByteArray(bytesPerLine * height, Qt::Uninitialized);
+        m_frameBuffer = QImage(reinterpret_cast<uchar*>(m_frameData.data()),
+                               width, height, bytesPerLine, format);
+        m_frameBuffer.fill(Qt::black);
+        m_damage = m_frameBuffer.rect();
     }
+    m_client->frameBuffer = m_frameBuffer.bits();
+    m_client->format.bitsPerPixel = m_frameBuffer.depth();
+    if (lowColorDepth) {
+        m_client->format.depth=16;
+        m_client->format.redShift=11;
+        m_client->format.greenShift=5;
+        m_client->format.blueShift=0;
+        m_client->format.redMax=0x1f;
+        m_client->format.greenMax=0x3f;
+        m_client->format.blueMax=0x1f;
+    } else {
+        m_client->format.depth=24;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        m_client->format.redShift=0;
+        m_client->format.greenShift=8;
+        m_client->format.blueShift=16;
+#else
+        m_client->format.redShift=24;
+        m_client->format.greenShift=16;
+        m_client->format.blueShift=8;
+#endif
+        m_client->format.redMax=0xff;
+        m_client->format.greenMax=0xff;
+        m_client->format.blueMax=0xff;
+    }
+    m_client->canHandleNewFBSize=true;
+    applyEncodings();
+    applyUpdateRect();
+    bool ok = SetFormatAndEncodings(m_client);
+    if (Q_UNLIKELY(!ok)) {
+        qWarning() << "Could not set format to server";
+    }
+}
 
-    if (code == 0) {
-        uint16_t unicode = c.unicode();
-        for (UnicodeKeyEntry *i = unicodeToX11; i->unicode != 0; i++) {
-            if (i->unicode == unicode) {
-                code = i->xKey;
-                break;
+void VncWorker::onCursorShape(int xhot, int yhot, int width, int height,
+                              int bytesPerPixel)
+{
+    /* The shape comes in the framebuffer's pixel format, with a separate
+     * one byte per pixel mask */
+    QImage image;
+    if (width > 0 && height > 0 && m_client->rcSource && m_client->rcMask) {
+        const rfbPixelFormat &f = m_client->format;
+        image = QImage(width, height, QImage::Format_ARGB32_Premultiplied);
+        const uint8_t *source = m_client->rcSource;
+        const uint8_t *mask = m_client->rcMask;
+        for (int y = 0; y < height; y++) {
+            QRgb *line = reinterpret_cast<QRgb*>(image.scanLine(y));
+            for (int x = 0; x < width; x++, source += bytesPerPixel) {
+                if (!*mask++) {
+                    line[x] = 0;
+                    continue;
+                }
+                uint32_t pixel;
+                if (bytesPerPixel == 2) {
+                    uint16_t p16;
+                    memcpy(&p16, source, 2);
+                    pixel = p16;
+                } else {
+                    memcpy(&pixel, source, 4);
+                }
+                line[x] = qRgb(((pixel >> f.redShift) & f.redMax) * 255 / f.redMax,
+                               ((pixel >> f.greenShift) & f.greenMax) * 255 / f.greenMax,
+                               ((pixel >> f.blueShift) & f.blueMax) * 255 / f.blueMax);
             }
         }
-        qDebug() << "char" << c << "unicode" << code;
     }
-    return code;
+
+    VncClientPrivate *priv = d;
+    const QPoint hotspot(xhot, yhot);
+    QMetaObject::invokeMethod(d->q_ptr, [priv, image, hotspot]() {
+        priv->onCursorShape(image, hotspot);
+    }, Qt::QueuedConnection);
 }
 
-uint32_t VncClientPrivate::qKeyToVnc(int key)
+void VncWorker::onCursorPos(int x, int y)
 {
-    uint32_t code = 0;
-    if (key >= Qt::Key_0 && key <= Qt::Key_9) {
-        code = XK_0 + key - Qt::Key_0;
-    } else if (key >= Qt::Key_A && key <= Qt::Key_Z) {
-        code = XK_a + key - Qt::Key_A;
-    } else if (key >= Qt::Key_F1 && key <= Qt::Key_F35) {
-        code = XK_F1 + key - Qt::Key_F1;
-    } else {
-        switch (key) {
-        case Qt::Key_Escape: code = XK_Escape; break;
-        case Qt::Key_Tab: code = XK_Tab; break;
-        case Qt::Key_Backspace: code = XK_BackSpace; break;
-        case Qt::Key_Return:
-        case Qt::Key_Enter:
-            code = XK_Return;
-            break;
-        case Qt::Key_Insert: code = XK_Insert; break;
-        case Qt::Key_Delete: code = XK_Delete; break;
-        case Qt::Key_Pause: code = XK_Pause; break;
-        case Qt::Key_Print: code = XK_Print; break;
-        case Qt::Key_SysReq: code = XK_Sys_Req; break;
-        case Qt::Key_Clear: code = XK_Clear; break;
-        case Qt::Key_Home: code = XK_Home; break;
-        case Qt::Key_End: code = XK_End; break;
-        case Qt::Key_Left: code = XK_Left; break;
-        case Qt::Key_Up: code = XK_Up; break;
-        case Qt::Key_Right: code = XK_Right; break;
-        case Qt::Key_Down: code = XK_Down; break;
-        case Qt::Key_PageUp: code = XK_Page_Up; break;
-        case Qt::Key_PageDown: code = XK_Page_Down; break;
-        case Qt::Key_Shift: code = XK_Shift_L; break;
-        case Qt::Key_Control: code = XK_Control_L; break;
-        case Qt::Key_Meta: code = XK_Meta_L; break;
-        case Qt::Key_Alt: code = XK_Alt_L; break;
-        case Qt::Key_AltGr: code = XK_Alt_R; break;
-        case Qt::Key_CapsLock: code = XK_Caps_Lock; break;
-        case Qt::Key_NumLock: code = XK_Num_Lock; break;
-        case Qt::Key_ScrollLock: code = XK_Scroll_Lock; break;
-        case Qt::Key_Super_L: code = XK_Super_L; break;
-        case Qt::Key_Super_R: code = XK_Super_R; break;
-        case Qt::Key_Menu: code = XK_Menu; break;
-        case Qt::Key_Hyper_L: code = XK_Hyper_L; break;
-        case Qt::Key_Hyper_R: code = XK_Hyper_R; break;
-        case Qt::Key_Help: code = XK_Help; break;
-        case Qt::Key_Exclam: code = XK_exclam; break;
-        case Qt::Key_QuoteDbl: code = XK_quotedbl; break;
-        case Qt::Key_NumberSign: code = XK_numbersign; break;
-        case Qt::Key_Dollar: code = XK_dollar; break;
-        case Qt::Key_Percent: code = XK_percent; break;
-        case Qt::Key_Ampersand: code = XK_ampersand; break;
-        case Qt::Key_Apostrophe: code = XK_apostrophe; break;
-        case Qt::Key_ParenLeft: code = XK_parenleft; break;
-        case Qt::Key_ParenRight: code = XK_parenright; break;
-        case Qt::Key_Asterisk: code = XK_asterisk; break;
-        case Qt::Key_Plus: code = XK_plus; break;
-        case Qt::Key_Comma: code = XK_comma; break;
-        case Qt::Key_Minus: code = XK_minus; break;
-        case Qt::Key_Period: code = XK_period; break;
-        case Qt::Key_Slash: code = XK_slash; break;
-        case 32: code = XK_KP_Space; break;
-
-        default:
-            qWarning() << "Unsupported key:" << key;
+    VncClientPrivate *priv = d;
+    const QPoint pos(x, y);
+    QMetaObject::invokeMethod(d->q_ptr, [priv, pos]() {
+        priv->onCursorPos(pos);
+    }, Qt::QueuedConnection);
+}
+
+void VncWorker::onCutText(const QString &text)
+{
+    VncClientPrivate *priv = d;
+    QMetaObject::invokeMethod(d->q_ptr, [priv, text]() {
+        priv->onCutText(text);
+    }, Qt::QueuedConnection);
+}
+
+char *VncWorker::getPassword()
+{
+	return strdup(m_password.toUtf8().constData());
+}
+
+bool VncWorker::connectToServer(const QString &host, const QString &password,
+                                const VncSettings &settings)
+{
+    disconnect();
+
+    m_host = host;
+    m_password = QString(password);
+    m_settings = settings;
+    m_replaying = false;
+    m_recordings = 0;
+    m_reconnect = true;
+    m_retryDelay = RETRY_MIN_MS;
+    return tryConnect();
+}
+
+bool VncWorker::tryConnect()
+{
+    if (m_client) return true;
+
+    /* QEMU creates its socket some time after being started; connect as
+     * soon as it shows up, with the timer as a fallback */
+    const bool local = m_host.startsWith(QLatin1Char('/'));
+    if (local && !QFileInfo::exists(m_host)) {
+        const QString dir = QFileInfo(m_host).absolutePath();
+        if (!m_socketWatcher->directories().contains(dir)) {
+            m_socketWatcher->addPath(dir);
         }
+        scheduleReconnect();
+        return false;
     }
-    return code;
+
+    QString address = m_host;
+    if (!m_settings.recordFile.isEmpty()) {
+        if (local) {
+            RfbRecorder *recorder =
+                new RfbRecorder(m_host,
+                                recordingFileName(m_settings.recordFile,
+                                                  m_recordings),
+                                m_settings.lowColorDepth ? 2 : 4);
+            m_relay.reset(recorder);
+            address = recorder->listen();
+            if (address.isEmpty()) {
+                m_relay.reset();
+                address = m_host;
+            }
+        } else {
+            qWarning() << "Only sessions on local sockets can be recorded";
+        }
+    }
+
+    if (!open(address)) {
+        scheduleReconnect();
+        return false;
+    }
+    if (m_relay) {
+        m_recordings++;
+    }
+
+    const QStringList dirs = m_socketWatcher->directories();
+    if (!dirs.isEmpty()) {
+        m_socketWatcher->removePaths(dirs);
+    }
+    m_retryDelay = RETRY_MIN_MS;
+    m_lastActivity.start();
+    m_probing = false;
+    m_stallTimer->start();
+    return true;
 }
 
-void VncClientPrivate::onUpdate(int x, int y, int w, int h)
+void VncWorker::scheduleReconnect()
 {
-    Q_UNUSED(x);
-    Q_UNUSED(y);
-    Q_UNUSED(w);
-    Q_UNUSED(h);
+    if (!m_reconnect || m_retryTimer->isActive()) return;
 
-    for (QQuickItem *viewer: m_viewers) {
-        // TODO: update only the changed area
-        viewer->update();
-    }
+    m_retryTimer->start(m_retryDelay);
+    m_retryDelay = qMin(m_retryDelay * 2, RETRY_MAX_MS);
 }
 
-void VncClientPrivate::onResize()
+void VncWorker::onSocketDirChanged()
 {
-    int width = m_client->width;
-    int height = m_client->height;
-    qDebug() << Q_FUNC_INFO << width << height;
+    if (m_client || !QFileInfo::exists(m_host)) return;
 
-    m_client->updateRect.x = m_client->updateRect.y = 0;
-    m_client->updateRect.w = width;
-    m_client->updateRect.h = height;
-
-    m_image = QImage(m_client->width, m_client->height, QImage::Format_RGB32);
-    m_client->frameBuffer = m_image.bits();
-    m_client->width = m_image.bytesPerLine() / m_bytesPerPixel;
-    m_client->format.bitsPerPixel = m_image.depth();
-    m_client->format.redShift=16;
-    m_client->format.greenShift=8;
-    m_client->format.blueShift=0;
-    m_client->format.redMax=0xff;
-    m_client->format.greenMax=0xff;
-    m_client->format.blueMax=0xff;
-    m_client->canHandleNewFBSize=true;
-    bool ok = SetFormatAndEncodings(m_client);
-    if (Q_UNLIKELY(!ok)) {
-        qWarning() << "Could not set format to server";
-    }
+    m_retryTimer->stop();
+    m_retryDelay = RETRY_MIN_MS;
+    tryConnect();
 }
 
-char *VncClientPrivate::getPassword()
+void VncWorker::checkStalled()
 {
-	return strdup(m_password.toUtf8().constData());
+    if (!m_client || m_lastActivity.elapsed() < STALL_CHECK_MS) return;
+
+    /* An idle server has nothing to send: ask for a single pixel, which
+     * it has to answer even if it didn't change */
+    if (!m_probing) {
+        m_probing = true;
+        SendFramebufferUpdateRequest(m_client, 0, 0, 1, 1, FALSE);
+        return;
+    }
+
+    qWarning() << "VNC server" << m_host << "stalled, reconnecting";
+    closeConnection();
+    scheduleReconnect();
 }
 
-bool VncClientPrivate::connectToServer(const QString &host, const QString &password)
+bool VncWorker::replay(const QString &fileName, bool realTime,
+                       const VncSettings &settings)
 {
-    Q_Q(VncClient);
+    /* Also stops any reconnection attempts */
+    disconnect();
 
-    if (m_client) {
-        disconnect();
+    RfbReplayer *replayer = new RfbReplayer(fileName, realTime);
+    m_relay.reset(replayer);
+    m_host = fileName;
+    m_password.clear();
+    m_settings = settings;
+    /* The pixels come in the format of the recorded session */
+    m_settings.lowColorDepth = replayer->bytesPerPixel() == 2;
+    m_replaying = true;
+
+    const QString address =
+        replayer->bytesPerPixel() != 0 ? replayer->listen() : QString();
+    if (Q_UNLIKELY(address.isEmpty() || !open(address))) {
+        m_relay.reset();
+        setConnected(false);
+        return false;
     }
+    return true;
+}
 
-    m_password = QString(password);
+bool VncWorker::open(const QString &address)
+{
+    m_bytesPerPixel = m_settings.lowColorDepth ? 2 : 4;
 
-    m_client = rfbGetClient(8, 3, m_bytesPerPixel);
+    m_client = rfbGetClient(m_settings.lowColorDepth ? 5 : 8, 3, m_bytesPerPixel);
+    m_defaultEncodings = m_client->appData.encodingsString;
+    applyEncodings();
     m_client->MallocFrameBuffer = mallocFrameBuffer;
     m_client->GotFrameBufferUpdate = gotFrameBufferUpdate;
     m_client->GetPassword = GetPassword;
+    m_client->GotCursorShape = gotCursorShape;
+    m_client->HandleCursorPos = handleCursorPos;
+    m_client->GotXCutText = gotCutText;
+#ifdef HAVE_VNC_UTF8_CLIPBOARD
+    /* Also announces the extended clipboard, whose text is UTF-8 and
+     * zlib compressed */
+    m_client->GotXCutTextUTF8 = gotCutTextUtf8;
+#endif
     rfbClientSetClientData(m_client, dataTag(), this);
 
     QByteArrayList arguments = {
         "lomiri-vnc",
     };
-    arguments.append(host.toUtf8());
+    arguments.append(address.toUtf8());
     int argc = arguments.count();
     QVector<char *> argv;
     argv.reserve(argc + 1);
@@ -315,96 +735,886 @@ bool VncClientPrivate::connectToServer(const QString &host, const QString &passw
     }
     argv.append(nullptr);
 
+    /* On failure, the rfbClient is freed already */
     bool ok = rfbInitClient(m_client, &argc, argv.data());
     if (Q_UNLIKELY(!ok)) {
         qWarning() << "Could not initialize rfbClient";
         m_client = nullptr;
+        m_relay.reset();
         return false;
     }
 
     m_notifier.reset(new QSocketNotifier(m_client->sock,
                                          QSocketNotifier::Read));
     QObject::connect(m_notifier.data(), &QSocketNotifier::activated,
-                     q, [this]() { onSocketActivated(); });
-    Q_EMIT q->connectionStatusChanged();
+                     this, [this]() { onSocketActivated(); });
+    publishFrame();
+    setConnected(true);
     return true;
 }
 
-void VncClientPrivate::disconnect()
+void VncWorker::disconnect()
 {
-    Q_Q(VncClient);
+    m_reconnect = false;
+    m_retryTimer->stop();
+    const QStringList dirs = m_socketWatcher->directories();
+    if (!dirs.isEmpty()) {
+        m_socketWatcher->removePaths(dirs);
+    }
+    closeConnection();
+}
 
+void VncWorker::closeConnection()
+{
+    m_stallTimer->stop();
     m_notifier.reset();
     if (m_client) {
         rfbClientCleanup(m_client);
         m_client = nullptr;
+        setConnected(false);
     }
+    m_relay.reset();
+}
 
-    Q_EMIT q->connectionStatusChanged();
+void VncWorker::setSettings(const VncSettings &settings)
+{
+    /* A replay keeps the pixel format it was recorded with */
+    const bool lowColorDepth =
+        m_replaying ? m_settings.lowColorDepth : settings.lowColorDepth;
+    const bool depthChanged = lowColorDepth != m_settings.lowColorDepth;
+    m_settings = settings;
+    m_settings.lowColorDepth = lowColorDepth;
+    if (!m_client) return;
+
+    /* Updates in the old pixel format may already be on their way, and
+     * would be decoded with the new one: start over instead */
+    if (depthChanged) {
+        closeConnection();
+        m_retryDelay = RETRY_MIN_MS;
+        tryConnect();
+        return;
+    }
+
+    applyEncodings();
+    if (Q_UNLIKELY(!SetFormatAndEncodings(m_client))) {
+        qWarning() << "Could not set encodings to server";
+    }
+}
+
+void VncWorker::applyEncodings()
+{
+    if (!m_settings.encodings.isEmpty()) {
+        m_encodings = m_settings.encodings;
+    } else if (QFileInfo(m_host).exists()) {
+        /* Over a local socket decoding costs more than the bandwidth saved */
+        m_encodings = "copyrect raw";
+    } else {
+        m_encodings.clear();
+    }
+
+    m_client->appData.encodingsString =
+        m_encodings.isEmpty() ? m_defaultEncodings : m_encodings.constData();
+    m_client->appData.compressLevel = qBound(0, m_settings.compressLevel, 9);
+    m_client->appData.enableJPEG = m_settings.qualityLevel >= 0;
+    m_client->appData.qualityLevel = qBound(0, m_settings.qualityLevel, 9);
+    m_client->appData.useRemoteCursor = m_settings.remoteCursor;
 }
 
-void VncClientPrivate::onSocketActivated()
+void VncWorker::onSocketActivated()
 {
-    bool ok = HandleRFBServerMessage(m_client);
+    VncMetrics &metrics = d->m_metrics;
+    const bool measure = metrics.isEnabled();
+    QElapsedTimer timer;
+    int available = 0;
+    const int buffered = m_client->buffered;
+    if (measure) {
+        /* Data arriving while decoding is not counted; close enough */
+        ioctl(m_client->sock, FIONREAD, &available);
+        timer.start();
+    }
+
+    /* libvncclient reads ahead: handle all the messages it has already
+     * buffered, since the socket won't signal them again */
+    bool ok;
+    do {
+        ok = HandleRFBServerMessage(m_client);
+    } while (ok && m_client->buffered > 0);
+
+    if (measure) {
+        metrics.record(VncMetrics::DecodeTime, timer.nsecsElapsed() / 1e6);
+        metrics.record(VncMetrics::BytesReceived,
+                       available + buffered - m_client->buffered);
+    }
+    m_lastActivity.start();
+    m_probing = false;
+
+    /* The replayer hangs up at the end of the recording */
+    const bool replayed = !ok && m_replaying;
+    if (Q_UNLIKELY(!ok && !replayed)) {
+        qWarning() << "RFB failed to handle message from" << m_host;
+    }
+    publishFrame();
+
     if (Q_UNLIKELY(!ok)) {
-        qWarning() << "RFB failed to handle message";
+        /* Not from within the notifier's own signal */
+        m_notifier->setEnabled(false);
+        VncClientPrivate *priv = d;
+        rfbClient *client = m_client;
+        QMetaObject::invokeMethod(this, [this, priv, client, replayed]() {
+            if (m_client != client) return;
+            if (!replayed) {
+                /* Most likely the guest rebooted, or QEMU is gone */
+                closeConnection();
+                scheduleReconnect();
+                return;
+            }
+            disconnect();
+            QMetaObject::invokeMethod(d->q_ptr, [priv]() {
+                priv->onReplayFinished();
+            }, Qt::QueuedConnection);
+        }, Qt::QueuedConnection);
     }
 }
 
-void VncClientPrivate::sendKeyEvent(QChar c)
+void VncWorker::setFramebufferUpdates(bool enabled)
 {
-    uint32_t code = qCharToVnc(c);
-    sendKeyEvent(code, true);
-    sendKeyEvent(code, false);
+    m_framebufferUpdates = enabled;
+    if (!m_client) return;
+
+    applyUpdateRect();
+    if (enabled) {
+        SendFramebufferUpdateRequest(m_client, 0, 0,
+                                     m_client->width, m_client->height,
+                                     FALSE);
+    }
 }
 
-void VncClientPrivate::sendKeyEvent(QKeyEvent *keyEvent, bool pressed)
+void VncWorker::applyUpdateRect()
+{
+    /* While the framebuffer comes from the shared display, only ask for a
+     * single pixel, so that the server doesn't encode anything */
+    m_client->updateRect.x = m_client->updateRect.y = 0;
+    m_client->updateRect.w = m_framebufferUpdates ? m_client->width : 1;
+    m_client->updateRect.h = m_framebufferUpdates ? m_client->height : 1;
+}
+
+void VncWorker::publishFrame()
+{
+    if (m_damage.isEmpty()) return;
+
+    VncMetrics &metrics = d->m_metrics;
+    if (metrics.isEnabled()) {
+        qint64 area = 0;
+        for (const QRect &r: m_damage) {
+            area += qint64(r.width()) * r.height();
+        }
+        metrics.record(VncMetrics::DamageArea, area);
+        metrics.updateReceived();
+    }
+
+    bool mustNotify = d->m_frames.publish(m_frameBuffer, m_damage);
+    m_damage = QRegion();
+    if (mustNotify) {
+        VncClientPrivate *priv = d;
+        QMetaObject::invokeMethod(d->q_ptr, [priv]() {
+            priv->onFrameReady();
+        }, Qt::QueuedConnection);
+    }
+}
+
+void VncWorker::setConnected(bool connected)
 {
-    // TODO handle modifiers
-    uint32_t code = qKeyToVnc(keyEvent->key());
-    sendKeyEvent(code, pressed);
+    VncClientPrivate *priv = d;
+    QMetaObject::invokeMethod(d->q_ptr, [priv, connected]() {
+        priv->onConnectionStatus(connected);
+    }, Qt::QueuedConnection);
 }
 
-void VncClientPrivate::sendKeyEvent(uint32_t code, bool pressed)
+void VncWorker::sendKeyEvents(const QVector<KeyStroke> &strokes)
 {
     if (Q_UNLIKELY(!m_client)) {
         qWarning() << "Not connected";
         return;
     }
-    SendKeyEvent(m_client, code, pressed);
+    if (!SupportsClient2Server(m_client, rfbKeyEvent)) return;
+
+    /* Same messages as SendKeyEvent(), but all written at once */
+    QByteArray buffer;
+    buffer.reserve(strokes.count() * sz_rfbKeyEventMsg);
+    for (const KeyStroke &stroke: strokes) {
+        rfbKeyEventMsg msg;
+        msg.type = rfbKeyEvent;
+        msg.down = stroke.pressed ? 1 : 0;
+        msg.pad = 0;
+        msg.key = qToBigEndian<quint32>(stroke.code);
+        buffer.append(reinterpret_cast<const char *>(&msg), sz_rfbKeyEventMsg);
+    }
+    WriteToRFBServer(m_client, buffer.data(), buffer.size());
 }
 
-void VncClientPrivate::sendMouseEvent(const QPointF &pos,
-                                      Qt::MouseButtons buttons)
+void VncWorker::sendMouseEvent(int x, int y, int buttonMask)
 {
     if (Q_UNLIKELY(!m_client)) {
         qWarning() << "Not connected";
         return;
     }
-    SendPointerEvent(m_client, pos.x(), pos.y(), qtToRfb(buttons));
+    SendPointerEvent(m_client, x, y, buttonMask);
 }
 
-VncClient::VncClient(QObject *parent):
-    QObject(parent),
-    d_ptr(new VncClientPrivate(this))
+void VncWorker::sendCutText(const QString &text)
 {
-}
+    if (Q_UNLIKELY(!m_client)) {
+        qWarning() << "Not connected";
+        return;
+    }
 
-VncClient::~VncClient() = default;
+#ifdef HAVE_VNC_UTF8_CLIPBOARD
+    /* Fails if the server has no extended clipboard */
+    QByteArray utf8 = text.toUtf8();
+    if (SendClientCutTextUTF8(m_client, utf8.data(), utf8.size())) return;
+#endif
+    QByteArray latin1 = text.toLatin1();
+    SendClientCutText(m_client, latin1.data(), latin1.size());
+}
 
-bool VncClient::isConnected() const
+void VncWorker::setDesktopSize(const QSize &size)
 {
-    Q_D(const VncClient);
-    return d->m_client != nullptr;
+    if (Q_UNLIKELY(!m_client)) {
+        qWarning() << "Not connected";
+        return;
+    }
+    if (size == QSize(m_client->width, m_client->height)) return;
+
+#ifdef HAVE_VNC_DESKTOP_SIZE
+    /* Silently ignored unless the server announced ExtendedDesktopSize */
+    SendExtDesktopSize(m_client, size.width(), size.height());
+#else
+    qWarning() << "This libvncclient can't resize the remote desktop";
+#endif
 }
 
-void VncClient::addViewer(QQuickItem *viewer)
+VncClientPrivate::VncClientPrivate(VncClient *q):
+    m_worker(new VncWorker(this)),
+    m_sharedDisplay(false),
+    m_clipboardSharing(false),
+    m_modifiers(Qt::NoModifier),
+    m_connected(false),
+    q_ptr(q)
+{
+    rfbClientLog = vncLog;
+    rfbClientErr = vncError;
+
+    m_thread.setObjectName(QStringLiteral("VncWorker"));
+    m_worker->moveToThread(&m_thread);
+    m_thread.start();
+
+    QObject::connect(&m_display, &DBusDisplay::updated,
+                     q, [this](const QRect &rect) { onDisplayUpdated(rect); });
+    if (qGuiApp) {
+        QObject::connect(QGuiApplication::clipboard(), &QClipboard::dataChanged,
+                         q, [this]() { onSystemClipboardChanged(); });
+    }
+
+    /* Rotating the phone resizes the viewers several times in a row */
+    m_resizeTimer.setSingleShot(true);
+    m_resizeTimer.setInterval(500);
+    QObject::connect(&m_resizeTimer, &QTimer::timeout,
+                     q, [this]() { applyDesktopSize(); });
+    QObject::connect(&m_display, &DBusDisplay::attachedChanged,
+                     q, [this]() { m_resizeTimer.start(); });
+}
+
+VncClientPrivate::~VncClientPrivate()
+{
+    VncWorker *worker = m_worker;
+    QMetaObject::invokeMethod(worker, [worker]() {
+        worker->disconnect();
+    }, Qt::BlockingQueuedConnection);
+    m_thread.quit();
+    m_thread.wait();
+    delete m_worker;
+}
+
+void VncClientPrivate::vncLog(const char *format, ...)
+{
+    va_list args;
+	va_start(args, format);
+    QString message = QString::vasprintf(format, args);
+	va_end(args);
+
+    qDebug() << "VNC:" << message.trimmed();
+}
+
+void VncClientPrivate::vncError(const char *format, ...)
+{
+    va_list args;
+	va_start(args, format);
+    QString message = QString::vasprintf(format, args);
+	va_end(args);
+
+    qWarning() << "VNC:" << message.trimmed();
+}
+
+int VncClientPrivate::qtToRfb(Qt::MouseButtons buttons)
+{
+    int ret = 0;
+    if (buttons & Qt::LeftButton) ret |= rfbButton1Mask;
+    if (buttons & Qt::RightButton) ret |= rfbButton2Mask;
+    if (buttons & Qt::MiddleButton) ret |= rfbButton3Mask;
+    return ret;
+}
+
+#include "key_mapping.h"
+
+static const struct {
+    Qt::KeyboardModifier modifier;
+    int key;
+} modifierKeys[] = {
+    { Qt::ShiftModifier, Qt::Key_Shift },
+    { Qt::ControlModifier, Qt::Key_Control },
+    { Qt::AltModifier, Qt::Key_Alt },
+    { Qt::MetaModifier, Qt::Key_Meta },
+};
+
+uint32_t VncClientPrivate::qCharToVnc(uint ucs4)
+{
+    /* Printable Latin-1 keysyms have the same value as the character */
+    if ((ucs4 >= 0x20 && ucs4 < 0x7f) || (ucs4 >= 0xa0 && ucs4 < 0x100)) {
+        return ucs4;
+    }
+
+    switch (ucs4) {
+    case '\t': return XK_Tab;
+    case '\b': return XK_BackSpace;
+    case '\n':
+    case '\r':
+        return XK_Return;
+    case 0x7f: return XK_Delete;
+    }
+    /* No keysyms for the other C0 and C1 controls */
+    if (ucs4 < 0xa0) return 0;
+
+    if (ucs4 <= 0xffff) {
+        uint32_t code = findKey(unicodeToX11, uint16_t(ucs4));
+        if (code != 0) return code;
+    }
+    /* X11 has a keysym for every Unicode character */
+    return 0x01000000 | ucs4;
+}
+
+uint32_t VncClientPrivate::qKeyToVnc(int key)
+{
+    uint32_t code = 0;
+    if (key >= Qt::Key_Space && key <= Qt::Key_ydiaeresis) {
+        /* Letters are reported uppercase, with the shift state apart */
+        code = QChar(key).toLower().unicode();
+    } else if (key >= Qt::Key_F1 && key <= Qt::Key_F35) {
+        code = XK_F1 + key - Qt::Key_F1;
+    } else {
+        code = findKey(qtKeyToX11, key);
+        if (code == 0) {
+            qWarning() << "Unsupported key:" << key;
+        }
+    }
+    return code;
+}
+
+Qt::KeyboardModifier VncClientPrivate::qKeyToModifier(int key)
+{
+    for (const auto &m: modifierKeys) {
+        if (m.key == key) return m.modifier;
+    }
+    return Qt::NoModifier;
+}
+
+bool VncClientPrivate::connectToServer(const QString &host, const QString &password)
+{
+    /* The worker keeps trying on its own, so a new call is only needed for
+     * another server or different settings */
+    if (Q_UNLIKELY(host.isEmpty())) {
+        qWarning() << "No VNC server to connect to";
+        return false;
+    }
+    if (!m_displayBus.isEmpty()) {
+        m_display.attach(m_displayBus);
+    }
+
+    VncWorker *worker = m_worker;
+    const VncSettings settings = m_settings;
+    QMetaObject::invokeMethod(worker, [worker, host, password, settings]() {
+        worker->connectToServer(host, password, settings);
+    }, Qt::QueuedConnection);
+    return true;
+}
+
+bool VncClientPrivate::replay(const QString &fileName, bool realTime)
+{
+    /* Opening the recording and the handshake are quick, and the worker
+     * never waits for the GUI thread: wait for the outcome */
+    VncWorker *worker = m_worker;
+    const VncSettings settings = m_settings;
+    bool ok = false;
+    QMetaObject::invokeMethod(worker, [worker, fileName, realTime, settings, &ok]() {
+        ok = worker->replay(fileName, realTime, settings);
+    }, Qt::BlockingQueuedConnection);
+    return ok;
+}
+
+void VncClientPrivate::disconnect()
+{
+    m_display.detach();
+    onDisplayUpdated(QRect());
+
+    VncWorker *worker = m_worker;
+    QMetaObject::invokeMethod(worker, [worker]() {
+        worker->disconnect();
+    }, Qt::QueuedConnection);
+}
+
+void VncClientPrivate::onFrameReady()
+{
+    if (!m_frames.take()) return;
+
+    /* Keep taking the frames, but they're not shown */
+    if (m_sharedDisplay) return;
+
+    const QRegion &damage = m_frames.current().damage;
+    for (const QRect &rect: damage) {
+        updateViewers(rect);
+    }
+}
+
+void VncClientPrivate::onDisplayUpdated(const QRect &rect)
+{
+    Q_Q(VncClient);
+
+    const bool shared = m_display.isAttached() && !m_display.image().isNull();
+    if (shared != m_sharedDisplay) {
+        m_sharedDisplay = shared;
+
+        VncWorker *worker = m_worker;
+        QMetaObject::invokeMethod(worker, [worker, shared]() {
+            worker->setFramebufferUpdates(!shared);
+        }, Qt::QueuedConnection);
+
+        /* The source changed: repaint everything */
+        updateViewers(q->image().rect());
+        Q_EMIT q->sharedDisplayChanged();
+        return;
+    }
+
+    if (shared && !rect.isEmpty()) {
+        m_metrics.record(VncMetrics::DamageArea,
+                         qint64(rect.width()) * rect.height());
+        m_metrics.updateReceived();
+        updateViewers(rect);
+    }
+}
+
+void VncClientPrivate::onCursorShape(const QImage &image,
+                                     const QPoint &hotspot)
+{
+    /* A late shape may still arrive after the cursor was turned off */
+    m_cursorImage = m_settings.remoteCursor ? image : QImage();
+    m_cursorHotspot = hotspot;
+    for (VncOutput *viewer: m_viewers) {
+        viewer->updateCursor();
+    }
+}
+
+void VncClientPrivate::onCursorPos(const QPoint &pos)
+{
+    for (VncOutput *viewer: m_viewers) {
+        viewer->moveCursor(pos);
+    }
+}
+
+void VncClientPrivate::onCutText(const QString &text)
+{
+    Q_Q(VncClient);
+
+    if (text == m_clipboard) return;
+
+    m_clipboard = text;
+    if (m_clipboardSharing && qGuiApp) {
+        QGuiApplication::clipboard()->setText(text);
+    }
+    Q_EMIT q->clipboardChanged();
+}
+
+void VncClientPrivate::onReplayFinished()
+{
+    Q_Q(VncClient);
+    Q_EMIT q->replayFinished();
+}
+
+void VncClientPrivate::onSystemClipboardChanged()
+{
+    if (!m_clipboardSharing || !m_connected || !qGuiApp) return;
+
+    /* Changes we made ourselves come back here too */
+    const QString text = QGuiApplication::clipboard()->text();
+    if (text.isEmpty() || text == m_clipboard) return;
+
+    sendClipboard(text);
+}
+
+void VncClientPrivate::updateViewers(const QRect &rect)
+{
+    for (VncOutput *viewer: m_viewers) {
+        viewer->updateVncRect(rect);
+    }
+}
+
+void VncClientPrivate::applySettings()
+{
+    VncWorker *worker = m_worker;
+    const VncSettings settings = m_settings;
+    QMetaObject::invokeMethod(worker, [worker, settings]() {
+        worker->setSettings(settings);
+    }, Qt::QueuedConnection);
+}
+
+void VncClientPrivate::onConnectionStatus(bool connected)
+{
+    Q_Q(VncClient);
+
+    if (connected == m_connected) return;
+
+    m_connected = connected;
+    /* A new session starts with no keys held */
+    m_modifiers = Qt::NoModifier;
+    if (!connected && !m_cursorImage.isNull()) {
+        onCursorShape(QImage(), QPoint());
+    }
+    Q_EMIT q->connectionStatusChanged();
+
+    /* Whatever was copied meanwhile is available in the guest right away */
+    if (connected) {
+        m_clipboard.clear();
+        onSystemClipboardChanged();
+        /* The guest may have been started, or reset, at another size */
+        m_resizeTimer.start();
+    }
+}
+
+void VncClientPrivate::sendText(const QString &text)
+{
+    QVector<KeyStroke> strokes;
+    const QVector<uint> characters = text.toUcs4();
+    strokes.reserve(characters.count() * 2);
+    for (uint c: characters) {
+        uint32_t code = qCharToVnc(c);
+        if (code == 0) continue;
+        strokes.append(KeyStroke { code, true });
+        strokes.append(KeyStroke { code, false });
+    }
+    sendKeyStrokes(strokes);
+}
+
+void VncClientPrivate::sendKeyEvent(QKeyEvent *keyEvent, bool pressed)
+{
+    QVector<KeyStroke> strokes;
+    const int key = keyEvent->key();
+    const Qt::KeyboardModifier modifier = qKeyToModifier(key);
+    if (modifier != Qt::NoModifier) {
+        /* The modifier key itself: just keep track of it */
+        if (pressed) {
+            m_modifiers |= modifier;
+        } else {
+            m_modifiers &= ~modifier;
+        }
+    } else {
+        /* The on-screen keyboard doesn't send the modifier keys, only
+         * their state along with the other keys */
+        syncModifiers(keyEvent->modifiers(), strokes);
+    }
+
+    uint32_t code = qKeyToVnc(key);
+    if (code != 0) {
+        strokes.append(KeyStroke { code, pressed });
+    }
+    sendKeyStrokes(strokes);
+}
+
+void VncClientPrivate::syncModifiers(Qt::KeyboardModifiers modifiers,
+                                     QVector<KeyStroke> &strokes)
+{
+    for (const auto &m: modifierKeys) {
+        const bool pressed = modifiers.testFlag(m.modifier);
+        if (pressed == m_modifiers.testFlag(m.modifier)) continue;
+
+        strokes.append(KeyStroke { qKeyToVnc(m.key), pressed });
+        if (pressed) {
+            m_modifiers |= m.modifier;
+        } else {
+            m_modifiers &= ~m.modifier;
+        }
+    }
+}
+
+void VncClientPrivate::sendKeyStrokes(const QVector<KeyStroke> &strokes)
+{
+    if (strokes.isEmpty()) return;
+
+    m_metrics.inputSent();
+
+    /* Queued to the worker thread: this never blocks on the socket */
+    VncWorker *worker = m_worker;
+    QMetaObject::invokeMethod(worker, [worker, strokes]() {
+        worker->sendKeyEvents(strokes);
+    }, Qt::QueuedConnection);
+}
+
+void VncClientPrivate::sendClipboard(const QString &text)
+{
+    Q_Q(VncClient);
+
+    if (text != m_clipboard) {
+        m_clipboard = text;
+        Q_EMIT q->clipboardChanged();
+    }
+
+    /* A single message, however large the text */
+    VncWorker *worker = m_worker;
+    QMetaObject::invokeMethod(worker, [worker, text]() {
+        worker->sendCutText(text);
+    }, Qt::QueuedConnection);
+}
+
+void VncClientPrivate::requestDesktopSize(const QSize &size)
+{
+    if (size == m_desktopSize) return;
+
+    m_desktopSize = size;
+    m_resizeTimer.start();
+}
+
+void VncClientPrivate::applyDesktopSize()
+{
+    if (!m_connected || m_desktopSize.isEmpty()) return;
+
+    /* QEMU turns both into a virtio-gpu display change for the guest */
+    if (m_display.isAttached()) {
+        m_display.setUiInfo(m_desktopSize);
+        return;
+    }
+
+    VncWorker *worker = m_worker;
+    const QSize size = m_desktopSize;
+    QMetaObject::invokeMethod(worker, [worker, size]() {
+        worker->setDesktopSize(size);
+    }, Qt::QueuedConnection);
+}
+
+void VncClientPrivate::sendMouseEvent(const QPointF &pos,
+                                      Qt::MouseButtons buttons)
+{
+    VncWorker *worker = m_worker;
+    const int x = pos.x();
+    const int y = pos.y();
+    const int buttonMask = qtToRfb(buttons);
+    m_metrics.inputSent();
+    QMetaObject::invokeMethod(worker, [worker, x, y, buttonMask]() {
+        worker->sendMouseEvent(x, y, buttonMask);
+    }, Qt::QueuedConnection);
+}
+
+VncClient::VncClient(QObject *parent):
+    QObject(parent),
+    d_ptr(new VncClientPrivate(this))
+{
+}
+
+VncClient::~VncClient() = default;
+
+bool VncClient::isConnected() const
+{
+    Q_D(const VncClient);
+    return d->m_connected;
+}
+
+void VncClient::setDisplayBus(const QString &address)
+{
+    Q_D(VncClient);
+    if (address == d->m_displayBus) return;
+
+    d->m_displayBus = address;
+    if (address.isEmpty()) {
+        d->m_display.detach();
+        d->onDisplayUpdated(QRect());
+    }
+    Q_EMIT displayBusChanged();
+}
+
+QString VncClient::displayBus() const
+{
+    Q_D(const VncClient);
+    return d->m_displayBus;
+}
+
+bool VncClient::usesSharedDisplay() const
+{
+    Q_D(const VncClient);
+    return d->m_sharedDisplay;
+}
+
+void VncClient::setEncodings(const QString &encodings)
+{
+    Q_D(VncClient);
+    const QByteArray latin1 = encodings.simplified().toLatin1();
+    if (latin1 == d->m_settings.encodings) return;
+
+    d->m_settings.encodings = latin1;
+    d->applySettings();
+    Q_EMIT encodingsChanged();
+}
+
+QString VncClient::encodings() const
+{
+    Q_D(const VncClient);
+    return QString::fromLatin1(d->m_settings.encodings);
+}
+
+void VncClient::setCompressLevel(int level)
+{
+    Q_D(VncClient);
+    if (level == d->m_settings.compressLevel) return;
+
+    d->m_settings.compressLevel = level;
+    d->applySettings();
+    Q_EMIT compressLevelChanged();
+}
+
+int VncClient::compressLevel() const
+{
+    Q_D(const VncClient);
+    return d->m_settings.compressLevel;
+}
+
+void VncClient::setQualityLevel(int level)
+{
+    Q_D(VncClient);
+    if (level == d->m_settings.qualityLevel) return;
+
+    d->m_settings.qualityLevel = level;
+    d->applySettings();
+    Q_EMIT qualityLevelChanged();
+}
+
+int VncClient::qualityLevel() const
+{
+    Q_D(const VncClient);
+    return d->m_settings.qualityLevel;
+}
+
+void VncClient::setLowColorDepth(bool enabled)
+{
+    Q_D(VncClient);
+    if (enabled == d->m_settings.lowColorDepth) return;
+
+    d->m_settings.lowColorDepth = enabled;
+    d->applySettings();
+    Q_EMIT lowColorDepthChanged();
+}
+
+bool VncClient::lowColorDepth() const
+{
+    Q_D(const VncClient);
+    return d->m_settings.lowColorDepth;
+}
+
+void VncClient::setRemoteCursor(bool enabled)
+{
+    Q_D(VncClient);
+    if (enabled == d->m_settings.remoteCursor) return;
+
+    d->m_settings.remoteCursor = enabled;
+    d->applySettings();
+    if (!enabled) {
+        /* The server draws it into the framebuffer again */
+        d->onCursorShape(QImage(), QPoint());
+    }
+    Q_EMIT remoteCursorChanged();
+}
+
+bool VncClient::remoteCursor() const
+{
+    Q_D(const VncClient);
+    return d->m_settings.remoteCursor;
+}
+
+void VncClient::setClipboardSharing(bool enabled)
+{
+    Q_D(VncClient);
+    if (enabled == d->m_clipboardSharing) return;
+
+    d->m_clipboardSharing = enabled;
+    if (enabled) {
+        d->onSystemClipboardChanged();
+    }
+    Q_EMIT clipboardSharingChanged();
+}
+
+bool VncClient::clipboardSharing() const
+{
+    Q_D(const VncClient);
+    return d->m_clipboardSharing;
+}
+
+QString VncClient::clipboard() const
+{
+    Q_D(const VncClient);
+    return d->m_clipboard;
+}
+
+void VncClient::setRecordFile(const QString &fileName)
+{
+    Q_D(VncClient);
+    if (fileName == d->m_settings.recordFile) return;
+
+    d->m_settings.recordFile = fileName;
+    d->applySettings();
+    Q_EMIT recordFileChanged();
+}
+
+QString VncClient::recordFile() const
+{
+    Q_D(const VncClient);
+    return d->m_settings.recordFile;
+}
+
+void VncClient::sendClipboard(const QString &text)
+{
+    Q_D(VncClient);
+    return d->sendClipboard(text);
+}
+
+void VncClient::requestDesktopSize(const QSize &size)
+{
+    Q_D(VncClient);
+    return d->requestDesktopSize(size);
+}
+
+const QImage &VncClient::cursorImage() const
+{
+    Q_D(const VncClient);
+    return d->m_cursorImage;
+}
+
+QPoint VncClient::cursorHotspot() const
+{
+    Q_D(const VncClient);
+    return d->m_cursorHotspot;
+}
+
+void VncClient::addViewer(VncOutput *viewer)
 {
     Q_D(VncClient);
     d->m_viewers.append(viewer);
 }
 
-void VncClient::removeViewer(QQuickItem *viewer)
+void VncClient::removeViewer(VncOutput *viewer)
 {
     Q_D(VncClient);
     d->m_viewers.removeAll(viewer);
@@ -413,7 +1623,16 @@ void VncClient::removeViewer(QQuickItem *viewer)
 const QImage &VncClient::image() const
 {
     Q_D(const VncClient);
-    return d->m_image;
+    if (d->m_sharedDisplay) {
+        return d->m_display.image();
+    }
+    return d->m_frames.current().image;
+}
+
+VncMetrics *VncClient::metrics()
+{
+    Q_D(VncClient);
+    return &d->m_metrics;
 }
 
 bool VncClient::connectToServer(const QString &host, const QString &password)
@@ -422,6 +1641,12 @@ bool VncClient::connectToServer(const QString &host, const QString &password)
     return d->connectToServer(host, password);
 }
 
+bool VncClient::replay(const QString &fileName, bool realTime)
+{
+    Q_D(VncClient);
+    return d->replay(fileName, realTime);
+}
+
 void VncClient::disconnect()
 {
     Q_D(VncClient);
@@ -431,7 +1656,13 @@ void VncClient::disconnect()
 void VncClient::sendKeyEvent(QChar c)
 {
     Q_D(VncClient);
-    return d->sendKeyEvent(c);
+    return d->sendText(QString(c));
+}
+
+void VncClient::sendText(const QString &text)
+{
+    Q_D(VncClient);
+    return d->sendText(text);
 }
 
 void VncClient::sendKeyEvent(QKeyEvent *keyEvent, bool pressed)
@@ -21,20 +21,59 @@
 #define LOMIRIVNC_VNC_CLIENT_H
 
 #include <QObject>
+#include <QPoint>
 #include <QScopedPointer>
 
 class QImage;
 class QKeyEvent;
 class QPointF;
-class QQuickItem;
+class QSize;
 
 namespace LomiriVNC {
 
+class VncMetrics;
+class VncOutput;
 class VncClientPrivate;
 class VncClient: public QObject
 {
     Q_OBJECT
     Q_PROPERTY(bool connected READ isConnected NOTIFY connectionStatusChanged)
+    /* Address of the VM's private bus for QEMU's D-Bus display; when set, the
+     * framebuffer is taken from a shared memory scanout and VNC is only
+     * used for input, or as a fallback. */
+    Q_PROPERTY(QString displayBus READ displayBus WRITE setDisplayBus
+               NOTIFY displayBusChanged)
+    Q_PROPERTY(bool sharedDisplay READ usesSharedDisplay
+               NOTIFY sharedDisplayChanged)
+    /* Space separated libvncclient encoding names, in order of preference;
+     * when empty, "copyrect raw" is used on local sockets and the library
+     * defaults elsewhere. */
+    Q_PROPERTY(QString encodings READ encodings WRITE setEncodings
+               NOTIFY encodingsChanged)
+    // zlib compression, 0-9
+    Q_PROPERTY(int compressLevel READ compressLevel WRITE setCompressLevel
+               NOTIFY compressLevelChanged)
+    // JPEG quality for the Tight encoding, 0-9; -1 disables JPEG
+    Q_PROPERTY(int qualityLevel READ qualityLevel WRITE setQualityLevel
+               NOTIFY qualityLevelChanged)
+    // Request a 16bpp (RGB565) framebuffer
+    Q_PROPERTY(bool lowColorDepth READ lowColorDepth WRITE setLowColorDepth
+               NOTIFY lowColorDepthChanged)
+    /* Let the server send the cursor shape instead of drawing it into the
+     * framebuffer; it's then drawn by the viewers */
+    Q_PROPERTY(bool remoteCursor READ remoteCursor WRITE setRemoteCursor
+               NOTIFY remoteCursorChanged)
+    /* Keep the system clipboard and the server's in sync; the guest needs
+     * a clipboard agent for QEMU to take part */
+    Q_PROPERTY(bool clipboardSharing READ clipboardSharing
+               WRITE setClipboardSharing NOTIFY clipboardSharingChanged)
+    // The last clipboard text exchanged with the server
+    Q_PROPERTY(QString clipboard READ clipboard NOTIFY clipboardChanged)
+    /* Records what the server sends to this file, from the next connection
+     * on; only for servers on local sockets. Empty to not record. After a
+     * reconnection the session goes on in "name.2.suffix", and so on. */
+    Q_PROPERTY(QString recordFile READ recordFile WRITE setRecordFile
+               NOTIFY recordFileChanged)
 
 public:
     VncClient(QObject *parent = nullptr);
@@ -42,20 +81,76 @@ public:
 
     bool isConnected() const;
 
-    void addViewer(QQuickItem *viewer);
-    void removeViewer(QQuickItem *viewer);
+    void setDisplayBus(const QString &address);
+    QString displayBus() const;
+    bool usesSharedDisplay() const;
+
+    void setEncodings(const QString &encodings);
+    QString encodings() const;
+    void setCompressLevel(int level);
+    int compressLevel() const;
+    void setQualityLevel(int level);
+    int qualityLevel() const;
+    void setLowColorDepth(bool enabled);
+    bool lowColorDepth() const;
+    void setRemoteCursor(bool enabled);
+    bool remoteCursor() const;
+    void setClipboardSharing(bool enabled);
+    bool clipboardSharing() const;
+    QString clipboard() const;
+    void setRecordFile(const QString &fileName);
+    QString recordFile() const;
+
+    void addViewer(VncOutput *viewer);
+    void removeViewer(VncOutput *viewer);
+    /* The latest frame received from the decoding thread; only valid in
+     * the GUI thread, or in the render thread while the GUI one is
+     * blocked. */
     const QImage &image() const;
+    /* The cursor shape sent by the server, if any; null when the cursor is
+     * hidden or drawn in the framebuffer. */
+    const QImage &cursorImage() const;
+    QPoint cursorHotspot() const;
+
+    /* Performance samples, recorded while a VncStatistics is attached */
+    VncMetrics *metrics();
 
+    /* Waits for a unix socket to appear, if needed, and keeps reconnecting
+     * with a backoff whenever the connection fails, is lost, or the server
+     * stops answering, until disconnect() is called. False without a host. */
     Q_INVOKABLE bool connectToServer(const QString &host, const QString &password);
+    /* Plays a recording instead of connecting to a server, at the pace it
+     * was recorded or as fast as it can be decoded. Input is ignored, and
+     * the client disconnects when it's over. False if the recording can't
+     * be read or served. */
+    Q_INVOKABLE bool replay(const QString &fileName, bool realTime = true);
     Q_INVOKABLE void disconnect();
 
     void sendKeyEvent(QChar c);
     void sendKeyEvent(QKeyEvent *keyEvent, bool pressed);
+    /* Types the text, with all the key events sent in one write */
+    Q_INVOKABLE void sendText(const QString &text);
+    /* Sets the server's clipboard, in a single message */
+    Q_INVOKABLE void sendClipboard(const QString &text);
+    /* Asks the guest to change its screen size, once the requests stopped
+     * coming for a moment; an empty size cancels a pending request. */
+    Q_INVOKABLE void requestDesktopSize(const QSize &size);
     Q_INVOKABLE void sendMouseEvent(const QPointF &pos,
                                     Qt::MouseButtons buttons);
 
 Q_SIGNALS:
     void connectionStatusChanged();
+    void displayBusChanged();
+    void sharedDisplayChanged();
+    void encodingsChanged();
+    void compressLevelChanged();
+    void qualityLevelChanged();
+    void lowColorDepthChanged();
+    void remoteCursorChanged();
+    void clipboardSharingChanged();
+    void clipboardChanged();
+    void recordFileChanged();
+    void replayFinished();
 
 private:
     Q_DECLARE_PRIVATE(VncClient)
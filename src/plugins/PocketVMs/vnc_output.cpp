@@ -19,20 +19,67 @@
 
 #include "vnc_output.h"
 
+#include "image_scaler.h"
 #include "scaler.h"
 #include "vnc_client.h"
+#include "vnc_statistics.h"
+#include "vnc_texture.h"
 
-#include <QDebug>
+#include <QElapsedTimer>
 #include <QImage>
 #include <QMouseEvent>
-#include <QPainter>
+#include <QOpenGLContext>
 #include <QPointF>
+#include <QQuickWindow>
+#include <QRegion>
+#include <QSGSimpleRectNode>
+#include <QSGSimpleTextureNode>
+#include <QTimer>
 #include <QTransform>
 
 using namespace LomiriVNC;
 
 namespace LomiriVNC {
 
+/* Black background, with the remote screen as a child texture node. The
+ * scaling computed by the Scaler is applied by the GPU, by mapping the
+ * visible part of the texture onto the painted rect; without OpenGL, the
+ * damaged part of the visible area is scaled on the CPU instead. The remote
+ * cursor, if any, is another texture node on top, so moving it repaints
+ * nothing. */
+class VncNode: public QSGSimpleRectNode
+{
+public:
+    VncNode();
+    ~VncNode();
+
+    void updateImage(QQuickWindow *window,
+                     const QImage &image, const QRegion &dirty);
+    void updateMapping(const QRectF &paintedRect, const QRectF &sourceRect,
+                       bool smooth);
+    /* Software backend: keeps the visible part of the image scaled to the
+     * painted rect, redoing only the `dirty` part (in VNC coordinates) as
+     * long as the mapping doesn't change. */
+    void updateScaledImage(QQuickWindow *window, const QImage &image,
+                           const QRegion &dirty, const QRectF &paintedRect,
+                           const QRectF &sourceRect, bool smooth);
+    void updateCursorImage(QQuickWindow *window, const QImage &image);
+    void updateCursorRect(const QRectF &rect);
+
+private:
+    void setTexture(QSGTexture *texture);
+
+    QSGSimpleTextureNode *m_textureNode;
+    QSGSimpleTextureNode *m_cursorNode;
+    /* Only used with OpenGL; the software backend always gets a new
+     * texture from the image. */
+    VncTexture *m_texture;
+    QSGTexture *m_imageTexture;
+    QImage m_scaledImage;
+    QRectF m_scaledSource;
+    bool m_scaledSmooth;
+};
+
 class VncOutputPrivate {
     Q_DECLARE_PUBLIC(VncOutput)
 
@@ -43,31 +90,215 @@ public:
     void setScale(qreal scale);
     void setCenter(const QPointF &center);
     void updateMapping();
+    void addDamage(const QRect &vncRect);
+    void setCursorPos(const QPointF &vncPos);
 
     void sendKeyEvent(const QString &text);
     void sendMouseEvent(const QPointF &pos, Qt::MouseButtons buttons);
+    void flushPointerEvent();
+    void onWindowChanged(QQuickWindow *window);
+    void requestDesktopSize();
 
 private:
+    void sendPointerEvent(const QPointF &vncPos, Qt::MouseButtons buttons);
+
     VncClient *m_client;
     QSize m_vncSize;
     QRect m_vncVisibleRect;
     QRectF m_paintedRect;
     QTransform m_itemToVnc;
     QTransform m_vncToItem;
+    /* Damaged area, in VNC coordinates, accumulated until the next frame */
+    QRegion m_damage;
+    bool m_fullUpload;
     qreal m_requestedScale;
     qreal m_scale;
     QPointF m_center;
+    /* Cursor shape, and its position in VNC coordinates */
+    QImage m_cursorImage;
+    QPoint m_cursorHotspot;
+    QPointF m_cursorPos;
+    bool m_cursorVisible;
+    bool m_cursorDirty;
+    /* Latest motion not sent yet, in VNC coordinates */
+    QPointF m_pointerPos;
+    bool m_pointerPending;
+    Qt::MouseButtons m_pointerButtons;
+    int m_pointerRate;
+    QTimer m_pointerTimer;
+    QMetaObject::Connection m_frameConnection;
+    qint64 m_sentPointerEvents;
+    qint64 m_droppedPointerEvents;
+    bool m_autoResize;
     VncOutput *q_ptr;
 };
 
 } // namespace
 
+VncNode::VncNode():
+    QSGSimpleRectNode(QRectF(), Qt::black),
+    m_textureNode(nullptr),
+    m_cursorNode(nullptr),
+    m_texture(nullptr),
+    m_imageTexture(nullptr),
+    m_scaledSmooth(false)
+{
+}
+
+VncNode::~VncNode()
+{
+    delete m_texture;
+    delete m_imageTexture;
+}
+
+void VncNode::updateImage(QQuickWindow *window,
+                          const QImage &image, const QRegion &dirty)
+{
+    QSGTexture *texture;
+    if (QOpenGLContext::currentContext()) {
+        if (!m_texture) {
+            m_texture = new VncTexture;
+        }
+        m_texture->upload(image, dirty);
+        texture = m_texture;
+    } else {
+        texture = window->createTextureFromImage(image);
+    }
+    setTexture(texture);
+}
+
+void VncNode::setTexture(QSGTexture *texture)
+{
+    /* The texture node is only added once there is something to show,
+     * always below the cursor */
+    if (!m_textureNode) {
+        m_textureNode = new QSGSimpleTextureNode;
+        m_textureNode->setOwnsTexture(false);
+        m_textureNode->setTexture(texture);
+        prependChildNode(m_textureNode);
+    } else {
+        m_textureNode->setTexture(texture);
+    }
+    m_textureNode->markDirty(QSGNode::DirtyMaterial);
+
+    if (texture != m_texture) {
+        delete m_imageTexture;
+        m_imageTexture = texture;
+    }
+}
+
+void VncNode::updateMapping(const QRectF &paintedRect,
+                            const QRectF &sourceRect, bool smooth)
+{
+    if (!m_textureNode) return;
+
+    m_textureNode->setRect(paintedRect);
+    m_textureNode->setSourceRect(sourceRect);
+    m_textureNode->setFiltering(smooth ? QSGTexture::Linear :
+                                QSGTexture::Nearest);
+}
+
+void VncNode::updateScaledImage(QQuickWindow *window, const QImage &image,
+                                const QRegion &dirty, const QRectF &paintedRect,
+                                const QRectF &sourceRect, bool smooth)
+{
+    const QSize size =
+        (paintedRect.size() * window->effectiveDevicePixelRatio()).toSize();
+    const QImage::Format format = ImageScaler::targetFormat(image.format());
+    if (Q_UNLIKELY(size.isEmpty() || format == QImage::Format_Invalid)) {
+        /* Left to QPainter */
+        m_scaledImage = QImage();
+        if (!dirty.isEmpty()) {
+            updateImage(window, image, QRegion());
+        }
+        updateMapping(paintedRect, sourceRect, smooth);
+        return;
+    }
+
+    QRegion area;
+    if (size != m_scaledImage.size() || format != m_scaledImage.format() ||
+        sourceRect != m_scaledSource || smooth != m_scaledSmooth ||
+        !m_textureNode) {
+        if (size != m_scaledImage.size() || format != m_scaledImage.format()) {
+            m_scaledImage = QImage(size, format);
+        }
+        m_scaledSource = sourceRect;
+        m_scaledSmooth = smooth;
+        area = m_scaledImage.rect();
+    } else {
+        const qreal xScale = size.width() / sourceRect.width();
+        const qreal yScale = size.height() / sourceRect.height();
+        for (const QRect &rect: dirty) {
+            /* Filtering reaches one more source pixel around the rect */
+            const QRectF r = QRectF(rect.adjusted(-1, -1, 1, 1))
+                .translated(-sourceRect.topLeft());
+            area += QRectF(r.x() * xScale, r.y() * yScale,
+                           r.width() * xScale, r.height() * yScale)
+                .toAlignedRect().intersected(m_scaledImage.rect());
+        }
+    }
+    if (!area.isEmpty()) {
+        for (const QRect &rect: area) {
+            ImageScaler::scale(image, sourceRect, &m_scaledImage, rect, smooth);
+        }
+        setTexture(window->createTextureFromImage(m_scaledImage));
+    }
+
+    /* Already at the device pixel size */
+    m_textureNode->setRect(paintedRect);
+    m_textureNode->setSourceRect(QRectF(m_scaledImage.rect()));
+    m_textureNode->setFiltering(QSGTexture::Nearest);
+}
+
+void VncNode::updateCursorImage(QQuickWindow *window, const QImage &image)
+{
+    if (image.isNull()) {
+        if (m_cursorNode) {
+            removeChildNode(m_cursorNode);
+            delete m_cursorNode;
+            m_cursorNode = nullptr;
+        }
+        return;
+    }
+
+    /* Small enough to be uploaded anew at each shape change */
+    QSGTexture *texture = window->createTextureFromImage(image);
+    if (!m_cursorNode) {
+        m_cursorNode = new QSGSimpleTextureNode;
+        m_cursorNode->setOwnsTexture(true);
+        appendChildNode(m_cursorNode);
+    }
+    m_cursorNode->setTexture(texture);
+}
+
+void VncNode::updateCursorRect(const QRectF &rect)
+{
+    if (!m_cursorNode) return;
+
+    m_cursorNode->setRect(rect);
+}
+
 VncOutputPrivate::VncOutputPrivate(VncOutput *q):
     m_client(nullptr),
+    m_fullUpload(true),
     m_requestedScale(0.0),
     m_scale(0.0),
+    m_cursorVisible(false),
+    m_cursorDirty(false),
+    m_pointerPending(false),
+    m_pointerButtons(Qt::NoButton),
+    m_pointerRate(0),
+    m_sentPointerEvents(0),
+    m_droppedPointerEvents(0),
+    m_autoResize(false),
     q_ptr(q)
 {
+    m_pointerTimer.setSingleShot(true);
+    QObject::connect(&m_pointerTimer, &QTimer::timeout, q, [this]() {
+        if (!m_pointerPending) return;
+        flushPointerEvent();
+        m_pointerTimer.start();
+    });
 }
 
 VncOutputPrivate::~VncOutputPrivate() = default;
@@ -127,36 +358,144 @@ void VncOutputPrivate::updateMapping()
     }
 }
 
+void VncOutputPrivate::addDamage(const QRect &vncRect)
+{
+    Q_Q(VncOutput);
+
+    if (Q_UNLIKELY(!m_client)) return;
+
+    if (m_client->image().size() != m_vncSize) {
+        /* The remote screen was resized: the texture must be recreated */
+        updateMapping();
+        m_damage = QRegion();
+        m_fullUpload = true;
+        q->update();
+        return;
+    }
+
+    /* Updates arriving before the next frame are coalesced into the
+     * region, and uploaded at once in updatePaintNode() */
+    m_damage += vncRect.intersected(QRect(QPoint(0, 0), m_vncSize));
+    q->update();
+}
+
+void VncOutputPrivate::setCursorPos(const QPointF &vncPos)
+{
+    Q_Q(VncOutput);
+
+    m_cursorPos = vncPos;
+    m_cursorVisible = true;
+    if (!m_cursorImage.isNull()) {
+        q->update();
+    }
+}
+
 void VncOutputPrivate::sendKeyEvent(const QString &text)
 {
-    for (const QChar c: text) {
-        m_client->sendKeyEvent(c);
+    if (m_client && !text.isEmpty()) {
+        m_client->sendText(text);
     }
 }
 
 void VncOutputPrivate::sendMouseEvent(const QPointF &pos,
                                       Qt::MouseButtons buttons)
 {
+    Q_Q(VncOutput);
+
     if (Q_UNLIKELY(!m_client ||
                    !m_paintedRect.contains(pos.toPoint()))) return;
 
-    m_client->sendMouseEvent(m_itemToVnc.map(pos), buttons);
+    /* A pending motion is superseded by any newer event */
+    if (m_pointerPending) {
+        m_droppedPointerEvents++;
+        m_pointerPending = false;
+    }
+
+    const QPointF vncPos = m_itemToVnc.map(pos);
+    /* The cursor follows the local pointer right away */
+    setCursorPos(vncPos);
+    if (buttons != m_pointerButtons) {
+        sendPointerEvent(vncPos, buttons);
+        return;
+    }
+
+    m_pointerPos = vncPos;
+    m_pointerPending = true;
+    if (m_pointerRate > 0) {
+        if (!m_pointerTimer.isActive()) {
+            flushPointerEvent();
+            m_pointerTimer.start(1000 / m_pointerRate);
+        }
+    } else if (q->window()) {
+        /* Sent in afterAnimating, once per frame */
+        q->window()->update();
+    } else {
+        flushPointerEvent();
+    }
+}
+
+void VncOutputPrivate::flushPointerEvent()
+{
+    if (!m_pointerPending) return;
+
+    m_pointerPending = false;
+    sendPointerEvent(m_pointerPos, m_pointerButtons);
+}
+
+void VncOutputPrivate::requestDesktopSize()
+{
+    Q_Q(VncOutput);
+
+    if (!m_autoResize || !m_client) return;
+
+    const qreal ratio = q->window() ? q->window()->effectiveDevicePixelRatio() : 1.0;
+    m_client->requestDesktopSize((q->size() * ratio).toSize());
+}
+
+void VncOutputPrivate::sendPointerEvent(const QPointF &vncPos,
+                                        Qt::MouseButtons buttons)
+{
+    Q_Q(VncOutput);
+
+    m_pointerButtons = buttons;
+    if (m_client) {
+        m_client->sendMouseEvent(vncPos, buttons);
+    }
+    m_sentPointerEvents++;
+    Q_EMIT q->pointerStatisticsChanged();
+}
+
+void VncOutputPrivate::onWindowChanged(QQuickWindow *window)
+{
+    Q_Q(VncOutput);
+
+    QObject::disconnect(m_frameConnection);
+    if (!window) return;
+
+    /* The device pixel ratio may have changed */
+    requestDesktopSize();
+
+    /* Emitted in the GUI thread at the start of each frame */
+    m_frameConnection =
+        QObject::connect(window, &QQuickWindow::afterAnimating, q, [this]() {
+            if (m_pointerRate <= 0) flushPointerEvent();
+        });
 }
 
 VncOutput::VncOutput(QQuickItem *parent):
-    QQuickPaintedItem(parent),
+    QQuickItem(parent),
     d_ptr(new VncOutputPrivate(this))
 {
-    setFillColor(QColor(Qt::black));
-    setOpaquePainting(true);
-    setAntialiasing(true);
+    setFlag(QQuickItem::ItemHasContents, true);
     setAcceptedMouseButtons(Qt::AllButtons);
     setAcceptHoverEvents(true);
     setFlag(QQuickItem::ItemAcceptsInputMethod, true);
-    /* For some reason if FBO rendering is enabled, only the first
-     * frame is drawn, unless the image is a different one
-     */
-    //setRenderTarget(QQuickPaintedItem::FramebufferObject);
+
+    QObject::connect(this, &QQuickItem::windowChanged,
+                     this, [this](QQuickWindow *window) {
+        Q_D(VncOutput);
+        d->onWindowChanged(window);
+    });
 }
 
 VncOutput::~VncOutput() = default;
@@ -172,7 +511,15 @@ void VncOutput::setClient(VncClient *client)
         d->m_client->removeViewer(this);
     }
     d->m_client = client;
+    d->m_pointerPending = false;
+    d->m_cursorImage = client ? client->cursorImage() : QImage();
+    d->m_cursorHotspot = client ? client->cursorHotspot() : QPoint();
+    d->m_cursorDirty = true;
     d->updateMapping();
+    d->requestDesktopSize();
+    d->m_damage = QRegion();
+    d->m_fullUpload = true;
+    update();
     Q_EMIT clientChanged();
 }
 
@@ -246,6 +593,64 @@ qreal VncOutput::topMargin() const
     return d->m_paintedRect.y();
 }
 
+void VncOutput::setPointerRate(int rate)
+{
+    Q_D(VncOutput);
+    rate = qMax(rate, 0);
+    if (rate == d->m_pointerRate) return;
+
+    d->m_pointerRate = rate;
+    d->m_pointerTimer.stop();
+    d->flushPointerEvent();
+    Q_EMIT pointerRateChanged();
+}
+
+int VncOutput::pointerRate() const
+{
+    Q_D(const VncOutput);
+    return d->m_pointerRate;
+}
+
+void VncOutput::setAutoResize(bool enabled)
+{
+    Q_D(VncOutput);
+    if (enabled == d->m_autoResize) return;
+
+    d->m_autoResize = enabled;
+    if (enabled) {
+        d->requestDesktopSize();
+    } else if (d->m_client) {
+        d->m_client->requestDesktopSize(QSize());
+    }
+    Q_EMIT autoResizeChanged();
+}
+
+bool VncOutput::autoResize() const
+{
+    Q_D(const VncOutput);
+    return d->m_autoResize;
+}
+
+qint64 VncOutput::sentPointerEvents() const
+{
+    Q_D(const VncOutput);
+    return d->m_sentPointerEvents;
+}
+
+qint64 VncOutput::droppedPointerEvents() const
+{
+    Q_D(const VncOutput);
+    return d->m_droppedPointerEvents;
+}
+
+void VncOutput::resetPointerStatistics()
+{
+    Q_D(VncOutput);
+    d->m_sentPointerEvents = 0;
+    d->m_droppedPointerEvents = 0;
+    Q_EMIT pointerStatisticsChanged();
+}
+
 QPointF VncOutput::itemToVnc(const QPointF &p) const
 {
     Q_D(const VncOutput);
@@ -258,45 +663,122 @@ QPointF VncOutput::vncToItem(const QPointF &p) const
     return d->m_vncToItem.map(p);
 }
 
-void VncOutput::paint(QPainter *painter)
+void VncOutput::updateVncRect(const QRect &rect)
+{
+    Q_D(VncOutput);
+    d->addDamage(rect);
+}
+
+void VncOutput::updateCursor()
+{
+    Q_D(VncOutput);
+    if (Q_UNLIKELY(!d->m_client)) return;
+
+    d->m_cursorImage = d->m_client->cursorImage();
+    d->m_cursorHotspot = d->m_client->cursorHotspot();
+    d->m_cursorDirty = true;
+    update();
+}
+
+void VncOutput::moveCursor(const QPoint &pos)
+{
+    Q_D(VncOutput);
+    d->setCursorPos(pos);
+}
+
+QSGNode *VncOutput::updatePaintNode(QSGNode *oldNode,
+                                    UpdatePaintNodeData *data)
 {
     Q_D(VncOutput);
+    Q_UNUSED(data);
 
-    const QImage &image = d->m_client->image();
-    if (image.size() != d->m_vncSize) {
-        d->updateMapping();
-        Q_EMIT remoteScreenSizeChanged();
-        Q_EMIT marginsChanged();
+    VncNode *node = static_cast<VncNode*>(oldNode);
+    if (!node) {
+        node = new VncNode;
     }
-    painter->drawImage(d->m_paintedRect, image, d->m_vncVisibleRect);
+    node->setRect(boundingRect());
+
+    const QImage *image = d->m_client ? &d->m_client->image() : nullptr;
+    if (Q_UNLIKELY(!image || image->isNull() || d->m_paintedRect.isEmpty())) {
+        node->updateMapping(QRectF(), QRectF(), false);
+        node->updateCursorRect(QRectF());
+        return node;
+    }
+
+    if (Q_UNLIKELY(image->size() != d->m_vncSize)) {
+        /* Already handled by updateVncRect() on the next update; wait. */
+        return node;
+    }
+
+    const QRectF sourceRect = d->m_itemToVnc.mapRect(d->m_paintedRect);
+    const bool filtered = smooth() && d->m_scale != 1.0;
+    const bool changed = d->m_fullUpload || !d->m_damage.isEmpty();
+    VncMetrics *metrics = d->m_client->metrics();
+    QElapsedTimer timer;
+    if (changed && metrics->isEnabled()) timer.start();
+
+    if (QOpenGLContext::currentContext()) {
+        if (changed) {
+            node->updateImage(window(), *image,
+                              d->m_fullUpload ? QRegion() : d->m_damage);
+        }
+        node->updateMapping(d->m_paintedRect, sourceRect, filtered);
+    } else {
+        /* Also called when only the mapping changed */
+        node->updateScaledImage(window(), *image,
+                                d->m_fullUpload ? QRegion(image->rect()) : d->m_damage,
+                                d->m_paintedRect, sourceRect, filtered);
+    }
+    d->m_damage = QRegion();
+    d->m_fullUpload = false;
+
+    if (timer.isValid()) {
+        metrics->record(VncMetrics::PaintTime, timer.nsecsElapsed() / 1e6);
+    }
+
+    if (d->m_cursorDirty) {
+        node->updateCursorImage(window(), d->m_cursorImage);
+        d->m_cursorDirty = false;
+    }
+    QRectF cursorRect;
+    if (d->m_cursorVisible &&
+        d->m_vncVisibleRect.contains(d->m_cursorPos.toPoint())) {
+        cursorRect = d->m_vncToItem.mapRect(
+            QRectF(d->m_cursorPos - d->m_cursorHotspot, d->m_cursorImage.size()));
+    }
+    node->updateCursorRect(cursorRect);
+    return node;
 }
 
 void VncOutput::geometryChanged(const QRectF &newGeometry,
                                 const QRectF &oldGeometry)
 {
     Q_D(VncOutput);
-    QQuickPaintedItem::geometryChanged(newGeometry, oldGeometry);
+    QQuickItem::geometryChanged(newGeometry, oldGeometry);
     d->updateMapping();
+    if (newGeometry.size() != oldGeometry.size()) {
+        d->requestDesktopSize();
+    }
+    update();
     Q_EMIT marginsChanged();
 }
 
 void VncOutput::hoverMoveEvent(QHoverEvent *event)
 {
     Q_D(VncOutput);
-    QQuickPaintedItem::hoverMoveEvent(event);
+    QQuickItem::hoverMoveEvent(event);
     d->sendMouseEvent(event->pos(), Qt::NoButton);
 }
 
 void VncOutput::inputMethodEvent(QInputMethodEvent *event)
 {
     Q_D(VncOutput);
-    qDebug() << Q_FUNC_INFO << event;
     d->sendKeyEvent(event->commitString());
 }
 
 QVariant VncOutput::inputMethodQuery(Qt::InputMethodQuery query) const
 {
-    QVariant ret = QQuickPaintedItem::inputMethodQuery(query);
+    QVariant ret = QQuickItem::inputMethodQuery(query);
     if (query == Qt::ImHints) {
         ret = int(Qt::ImhHiddenText |
                   Qt::ImhNoAutoUppercase |
@@ -324,7 +806,7 @@ void VncOutput::keyReleaseEvent(QKeyEvent *event)
 void VncOutput::mouseMoveEvent(QMouseEvent *event)
 {
     Q_D(VncOutput);
-    QQuickPaintedItem::mouseMoveEvent(event);
+    QQuickItem::mouseMoveEvent(event);
     d->sendMouseEvent(event->localPos(), event->buttons());
     event->accept();
 }
@@ -332,7 +814,7 @@ void VncOutput::mouseMoveEvent(QMouseEvent *event)
 void VncOutput::mousePressEvent(QMouseEvent *event)
 {
     Q_D(VncOutput);
-    QQuickPaintedItem::mousePressEvent(event);
+    QQuickItem::mousePressEvent(event);
     d->sendMouseEvent(event->localPos(), event->buttons());
     event->accept();
 }
@@ -340,7 +822,7 @@ void VncOutput::mousePressEvent(QMouseEvent *event)
 void VncOutput::mouseReleaseEvent(QMouseEvent *event)
 {
     Q_D(VncOutput);
-    QQuickPaintedItem::mouseReleaseEvent(event);
+    QQuickItem::mouseReleaseEvent(event);
     d->sendMouseEvent(event->localPos(), event->buttons());
     event->accept();
 }
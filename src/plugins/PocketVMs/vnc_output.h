@@ -22,14 +22,14 @@
 
 #include "vnc_client.h"
 
-#include <QQuickPaintedItem>
+#include <QQuickItem>
 #include <QScopedPointer>
 #include <QSizeF>
 
 namespace LomiriVNC {
 
 class VncOutputPrivate;
-class VncOutput: public QQuickPaintedItem
+class VncOutput: public QQuickItem
 {
     Q_OBJECT
     Q_PROPERTY(VncClient *client READ client WRITE setClient NOTIFY clientChanged)
@@ -43,6 +43,19 @@ class VncOutput: public QQuickPaintedItem
     Q_PROPERTY(qreal leftMargin READ leftMargin NOTIFY marginsChanged)
     Q_PROPERTY(qreal rightMargin READ rightMargin NOTIFY marginsChanged)
     Q_PROPERTY(qreal topMargin READ topMargin NOTIFY marginsChanged)
+    /* Maximum number of pointer motion events sent per second; when 0,
+     * motion is sent at most once per displayed frame. Button changes are
+     * always sent immediately. */
+    Q_PROPERTY(int pointerRate READ pointerRate WRITE setPointerRate
+               NOTIFY pointerRateChanged)
+    Q_PROPERTY(qint64 sentPointerEvents READ sentPointerEvents
+               NOTIFY pointerStatisticsChanged)
+    Q_PROPERTY(qint64 droppedPointerEvents READ droppedPointerEvents
+               NOTIFY pointerStatisticsChanged)
+    /* Ask the guest to use the item's size, in physical pixels, as its
+     * screen size, so that there's nothing to scale */
+    Q_PROPERTY(bool autoResize READ autoResize WRITE setAutoResize
+               NOTIFY autoResizeChanged)
 
 public:
     VncOutput(QQuickItem *parent = nullptr);
@@ -66,10 +79,26 @@ public:
     qreal rightMargin() const;
     qreal topMargin() const;
 
+    void setPointerRate(int rate);
+    int pointerRate() const;
+
+    void setAutoResize(bool enabled);
+    bool autoResize() const;
+
+    qint64 sentPointerEvents() const;
+    qint64 droppedPointerEvents() const;
+    Q_INVOKABLE void resetPointerStatistics();
+
     Q_INVOKABLE QPointF itemToVnc(const QPointF &p) const;
     Q_INVOKABLE QPointF vncToItem(const QPointF &p) const;
 
-    void paint(QPainter *painter) override;
+    /* Called by the client whenever an area of the remote framebuffer
+     * changed; the rect is in VNC coordinates. */
+    void updateVncRect(const QRect &rect);
+    /* Called by the client when the cursor shape changed, or when the
+     * server moved the pointer (in VNC coordinates). */
+    void updateCursor();
+    void moveCursor(const QPoint &pos);
 
 Q_SIGNALS:
     void clientChanged();
@@ -78,8 +107,13 @@ Q_SIGNALS:
     void centerChanged();
     void remoteScreenSizeChanged();
     void marginsChanged();
+    void pointerRateChanged();
+    void pointerStatisticsChanged();
+    void autoResizeChanged();
 
 protected:
+    QSGNode *updatePaintNode(QSGNode *oldNode,
+                             UpdatePaintNodeData *data) override;
     void geometryChanged(const QRectF &newGeometry,
                          const QRectF &oldGeometry) override;
     void hoverMoveEvent(QHoverEvent *event) override;
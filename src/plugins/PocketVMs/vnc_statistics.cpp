@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vnc_statistics.h"
+
+#include <QDebug>
+#include <QMutexLocker>
+#include <QPointer>
+#include <QTimer>
+#include <algorithm>
+#include <cmath>
+
+using namespace LomiriVNC;
+
+namespace LomiriVNC {
+
+class VncStatisticsPrivate {
+    Q_DECLARE_PUBLIC(VncStatistics)
+
+public:
+    VncStatisticsPrivate(VncStatistics *q);
+    ~VncStatisticsPrivate();
+
+    void refresh();
+
+private:
+    QPointer<VncClient> m_client;
+    QTimer m_timer;
+    bool m_logging;
+    QVariantMap m_summaries[VncMetrics::MetricCount];
+    VncStatistics *q_ptr;
+};
+
+} // namespace
+
+static const char *metricNames[VncMetrics::MetricCount] = {
+    "bytes received",
+    "decode time (ms)",
+    "damage area (px)",
+    "paint time (ms)",
+    "input latency (ms)",
+};
+
+VncMetrics::VncMetrics():
+    m_users(0),
+    m_inputTime(-1)
+{
+    m_clock.start();
+    reset();
+}
+
+void VncMetrics::addUser()
+{
+    m_users.ref();
+}
+
+void VncMetrics::removeUser()
+{
+    m_users.deref();
+}
+
+void VncMetrics::record(Metric metric, double value)
+{
+    if (!isEnabled()) return;
+
+    QMutexLocker locker(&m_mutex);
+    Window &window = m_windows[metric];
+    window.samples[window.next] = value;
+    window.next = (window.next + 1) % WindowSize;
+    window.count = qMin(window.count + 1, int(WindowSize));
+}
+
+void VncMetrics::inputSent()
+{
+    if (!isEnabled()) return;
+
+    QMutexLocker locker(&m_mutex);
+    if (m_inputTime < 0) {
+        m_inputTime = m_clock.nsecsElapsed();
+    }
+}
+
+void VncMetrics::updateReceived()
+{
+    if (!isEnabled()) return;
+
+    double latency;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_inputTime < 0) return;
+        latency = (m_clock.nsecsElapsed() - m_inputTime) / 1e6;
+        m_inputTime = -1;
+    }
+    record(InputLatency, latency);
+}
+
+VncMetrics::Summary VncMetrics::summary(Metric metric) const
+{
+    double samples[WindowSize];
+    int count;
+    {
+        QMutexLocker locker(&m_mutex);
+        const Window &window = m_windows[metric];
+        count = window.count;
+        std::copy(window.samples, window.samples + count, samples);
+    }
+
+    Summary ret = { count, 0.0, 0.0, 0.0, 0.0 };
+    if (count == 0) return ret;
+
+    /* Nearest rank percentiles */
+    std::sort(samples, samples + count);
+    auto percentile = [&](double p) {
+        const int rank = int(std::ceil(p * count));
+        return samples[qBound(0, rank - 1, count - 1)];
+    };
+    ret.p50 = percentile(0.50);
+    ret.p90 = percentile(0.90);
+    ret.p99 = percentile(0.99);
+    ret.max = samples[count - 1];
+    return ret;
+}
+
+void VncMetrics::reset()
+{
+    QMutexLocker locker(&m_mutex);
+    for (Window &window: m_windows) {
+        window.count = 0;
+        window.next = 0;
+    }
+    m_inputTime = -1;
+}
+
+VncStatisticsPrivate::VncStatisticsPrivate(VncStatistics *q):
+    m_logging(false),
+    q_ptr(q)
+{
+    m_timer.setInterval(1000);
+    QObject::connect(&m_timer, &QTimer::timeout, q, [this]() { refresh(); });
+}
+
+VncStatisticsPrivate::~VncStatisticsPrivate()
+{
+    if (m_client) {
+        m_client->metrics()->removeUser();
+    }
+}
+
+void VncStatisticsPrivate::refresh()
+{
+    Q_Q(VncStatistics);
+
+    if (!m_client) return;
+
+    const VncMetrics *metrics = m_client->metrics();
+    for (int i = 0; i < VncMetrics::MetricCount; i++) {
+        const VncMetrics::Summary s =
+            metrics->summary(VncMetrics::Metric(i));
+        m_summaries[i] = QVariantMap {
+            { "count", s.count },
+            { "p50", s.p50 },
+            { "p90", s.p90 },
+            { "p99", s.p99 },
+            { "max", s.max },
+        };
+
+        if (m_logging && s.count > 0) {
+            qDebug() << "VNC statistics:" << metricNames[i] <<
+                "p50" << s.p50 << "p90" << s.p90 << "p99" << s.p99 <<
+                "max" << s.max << "samples" << s.count;
+        }
+    }
+    Q_EMIT q->updated();
+}
+
+VncStatistics::VncStatistics(QObject *parent):
+    QObject(parent),
+    d_ptr(new VncStatisticsPrivate(this))
+{
+}
+
+VncStatistics::~VncStatistics() = default;
+
+void VncStatistics::setClient(VncClient *client)
+{
+    Q_D(VncStatistics);
+    if (client == d->m_client) return;
+
+    if (d->m_client) {
+        d->m_client->metrics()->removeUser();
+    }
+    d->m_client = client;
+    if (client) {
+        client->metrics()->addUser();
+        d->m_timer.start();
+    } else {
+        d->m_timer.stop();
+    }
+    d->refresh();
+    Q_EMIT clientChanged();
+}
+
+VncClient *VncStatistics::client() const
+{
+    Q_D(const VncStatistics);
+    return d->m_client;
+}
+
+void VncStatistics::setInterval(int interval)
+{
+    Q_D(VncStatistics);
+    interval = qMax(interval, 100);
+    if (interval == d->m_timer.interval()) return;
+
+    d->m_timer.setInterval(interval);
+    Q_EMIT intervalChanged();
+}
+
+int VncStatistics::interval() const
+{
+    Q_D(const VncStatistics);
+    return d->m_timer.interval();
+}
+
+void VncStatistics::setLogging(bool logging)
+{
+    Q_D(VncStatistics);
+    if (logging == d->m_logging) return;
+
+    d->m_logging = logging;
+    Q_EMIT loggingChanged();
+}
+
+bool VncStatistics::logging() const
+{
+    Q_D(const VncStatistics);
+    return d->m_logging;
+}
+
+QVariantMap VncStatistics::bytesReceived() const
+{
+    Q_D(const VncStatistics);
+    return d->m_summaries[VncMetrics::BytesReceived];
+}
+
+QVariantMap VncStatistics::decodeTime() const
+{
+    Q_D(const VncStatistics);
+    return d->m_summaries[VncMetrics::DecodeTime];
+}
+
+QVariantMap VncStatistics::damageArea() const
+{
+    Q_D(const VncStatistics);
+    return d->m_summaries[VncMetrics::DamageArea];
+}
+
+QVariantMap VncStatistics::paintTime() const
+{
+    Q_D(const VncStatistics);
+    return d->m_summaries[VncMetrics::PaintTime];
+}
+
+QVariantMap VncStatistics::inputLatency() const
+{
+    Q_D(const VncStatistics);
+    return d->m_summaries[VncMetrics::InputLatency];
+}
+
+void VncStatistics::reset()
+{
+    Q_D(VncStatistics);
+    if (d->m_client) {
+        d->m_client->metrics()->reset();
+    }
+    d->refresh();
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOMIRIVNC_VNC_STATISTICS_H
+#define LOMIRIVNC_VNC_STATISTICS_H
+
+#include "vnc_client.h"
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QObject>
+#include <QScopedPointer>
+#include <QVariantMap>
+
+namespace LomiriVNC {
+
+/* Rolling windows of per-frame samples, owned by each VncClient. Samples
+ * are recorded from the VNC, GUI and render threads, but only while a
+ * VncStatistics object is watching the client.
+ */
+class VncMetrics
+{
+public:
+    enum Metric {
+        BytesReceived = 0, // per decoded batch of RFB messages
+        DecodeTime,        // ms spent in HandleRFBServerMessage()
+        DamageArea,        // pixels changed per frame
+        PaintTime,         // ms spent uploading a frame in VncOutput
+        InputLatency,      // ms from an input event to the next update
+        MetricCount
+    };
+
+    struct Summary {
+        int count;
+        double p50;
+        double p90;
+        double p99;
+        double max;
+    };
+
+    VncMetrics();
+
+    void addUser();
+    void removeUser();
+    bool isEnabled() const { return m_users.loadAcquire() > 0; }
+
+    void record(Metric metric, double value);
+    /* Starts measuring the input latency, unless already measuring */
+    void inputSent();
+    /* Completes the input latency measurement, if any */
+    void updateReceived();
+
+    Summary summary(Metric metric) const;
+    void reset();
+
+private:
+    enum { WindowSize = 512 };
+
+    struct Window {
+        double samples[WindowSize];
+        int count;
+        int next;
+    };
+
+    mutable QMutex m_mutex;
+    QAtomicInt m_users;
+    QElapsedTimer m_clock;
+    qint64 m_inputTime;
+    Window m_windows[MetricCount];
+};
+
+class VncStatisticsPrivate;
+class VncStatistics: public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(VncClient *client READ client WRITE setClient NOTIFY clientChanged)
+    // How often the summaries are refreshed, in milliseconds
+    Q_PROPERTY(int interval READ interval WRITE setInterval NOTIFY intervalChanged)
+    // Also write the summaries to the log at each refresh
+    Q_PROPERTY(bool logging READ logging WRITE setLogging NOTIFY loggingChanged)
+    /* Each summary is a map with the "count", "p50", "p90", "p99" and "max"
+     * of the last samples */
+    Q_PROPERTY(QVariantMap bytesReceived READ bytesReceived NOTIFY updated)
+    Q_PROPERTY(QVariantMap decodeTime READ decodeTime NOTIFY updated)
+    Q_PROPERTY(QVariantMap damageArea READ damageArea NOTIFY updated)
+    Q_PROPERTY(QVariantMap paintTime READ paintTime NOTIFY updated)
+    Q_PROPERTY(QVariantMap inputLatency READ inputLatency NOTIFY updated)
+
+public:
+    VncStatistics(QObject *parent = nullptr);
+    virtual ~VncStatistics();
+
+    void setClient(VncClient *client);
+    VncClient *client() const;
+
+    void setInterval(int interval);
+    int interval() const;
+
+    void setLogging(bool logging);
+    bool logging() const;
+
+    QVariantMap bytesReceived() const;
+    QVariantMap decodeTime() const;
+    QVariantMap damageArea() const;
+    QVariantMap paintTime() const;
+    QVariantMap inputLatency() const;
+
+    Q_INVOKABLE void reset();
+
+Q_SIGNALS:
+    void clientChanged();
+    void intervalChanged();
+    void loggingChanged();
+    void updated();
+
+private:
+    Q_DECLARE_PRIVATE(VncStatistics)
+    QScopedPointer<VncStatisticsPrivate> d_ptr;
+};
+
+} // namespace
+
+#endif // LOMIRIVNC_VNC_STATISTICS_H
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "vnc_texture.h"
+
+#include <QDebug>
+#include <QOpenGLContext>
+
+#ifndef GL_UNPACK_ROW_LENGTH
+#define GL_UNPACK_ROW_LENGTH 0x0CF2
+#endif
+#ifndef GL_BGRA
+#define GL_BGRA 0x80E1
+#endif
+
+using namespace LomiriVNC;
+
+VncTexture::VncTexture():
+    m_id(0),
+    m_format({ GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, 4 }),
+    m_imageFormat(QImage::Format_Invalid),
+    m_hasRowLength(false),
+    m_hasBgra(false)
+{
+    initializeOpenGLFunctions();
+
+    /* GLES2 can only upload whole rows; GLES3 and desktop GL can upload
+     * sub-rectangles of the image directly */
+    QOpenGLContext *context = QOpenGLContext::currentContext();
+    m_hasRowLength = !context->isOpenGLES() ||
+        context->format().majorVersion() >= 3 ||
+        context->hasExtension(QByteArrayLiteral("GL_EXT_unpack_subimage"));
+    m_hasBgra = !context->isOpenGLES() ||
+        context->hasExtension(QByteArrayLiteral("GL_EXT_texture_format_BGRA8888"));
+
+    glGenTextures(1, &m_id);
+}
+
+VncTexture::~VncTexture()
+{
+    if (m_id) {
+        glDeleteTextures(1, &m_id);
+    }
+}
+
+int VncTexture::textureId() const
+{
+    return m_id;
+}
+
+QSize VncTexture::textureSize() const
+{
+    return m_size;
+}
+
+bool VncTexture::hasAlphaChannel() const
+{
+    return false;
+}
+
+bool VncTexture::hasMipmaps() const
+{
+    return false;
+}
+
+void VncTexture::bind()
+{
+    glBindTexture(GL_TEXTURE_2D, m_id);
+    updateBindOptions();
+}
+
+bool VncTexture::pixelFormat(QImage::Format format, PixelFormat *out) const
+{
+    switch (format) {
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+        *out = { GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, 4 };
+        return true;
+    case QImage::Format_RGB16:
+        *out = { GL_RGB, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, 2 };
+        return true;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+        if (!m_hasBgra) return false;
+        /* GLES wants the internal format to match the pixel format */
+        *out = {
+            QOpenGLContext::currentContext()->isOpenGLES() ? GL_BGRA : GL_RGBA,
+            GL_BGRA, GL_UNSIGNED_BYTE, 4
+        };
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+void VncTexture::upload(const QImage &image, const QRegion &dirty)
+{
+    if (Q_UNLIKELY(image.isNull())) return;
+
+    glBindTexture(GL_TEXTURE_2D, m_id);
+
+    if (image.size() != m_size || image.format() != m_imageFormat) {
+        m_size = image.size();
+        m_imageFormat = image.format();
+        /* Formats without a direct upload path are converted to RGBX8888 */
+        if (!pixelFormat(m_imageFormat, &m_format)) {
+            pixelFormat(QImage::Format_RGBX8888, &m_format);
+        }
+        glTexImage2D(GL_TEXTURE_2D, 0, m_format.internalFormat,
+                     m_size.width(), m_size.height(), 0,
+                     m_format.format, m_format.type, nullptr);
+        updateBindOptions(true);
+        uploadRect(image, image.rect());
+        return;
+    }
+
+    if (dirty.isEmpty()) {
+        uploadRect(image, image.rect());
+        return;
+    }
+
+    const QRect imageRect = image.rect();
+    if (m_hasRowLength) {
+        for (const QRect &rect: dirty) {
+            uploadRect(image, rect.intersected(imageRect));
+        }
+    } else {
+        /* Whole rows are contiguous in memory: upload full-width strips
+         * covering the damaged rects */
+        QRegion rows;
+        for (const QRect &rect: dirty) {
+            rows += QRect(0, rect.y(), m_size.width(), rect.height());
+        }
+        for (const QRect &rect: rows) {
+            uploadRect(image, rect.intersected(imageRect));
+        }
+    }
+}
+
+void VncTexture::uploadRect(const QImage &image, const QRect &rect)
+{
+    if (rect.isEmpty()) return;
+
+    PixelFormat format;
+    if (!pixelFormat(image.format(), &format)) {
+        const QImage converted =
+            image.copy(rect).convertToFormat(QImage::Format_RGBX8888);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(),
+                        rect.width(), rect.height(),
+                        m_format.format, m_format.type, converted.constBits());
+        return;
+    }
+
+    /* With the default GL_UNPACK_ALIGNMENT of 4, GL expects the same row
+     * padding as QImage uses for the images it allocates */
+    const int bpp = format.bytesPerPixel;
+    const int alignedRow = (image.width() * bpp + 3) & ~3;
+    const bool fullRows = rect.x() == 0 && rect.width() == image.width() &&
+        image.bytesPerLine() == alignedRow;
+    if (fullRows) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, rect.y(),
+                        rect.width(), rect.height(),
+                        format.format, format.type,
+                        image.constScanLine(rect.y()));
+    } else if (m_hasRowLength && image.bytesPerLine() % bpp == 0) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, image.bytesPerLine() / bpp);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(),
+                        rect.width(), rect.height(),
+                        format.format, format.type,
+                        image.constScanLine(rect.y()) + rect.x() * bpp);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    } else {
+        const QImage copy = image.copy(rect);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x(), rect.y(),
+                        rect.width(), rect.height(),
+                        format.format, format.type, copy.constBits());
+    }
+}
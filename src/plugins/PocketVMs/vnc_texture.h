@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2021  Alfred Neumayer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3.
+ *
+ * pvms is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOMIRIVNC_VNC_TEXTURE_H
+#define LOMIRIVNC_VNC_TEXTURE_H
+
+#include <QImage>
+#include <QOpenGLFunctions>
+#include <QRegion>
+#include <QSGTexture>
+#include <QSize>
+
+namespace LomiriVNC {
+
+/* A GL texture which persists across frames and mirrors the remote
+ * framebuffer. Only the damaged parts of the image are uploaded again.
+ * Must be created, updated and destroyed on the scene graph render thread.
+ */
+class VncTexture: public QSGTexture, protected QOpenGLFunctions
+{
+public:
+    VncTexture();
+    ~VncTexture();
+
+    int textureId() const override;
+    QSize textureSize() const override;
+    bool hasAlphaChannel() const override;
+    bool hasMipmaps() const override;
+    void bind() override;
+
+    /* Uploads the `dirty` area of `image`; the whole image is uploaded if
+     * the region is empty or if the texture size changed. */
+    void upload(const QImage &image, const QRegion &dirty);
+
+private:
+    struct PixelFormat {
+        GLint internalFormat;
+        GLenum format;
+        GLenum type;
+        int bytesPerPixel;
+    };
+
+    bool pixelFormat(QImage::Format format, PixelFormat *out) const;
+    void uploadRect(const QImage &image, const QRect &rect);
+
+    GLuint m_id;
+    QSize m_size;
+    PixelFormat m_format;
+    QImage::Format m_imageFormat;
+    bool m_hasRowLength;
+    bool m_hasBgra;
+};
+
+} // namespace
+
+#endif // LOMIRIVNC_VNC_TEXTURE_H
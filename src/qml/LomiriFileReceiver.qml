@@ -87,7 +87,7 @@ Item {
 
                         onClicked: {
                             for (var i = 0; i < importItems.length; i++) {
-                                machine.importIntoShare(importItems[i].url)
+                                VMManager.importIntoShare(machine, importItems[i].url)
                             }
                             PopupUtils.close(contentHubDialogue);
                         }
@@ -83,6 +83,13 @@ MainView {
     }
     function reconnect(machine, vncClient) {
         const socket = machine.storage + "/vnc.sock";
+        vncClient.displayBus = machine.usesLocalDisplay() ? machine.getDisplayBusAddress() : "";
+        vncClient.encodings = machine.vncEncodings;
+        vncClient.compressLevel = machine.vncCompressLevel;
+        vncClient.qualityLevel = machine.vncQualityLevel;
+        vncClient.lowColorDepth = machine.vncLowColorDepth;
+        vncClient.clipboardSharing = machine.shareClipboard;
+        vncClient.recordFile = machine.recordDisplay ? machine.storage + "/display.rfb" : "";
         vncClient.connectToServer(socket, "");
     }
 
@@ -182,6 +189,27 @@ MainView {
                     property Machine machine : isRegisteredMachine(modelData.storage) ?
                                                    getRegisteredMachine(modelData.storage) :
                                                    VMManager.fromQml(modelData);
+                    // Latest file imported into the shared folder
+                    property string importFile: ""
+                    property int importProgress: 0
+                    property bool importFailed: false
+
+                    Connections {
+                        target: VMManager
+                        onImportProgress: {
+                            if (storage !== machine.storage)
+                                return
+                            importFile = fileName
+                            importProgress = progress
+                            importFailed = false
+                        }
+                        onImportFinished: {
+                            if (storage !== machine.storage)
+                                return
+                            importFile = fileName
+                            importFailed = !success
+                        }
+                    }
 
                     leadingActions: ListItemActions {
                         actions: [
@@ -191,6 +219,14 @@ MainView {
                                 onTriggered: {
                                     PopupUtils.open(deleteDialog, null, {machine: machine});
                                 }
+                            },
+                            Action {
+                                iconName: "edit-copy"
+                                text: i18n.tr("Clone")
+                                visible: machine.isTemplate
+                                onTriggered: {
+                                    VMManager.cloneVM(machine, i18n.tr("%1 (clone)").arg(machine.name))
+                                }
                             }
                         ]
                     }
@@ -203,7 +239,18 @@ MainView {
 
                     ListItemLayout {
                         title.text: machine.name
-                        summary.text: machine.arch + ", " + machine.cores + " cores, " + machine.mem + "MB RAM"
+                        summary.text: machine.arch + ", " + machine.cores + " cores, " + machine.mem + "MB RAM" +
+                                      (machine.isTemplate ? ", " + i18n.tr("template") :
+                                       machine.backingFile !== "" ? ", " + i18n.tr("linked clone") : "") +
+                                      (machine.hasSavedState ? ", " + i18n.tr("suspended") : "") +
+                                      (VMManager.importingVMs.indexOf(machine.storage) >= 0 ?
+                                           "\n" + i18n.tr("Importing %1, %2%").arg(importFile).arg(importProgress) :
+                                       importFailed ? "\n" + i18n.tr("Failed to import %1").arg(importFile) : "") +
+                                      (machine.monitor.active ? "\n" + i18n.tr("%1% CPU, %2MB in use, disk %3/%4 kB/s")
+                                                                    .arg(machine.monitor.cpuUsage.toFixed(0))
+                                                                    .arg((machine.monitor.rss / (1024 * 1024)).toFixed(0))
+                                                                    .arg((machine.monitor.diskReadRate / 1024).toFixed(0))
+                                                                    .arg((machine.monitor.diskWriteRate / 1024).toFixed(0)) : "")
 
                         Icon {
                             id: icon
@@ -242,20 +289,14 @@ MainView {
                         Qt.inputMethod.show()
                 }
 
-                Timer {
-                    id: delayedReconnect
-                    onTriggered: reconnect(vmDetails.machine, vncClient)
-                    interval: 500
-                    repeat: !vncClient.connected
-                }
-
                 Connections {
                     target: machine
                     onStarted: {
                         starting = false
                         registerMachine(machine)
+                        // VncClient waits for QEMU's socket itself
                         if (!machine.externalWindowOnly)
-                            delayedReconnect.start()
+                            reconnect(machine, vncClient)
                     }
                     onStopped: {
                         starting = false
@@ -273,12 +314,15 @@ MainView {
                 Component.onCompleted: {
                     if (machine.running && !machine.externalWindowOnly) {
                         reconnect(machine, vncClient)
+                    } else if (!machine.running) {
+                        VMManager.prewarmVM(machine)
                     }
                 }
 
                 Component.onDestruction: {
                     root.fullscreenMode = false
-                    delayedReconnect.stop()
+                    // Unless it was started meanwhile
+                    machine.coolDown()
                 }
 
                 header: PageHeader {
@@ -300,11 +344,18 @@ MainView {
                             },
                             Action {
                                 iconName: !machine.running ? "media-playback-start" : "media-playback-stop"
-                                text: !machine.running ? i18n.tr("Start") : i18n.tr("Stop")
-                                enabled: !starting
+                                text: queued ? i18n.tr("Cancel start") :
+                                      !machine.running ? i18n.tr("Start") :
+                                      !machine.stopping ? i18n.tr("Stop") : i18n.tr("Force stop")
+                                enabled: (!starting || queued) && !machine.isTemplate &&
+                                         VMManager.maintainedVMs.indexOf(machine.storage) < 0
+                                readonly property bool queued: VMManager.queuedVMs.indexOf(machine.storage) >= 0
                                 onTriggered: {
-                                    if (!machine.running) {
-                                        starting = machine.start()
+                                    if (queued) {
+                                        VMManager.cancelStartVM(machine)
+                                        starting = false
+                                    } else if (!machine.running) {
+                                        starting = VMManager.startVM(machine)
                                     } else {
                                         vncClient.disconnect();
                                         machine.stop()
@@ -312,6 +363,13 @@ MainView {
                                     }
                                 }
                             },
+                            Action {
+                                iconName: "system-shutdown"
+                                text: i18n.tr("Shut down")
+                                visible: machine.running
+                                enabled: machine.status === "running" && !machine.stopping
+                                onTriggered: machine.powerdown()
+                            },
                             Action {
                                 iconName: "terminal-app-symbolic"
                                 text: i18n.tr("Serial console")
@@ -338,6 +396,13 @@ MainView {
                                 onTriggered: {
                                     focusForOsk()
                                 }
+                            },
+                            Action {
+                                iconName: "edit-paste"
+                                text: i18n.tr("Type clipboard")
+                                enabled: vncClient.connected && Clipboard.data.text !== ""
+                                visible: !machine.externalWindowOnly && machine.running
+                                onTriggered: vncClient.sendText(Clipboard.data.text)
                             }
                         ]
                         numberOfSlots: 5
@@ -513,6 +578,7 @@ MainView {
                         bottom: parent.bottom
                     }
                     visible: machine.running && !machine.externalWindowOnly
+                    autoResize: machine.autoResize
                 }
                 QMLTermWidget {
                     id: serialConnection
@@ -616,6 +682,32 @@ MainView {
                     i18n.tr("x86_64 (%1)".arg(VMManager.canVirtualize(supportedArchitectures[1]) ? "fast" : "slow"))
                 ]
 
+                property var supportedDiskProfiles : [
+                    "default",
+                    "balanced",
+                    "performance",
+                    "safe"
+                ]
+
+                property var supportedDiskProfilesReadable : [
+                    i18n.tr("Default"),
+                    i18n.tr("Balanced"),
+                    i18n.tr("Performance"),
+                    i18n.tr("Safe")
+                ]
+
+                property var supportedRamBackends : [
+                    "default",
+                    "memfd",
+                    "hugepages"
+                ]
+
+                property var supportedRamBackendsReadable : [
+                    i18n.tr("Default"),
+                    i18n.tr("Shared memory"),
+                    i18n.tr("Huge pages")
+                ]
+
                 property bool creating : false
                 property var activeTransfer
                 property string isoFileUrl : !editMode ? "" : existingMachine.dvd
@@ -628,6 +720,11 @@ MainView {
                 }
 
                 Component.onCompleted: {
+                    // The disk buttons need the image, which a prewarmed
+                    // QEMU holds, and saving cools it down anyway
+                    if (editMode)
+                        existingMachine.coolDown()
+
                     // Ubuntu Touch
                     if (!legacy) {
                         filePicker = lomiriFilePicker.createObject(root)
@@ -673,12 +770,23 @@ MainView {
                                                 externalWindowOnlyCheckbox.enabled &&
                                                 externalWindowOnlyCheckbox.checked;
                                         newMachine.enableVirtualization = virtualizationCheckbox.checked;
-
-                                        if (VMManager.createVM(newMachine)) {
-                                            VMManager.refreshVMs();
-                                            addVm.pageStack.removePages(addVm)
-                                            selectedMachinePage = null
-                                        }
+                                        newMachine.localDisplay = localDisplayCheckbox.checked;
+                                        newMachine.vncLowColorDepth = lowColorDepthCheckbox.checked;
+                                        newMachine.fastResume = fastResumeCheckbox.checked;
+                                        newMachine.autoBalloon = autoBalloonCheckbox.checked;
+                                        newMachine.diskProfile = supportedDiskProfiles[diskProfile.selectedIndex]
+                                        newMachine.pinVcpus = pinVcpusCheckbox.checked;
+                                        newMachine.cpuAffinity = cpuAffinity.text;
+                                        newMachine.ramBackend = supportedRamBackends[ramBackend.selectedIndex]
+                                        newMachine.preallocRam = preallocRamCheckbox.checked;
+                                        newMachine.shareClipboard = shareClipboardCheckbox.checked;
+                                        newMachine.autoResize = autoResizeCheckbox.checked;
+                                        newMachine.recordDisplay = recordDisplayCheckbox.checked;
+                                        newMachine.prewarm = prewarmCheckbox.checked;
+
+                                        // Finishes in onVmCreated
+                                        if (!VMManager.createVM(newMachine))
+                                            creating = false
                                     } else {
                                         existingMachine.name = description.text
                                         existingMachine.cores = coresSlider.value.toFixed(0)
@@ -690,6 +798,20 @@ MainView {
                                                 externalWindowOnlyCheckbox.enabled &&
                                                 externalWindowOnlyCheckbox.checked;
                                         existingMachine.enableVirtualization = virtualizationCheckbox.checked;
+                                        existingMachine.localDisplay = localDisplayCheckbox.checked;
+                                        existingMachine.vncLowColorDepth = lowColorDepthCheckbox.checked;
+                                        existingMachine.fastResume = fastResumeCheckbox.checked;
+                                        existingMachine.autoBalloon = autoBalloonCheckbox.checked;
+                                        existingMachine.diskProfile = supportedDiskProfiles[diskProfile.selectedIndex]
+                                        existingMachine.pinVcpus = pinVcpusCheckbox.checked;
+                                        existingMachine.cpuAffinity = cpuAffinity.text;
+                                        existingMachine.ramBackend = supportedRamBackends[ramBackend.selectedIndex]
+                                        existingMachine.preallocRam = preallocRamCheckbox.checked;
+                                        existingMachine.shareClipboard = shareClipboardCheckbox.checked;
+                                        existingMachine.autoResize = autoResizeCheckbox.checked;
+                                        existingMachine.recordDisplay = recordDisplayCheckbox.checked;
+                                        existingMachine.prewarm = prewarmCheckbox.checked;
+                                        existingMachine.isTemplate = templateCheckbox.checked;
 
                                         if (VMManager.editVM(existingMachine)) {
                                             VMManager.refreshVMs();
@@ -707,12 +829,42 @@ MainView {
                     filePicker.open()
                 }
 
+                Connections {
+                    target: VMManager
+                    onVmCreationProgress: {
+                        if (creating && storage === newMachine.storage)
+                            creatingProgress.value = progress
+                    }
+                    onVmCreated: {
+                        if (!creating || storage !== newMachine.storage)
+                            return
+                        creating = false
+                        if (success) {
+                            addVm.pageStack.removePages(addVm)
+                            selectedMachinePage = null
+                        }
+                    }
+                }
+
                 ActivityIndicator {
                     id: creatingActivity
                     running: creating
                     anchors.centerIn: parent
                 }
 
+                ProgressBar {
+                    id: creatingProgress
+                    visible: creating
+                    minimumValue: 0
+                    maximumValue: 100
+                    value: 0
+                    anchors {
+                        top: creatingActivity.bottom
+                        topMargin: typicalMargin
+                        horizontalCenter: parent.horizontalCenter
+                    }
+                }
+
                 Flickable {
                     id: addVmFlickable
                     width: parent.width
@@ -769,6 +921,13 @@ MainView {
                             Label {
                                 text: i18n.tr("RAM: ") + memSlider.value.toFixed(0) + i18n.tr("MB")
                             }
+                            Label {
+                                visible: VMManager.committedRam > 0
+                                textSize: Label.Small
+                                text: i18n.tr("Running VMs use %1 of %2 MB and %3 of %4 cores")
+                                        .arg(VMManager.committedRam).arg(VMManager.ramBudget)
+                                        .arg(VMManager.committedCores).arg(VMManager.coreBudget)
+                            }
 
                             Slider {
                                 id: memSlider
@@ -784,6 +943,27 @@ MainView {
                             }
                         }
 
+                        OptionSelector {
+                            id: ramBackend
+                            text: i18n.tr("Memory backing")
+                            model: supportedRamBackendsReadable
+                            selectedIndex: !editMode ? 0 : Math.max(0, supportedRamBackends.indexOf(existingMachine.ramBackend))
+                        }
+
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: preallocRamCheckbox
+                                checked: editMode ? existingMachine.preallocRam : false
+                                anchors.verticalCenter: preallocRamHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: preallocRamHint
+                                title.text: i18n.tr("Preallocate memory")
+                                summary.text: i18n.tr("Slower start, no page faults while running")
+                            }
+                        }
+
                         Column {
                             width: parent.width
                             visible: !editMode
@@ -801,6 +981,13 @@ MainView {
                             }
                         }
 
+                        OptionSelector {
+                            id: diskProfile
+                            text: i18n.tr("Disk performance")
+                            model: supportedDiskProfilesReadable
+                            selectedIndex: !editMode ? 0 : Math.max(0, supportedDiskProfiles.indexOf(existingMachine.diskProfile))
+                        }
+
                         Column {
                             width: parent.width
                             spacing: typicalMargin
@@ -856,6 +1043,34 @@ MainView {
                             }
                         }
 
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: localDisplayCheckbox
+                                checked: editMode ? existingMachine.localDisplay : false
+                                anchors.verticalCenter: localDisplayHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: localDisplayHint
+                                title.text: i18n.tr("Shared memory display")
+                                summary.text: i18n.tr("Faster screen updates without 3D graphics")
+                            }
+                        }
+
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: lowColorDepthCheckbox
+                                checked: editMode ? existingMachine.vncLowColorDepth : false
+                                anchors.verticalCenter: lowColorDepthHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: lowColorDepthHint
+                                title.text: i18n.tr("Reduced colors")
+                                summary.text: i18n.tr("Halves the screen bandwidth with 16-bit colors")
+                            }
+                        }
+
                         Row {
                             width: parent.width
                             Switch {
@@ -869,6 +1084,64 @@ MainView {
                                 summary.text: i18n.tr("Accessible via the virtiofs mount tag 'pocketvms'")
                             }
                         }
+
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: shareClipboardCheckbox
+                                checked: editMode ? existingMachine.shareClipboard : false
+                                anchors.verticalCenter: shareClipboardHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: shareClipboardHint
+                                title.text: i18n.tr("Share clipboard")
+                                summary.text: i18n.tr("Needs spice-vdagent in the VM")
+                            }
+                        }
+
+                        Row {
+                            width: parent.width
+                            visible: !(externalWindowOnlyCheckbox.enabled && externalWindowOnlyCheckbox.checked)
+                            Switch {
+                                id: autoResizeCheckbox
+                                checked: editMode ? existingMachine.autoResize : false
+                                anchors.verticalCenter: autoResizeHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: autoResizeHint
+                                title.text: i18n.tr("Match screen resolution")
+                                summary.text: i18n.tr("The VM's display follows the size of the phone's screen")
+                            }
+                        }
+
+                        Row {
+                            width: parent.width
+                            visible: !(externalWindowOnlyCheckbox.enabled && externalWindowOnlyCheckbox.checked)
+                            Switch {
+                                id: recordDisplayCheckbox
+                                checked: editMode ? existingMachine.recordDisplay : false
+                                anchors.verticalCenter: recordDisplayHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: recordDisplayHint
+                                title.text: i18n.tr("Record display")
+                                summary.text: i18n.tr("Saves what the VM shows to display.rfb, to analyze display lag")
+                            }
+                        }
+
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: prewarmCheckbox
+                                checked: editMode ? existingMachine.prewarm : false
+                                anchors.verticalCenter: prewarmHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: prewarmHint
+                                title.text: i18n.tr("Prewarm")
+                                summary.text: i18n.tr("Launches the VM paused while its page is open, so that it starts faster")
+                            }
+                        }
                         
                         Row {
                             width: parent.width
@@ -892,6 +1165,73 @@ MainView {
                             }
                         }
 
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: pinVcpusCheckbox
+                                checked: editMode ? existingMachine.pinVcpus : false
+                                anchors.verticalCenter: pinVcpusHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: pinVcpusHint
+                                title.text: i18n.tr("Use performance cores")
+                                summary.text: i18n.tr("Keeps the VM off the phone's efficiency cores")
+                            }
+                        }
+
+                        TextField {
+                            id: cpuAffinity
+                            visible: pinVcpusCheckbox.checked
+                            placeholderText: i18n.tr("Host CPUs, e.g. 4-7 (automatic if empty)")
+                            width: parent.width
+                            inputMethodHints: Qt.ImhNoPredictiveText
+                            text: !editMode ? "" : existingMachine.cpuAffinity
+                        }
+
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: autoBalloonCheckbox
+                                checked: editMode ? existingMachine.autoBalloon : false
+                                anchors.verticalCenter: autoBalloonHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: autoBalloonHint
+                                title.text: i18n.tr("Share memory with the phone")
+                                summary.text: i18n.tr("Shrinks the VM while the phone runs low on memory")
+                            }
+                        }
+
+                        Row {
+                            width: parent.width
+                            Switch {
+                                id: fastResumeCheckbox
+                                checked: editMode ? existingMachine.fastResume : false
+                                anchors.verticalCenter: fastResumeHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: fastResumeHint
+                                title.text: i18n.tr("Resume where it was stopped")
+                                summary.text: i18n.tr("Saves the VM state instead of shutting down, not with file sharing")
+                            }
+                        }
+
+                        Row {
+                            width: parent.width
+                            visible: editMode
+                            Switch {
+                                id: templateCheckbox
+                                checked: editMode ? existingMachine.isTemplate : false
+                                enabled: editMode && !VMManager.hasClones(existingMachine)
+                                anchors.verticalCenter: templateHint.verticalCenter
+                            }
+                            ListItemLayout {
+                                id: templateHint
+                                title.text: i18n.tr("Use as template")
+                                summary.text: i18n.tr("Read-only base for linked clones")
+                            }
+                        }
+
                         Column {
                             width: parent.width
                             spacing: typicalMargin
@@ -913,6 +1253,81 @@ MainView {
                                 }
                             }
                         }
+
+                        Column {
+                            id: diskMaintenance
+                            width: parent.width
+                            spacing: typicalMargin
+                            visible: editMode
+
+                            readonly property bool busy: editMode &&
+                                                         VMManager.maintainedVMs.indexOf(existingMachine.storage) >= 0
+                            property var info: editMode ? VMManager.diskInfo(existingMachine) : ({})
+
+                            function formatSize(bytes) {
+                                return (bytes / (1024 * 1024 * 1024)).toFixed(1) + i18n.tr("GB")
+                            }
+
+                            Connections {
+                                target: VMManager
+                                onDiskMaintenanceProgress: {
+                                    if (editMode && storage === existingMachine.storage)
+                                        diskMaintenanceProgress.value = progress
+                                }
+                                onDiskMaintenanceFinished: {
+                                    if (!editMode || storage !== existingMachine.storage)
+                                        return
+                                    diskMaintenance.info = VMManager.diskInfo(existingMachine)
+                                    diskMaintenanceProgress.value = 0
+                                }
+                            }
+
+                            Label {
+                                text: i18n.tr("Disk maintenance")
+                            }
+                            Label {
+                                width: parent.width
+                                wrapMode: Text.WordWrap
+                                visible: diskMaintenance.info.hddActualSize !== undefined
+                                text: i18n.tr("%1 used of %2").arg(diskMaintenance.formatSize(diskMaintenance.info.hddActualSize))
+                                                                .arg(diskMaintenance.formatSize(diskMaintenance.info.hddVirtualSize)) +
+                                      (diskMaintenance.info.hddChecked === undefined ? "" :
+                                       ", " + i18n.tr("%1 corruptions, %2 leaked clusters").arg(diskMaintenance.info.hddCorruptions)
+                                                                                            .arg(diskMaintenance.info.hddLeaks)) +
+                                      (diskMaintenance.info.hddReclaimed === undefined ? "" :
+                                       ", " + i18n.tr("%1 reclaimed").arg(diskMaintenance.formatSize(diskMaintenance.info.hddReclaimed)))
+                            }
+                            Row {
+                                width: parent.width
+                                Button {
+                                    text: i18n.tr("Check")
+                                    width: parent.width / 3
+                                    enabled: !diskMaintenance.busy && !existingMachine.running && !existingMachine.warm
+                                    onClicked: VMManager.checkDisk(existingMachine)
+                                }
+                                Button {
+                                    text: i18n.tr("Compact")
+                                    width: parent.width / 3
+                                    enabled: !diskMaintenance.busy && !existingMachine.running && !existingMachine.warm
+                                    onClicked: VMManager.compactDisk(existingMachine, false)
+                                }
+                                Button {
+                                    text: i18n.tr("Compress")
+                                    width: parent.width / 3
+                                    enabled: !diskMaintenance.busy && !existingMachine.running && !existingMachine.warm
+                                    onClicked: VMManager.compactDisk(existingMachine, true)
+                                }
+                            }
+                            ProgressBar {
+                                id: diskMaintenanceProgress
+                                width: parent.width
+                                visible: diskMaintenance.busy
+                                indeterminate: value === 0
+                                minimumValue: 0
+                                maximumValue: 100
+                                value: 0
+                            }
+                        }
                     }
                 }
 